@@ -40,6 +40,72 @@ module Zinc
   TK_CLASS   = :class
   TK_ARRAY   = :array
   TK_HASH    = :hash
+  TK_ROPE    = :rope
+  TK_HEAP    = :heap
+  TK_DEQUE   = :deque
+  TK_BITSET  = :bitset
+  TK_ORDERED_MAP = :ordered_map
+  TK_TRIE    = :trie
+  TK_LRU_CACHE = :lru_cache
+  TK_SORTED_INDEX = :sorted_index
+  TK_MATRIX  = :matrix
+  TK_SLOT_MAP = :slot_map
+  TK_CONCURRENT_HASH = :concurrent_hash
+  TK_ATOMIC_INT = :atomic_int
+  TK_ATOMIC_BOOL = :atomic_bool
+  TK_MUTEX   = :mutex
+  TK_RWLOCK  = :rwlock
+  TK_ONCE    = :once
+  TK_BARRIER = :barrier
+  TK_SHARED  = :shared
+
+  # Builtin reference-counted runtime types, mapped to the prefix of their
+  # runtime retain/release functions (__zn_str_retain, __zn_arr_release, ...)
+  RC_RUNTIME_PREFIX = {
+    TK_STRING => 'zn_str',
+    TK_ARRAY  => 'zn_arr',
+    TK_HASH   => 'zn_hash',
+    TK_ROPE   => 'zn_rope',
+    TK_HEAP   => 'zn_heap',
+    TK_DEQUE  => 'zn_deque',
+    TK_BITSET => 'zn_bitset',
+    TK_ORDERED_MAP => 'zn_omap',
+    TK_TRIE   => 'zn_trie',
+    TK_LRU_CACHE => 'zn_lru',
+    TK_SORTED_INDEX => 'zn_sidx',
+    TK_MATRIX => 'zn_mat',
+    TK_SLOT_MAP => 'zn_slotmap',
+    TK_CONCURRENT_HASH => 'zn_chash',
+    TK_ATOMIC_INT => 'zn_atomic',
+    TK_ATOMIC_BOOL => 'zn_atomic',
+    TK_MUTEX => 'zn_mutex',
+    TK_RWLOCK => 'zn_rwlock',
+    TK_ONCE => 'zn_once',
+    TK_BARRIER => 'zn_barrier',
+    TK_SHARED => 'zn_shared',
+  }.freeze
+
+  # Synchronization types: shared handles without a length
+  SYNC_KINDS = [TK_ATOMIC_INT, TK_ATOMIC_BOOL, TK_MUTEX, TK_RWLOCK, TK_ONCE, TK_BARRIER].freeze
+
+  # Shared handles whose runtime calls take a non-const pointer (locking,
+  # atomics, pinning, copying), so parameters of these kinds are not const
+  HANDLE_KINDS = [*SYNC_KINDS, TK_CONCURRENT_HASH, TK_SHARED, TK_MATRIX].freeze
+
+  # Reference-counted kinds: runtime types plus user classes
+  def self.ref_kind?(kind)
+    kind == TK_CLASS || RC_RUNTIME_PREFIX.key?(kind)
+  end
+
+  # Runtime types boxed as plain pointers (all but String)
+  def self.runtime_ptr_kind?(kind)
+    kind != TK_STRING && RC_RUNTIME_PREFIX.key?(kind)
+  end
+
+  # Runtime types with a _len field, read by .length
+  def self.sized_kind?(kind)
+    RC_RUNTIME_PREFIX.key?(kind) && !SYNC_KINDS.include?(kind) && kind != TK_SHARED
+  end
 
   # Resolved type representation
   class Type
@@ -151,6 +217,24 @@ module Zinc
         when TK_BOOL   then print 'bool'
         when TK_CHAR   then print 'char'
         when TK_VOID   then print 'void'
+        when TK_ROPE   then print 'Rope'
+        when TK_BITSET then print 'Bitset'
+        when TK_MATRIX then print 'Matrix'
+        when *SYNC_KINDS
+          print({ TK_ATOMIC_INT => 'AtomicInt', TK_ATOMIC_BOOL => 'AtomicBool', TK_MUTEX => 'Mutex',
+                  TK_RWLOCK => 'RwLock', TK_ONCE => 'Once', TK_BARRIER => 'Barrier' }[ti.kind])
+        when TK_HEAP, TK_DEQUE, TK_TRIE, TK_SORTED_INDEX, TK_SLOT_MAP, TK_SHARED
+          print({ TK_HEAP => 'Heap<', TK_DEQUE => 'Deque<', TK_TRIE => 'Trie<', TK_SORTED_INDEX => 'SortedIndex<',
+                  TK_SLOT_MAP => 'SlotMap<', TK_SHARED => 'Shared<' }[ti.kind])
+          print_type_info(ti.elem) if ti.elem
+          print '>'
+        when TK_ORDERED_MAP, TK_LRU_CACHE, TK_CONCURRENT_HASH
+          print({ TK_ORDERED_MAP => 'OrderedMap<', TK_LRU_CACHE => 'LruCache<',
+                  TK_CONCURRENT_HASH => 'ConcurrentHash<' }[ti.kind])
+          print_type_info(ti.key) if ti.key
+          print ', '
+          print_type_info(ti.elem) if ti.elem
+          print '>'
         when TK_STRUCT
           print(ti.name || 'struct')
         when TK_CLASS
@@ -263,11 +347,15 @@ module Zinc
       end
     end
 
+    # global: the GlobalDecl the name refers to; by_ref: the name is an
+    # inout parameter, reached through a pointer. Both set by Semantic.
     class Ident < Node
-      attr_accessor :name
+      attr_accessor :name, :global, :by_ref
       def initialize(name)
         super()
         @name = name
+        @global = nil
+        @by_ref = false
       end
 
       def print_ast(indent = 0)
@@ -277,16 +365,17 @@ module Zinc
     end
 
     class Param < Node
-      attr_accessor :name, :type_info
+      attr_accessor :name, :type_info, :is_inout
       def initialize(name, type_info)
         super()
         @name = name
         @type_info = type_info
+        @is_inout = false
       end
 
       def print_ast(indent = 0)
         indent_print(indent)
-        print "Param: #{@name}: "
+        print "Param: #{@is_inout ? 'inout ' : ''}#{@name}: "
         print_type_info(@type_info)
         puts
       end
@@ -393,6 +482,31 @@ module Zinc
       end
     end
 
+    # Top-level var or let; a threadlocal var has one copy per thread.
+    # Semantic sets const_value when the initializer folds to a constant
+    # (is_static then means it is emitted as a C static initializer), and
+    # init_uses to the main-thread globals the initializer reaches.
+    class GlobalDecl < Node
+      attr_accessor :name, :value, :is_const, :is_threadlocal, :is_static, :const_value, :init_uses
+      def initialize(name, value, is_const, is_threadlocal)
+        super()
+        @name = name
+        @value = value
+        @is_const = is_const
+        @is_threadlocal = is_threadlocal
+        @is_static = false
+        @const_value = nil
+        @init_uses = []
+      end
+
+      def print_ast(indent = 0)
+        indent_print(indent)
+        kind = @is_threadlocal ? 'ThreadLocalVar' : (@is_const ? 'GlobalLet' : 'GlobalVar')
+        puts "#{kind}: #{@name}"
+        @value.print_ast(indent + 1)
+      end
+    end
+
     class If < Node
       attr_accessor :cond, :then_b, :else_b
       def initialize(cond, then_b, else_b)
@@ -486,19 +600,45 @@ module Zinc
       end
     end
 
+    # @name or @name(int) before a declaration
+    class Attribute < Node
+      attr_accessor :name, :arg
+      def initialize(name, arg)
+        super()
+        @name = name
+        @arg = arg
+      end
+
+      def print_ast(indent = 0)
+        indent_print(indent)
+        puts(@arg ? "Attribute: @#{@name}(#{@arg})" : "Attribute: @#{@name}")
+      end
+    end
+
     class FuncDef < Node
-      attr_accessor :name, :params, :return_type, :body
+      # actor: name of the actor whose receive handler this is
+      attr_accessor :name, :params, :return_type, :body, :attrs,
+                    :memo_key, :memo_capacity, :actor
       def initialize(name, params, body)
         super()
         @name = name
         @params = params || []
         @return_type = nil
         @body = body
+        @attrs = []
+        @memo_key = nil
+        @memo_capacity = nil
+        @actor = nil
+      end
+
+      def memo?
+        @attrs.any? { |a| a.name == 'memo' }
       end
 
       def print_ast(indent = 0)
+        @attrs.each { |a| a.print_ast(indent) }
         indent_print(indent)
-        print "FuncDef: #{@name}("
+        print(@actor ? "Receive: #{@name}(" : "FuncDef: #{@name}(")
         @params.each_with_index do |p, i|
           if p.is_a?(Param)
             print "#{p.name}: "
@@ -527,6 +667,42 @@ module Zinc
       end
     end
 
+    class MethodCall < Node
+      # memory_order: an atomic access's ordering, moved out of args by Semantic
+      attr_accessor :object, :name, :args, :memory_order
+      def initialize(object, name, args)
+        super()
+        @object = object
+        @name = name
+        @args = args || []
+      end
+
+      def print_ast(indent = 0)
+        indent_print(indent)
+        puts "MethodCall: .#{@name}"
+        @object.print_ast(indent + 1)
+        @args.each { |a| a.print_ast(indent + 1) }
+      end
+    end
+
+    # Construction of a builtin runtime type, e.g. Rope("text")
+    class Construct < Node
+      attr_accessor :type_info, :args
+      def initialize(type_info, args)
+        super()
+        @type_info = type_info
+        @args = args || []
+      end
+
+      def print_ast(indent = 0)
+        indent_print(indent)
+        print 'Construct: '
+        print_type_info(@type_info)
+        puts
+        @args.each { |a| a.print_ast(indent + 1) }
+      end
+    end
+
     class Return < Node
       attr_accessor :value
       def initialize(value = nil)
@@ -557,12 +733,14 @@ module Zinc
       end
     end
 
+    # m[i] or, for matrices, m[i, j] with the column in col
     class Index < Node
-      attr_accessor :object, :index
-      def initialize(object, index)
+      attr_accessor :object, :index, :col
+      def initialize(object, index, col = nil)
         super()
         @object = object
         @index = index
+        @col = col
       end
 
       def print_ast(indent = 0)
@@ -570,6 +748,7 @@ module Zinc
         puts 'Index'
         @object.print_ast(indent + 1)
         @index.print_ast(indent + 1)
+        @col&.print_ast(indent + 1)
       end
     end
 
@@ -587,24 +766,32 @@ module Zinc
       end
     end
 
+    # struct, class or actor; an actor is a class whose state only its
+    # receive handlers touch
     class TypeDef < Node
-      attr_accessor :name, :fields, :is_class
+      attr_accessor :name, :fields, :is_class, :is_actor, :handlers, :attrs
       def initialize(name, fields, is_class)
         super()
         @name = name
         @fields = fields || []
         @is_class = is_class
+        @is_actor = false
+        @handlers = []
+        @attrs = []
       end
 
       def print_ast(indent = 0)
+        @attrs.each { |a| a.print_ast(indent) }
         indent_print(indent)
-        puts "#{@is_class ? 'ClassDef' : 'StructDef'}: #{@name}"
+        kind = @is_actor ? 'ActorDef' : (@is_class ? 'ClassDef' : 'StructDef')
+        puts "#{kind}: #{@name}"
         @fields.each { |f| f.print_ast(indent + 1) }
+        @handlers.each { |h| h.print_ast(indent + 1) }
       end
     end
 
     class StructField < Node
-      attr_accessor :name, :type_info, :default_value, :is_const, :is_weak
+      attr_accessor :name, :type_info, :default_value, :is_const, :is_weak, :attrs
       def initialize(name, type_info, default_value, is_const)
         super()
         @name = name
@@ -612,9 +799,11 @@ module Zinc
         @default_value = default_value
         @is_const = is_const
         @is_weak = false
+        @attrs = []
       end
 
       def print_ast(indent = 0)
+        @attrs.each { |a| a.print_ast(indent) }
         indent_print(indent)
         print "StructField: #{@is_const ? 'let ' : 'var '}#{@name}"
         if @type_info
@@ -626,6 +815,21 @@ module Zinc
       end
     end
 
+    # &target: a variable or field passed to an inout parameter
+    class InoutArg < Node
+      attr_accessor :target
+      def initialize(target)
+        super()
+        @target = target
+      end
+
+      def print_ast(indent = 0)
+        indent_print(indent)
+        puts 'InoutArg'
+        @target.print_ast(indent + 1)
+      end
+    end
+
     class NamedArg < Node
       attr_accessor :name, :value
       def initialize(name, value)
@@ -796,7 +1000,10 @@ module Zinc
       def print_ast(indent = 0)
         indent_print(indent)
         tk_int = { unknown: 0, int: 1, float: 2, string: 3, bool: 4, char: 5,
-                   void: 6, struct: 7, class: 8, array: 9, hash: 10 }
+                   void: 6, struct: 7, class: 8, array: 9, hash: 10, rope: 11, heap: 12, deque: 13, bitset: 14,
+                   ordered_map: 15, trie: 16, lru_cache: 17, sorted_index: 18, matrix: 19, slot_map: 20,
+                   concurrent_hash: 21, atomic_int: 22, atomic_bool: 23, mutex: 24, rwlock: 25, once: 26,
+                   barrier: 27, shared: 28 }
         puts "TypedEmptyArray: elem=#{tk_int[@elem_type] || 0}"
       end
     end
@@ -813,7 +1020,10 @@ module Zinc
       def print_ast(indent = 0)
         indent_print(indent)
         tk_int = { unknown: 0, int: 1, float: 2, string: 3, bool: 4, char: 5,
-                   void: 6, struct: 7, class: 8, array: 9, hash: 10 }
+                   void: 6, struct: 7, class: 8, array: 9, hash: 10, rope: 11, heap: 12, deque: 13, bitset: 14,
+                   ordered_map: 15, trie: 16, lru_cache: 17, sorted_index: 18, matrix: 19, slot_map: 20,
+                   concurrent_hash: 21, atomic_int: 22, atomic_bool: 23, mutex: 24, rwlock: 25, once: 26,
+                   barrier: 27, shared: 28 }
         puts "TypedEmptyHash: key=#{tk_int[@key_type] || 0} val=#{tk_int[@value_type] || 0}"
       end
     end
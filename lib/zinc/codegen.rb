@@ -67,6 +67,9 @@ module Zinc
     # Type helpers
     # ------------------------------------------------------------------
 
+    # Matches ZN_ARR_INLINE in the runtime
+    ARR_INLINE_MAX = 8
+
     TYPE_TO_C = {
       TK_INT    => "int64_t",
       TK_FLOAT  => "double",
@@ -78,6 +81,24 @@ module Zinc
       TK_CLASS  => "/* class */",
       TK_ARRAY  => "ZnArray*",
       TK_HASH   => "ZnHash*",
+      TK_ROPE   => "ZnRope*",
+      TK_HEAP   => "ZnHeap*",
+      TK_DEQUE  => "ZnDeque*",
+      TK_BITSET => "ZnBitset*",
+      TK_ORDERED_MAP => "ZnOrderedMap*",
+      TK_TRIE   => "ZnTrie*",
+      TK_LRU_CACHE => "ZnLruCache*",
+      TK_SORTED_INDEX => "ZnSortedIndex*",
+      TK_MATRIX => "ZnMatrix*",
+      TK_SLOT_MAP => "ZnSlotMap*",
+      TK_CONCURRENT_HASH => "ZnConcurrentHash*",
+      TK_ATOMIC_INT => "ZnAtomic*",
+      TK_ATOMIC_BOOL => "ZnAtomic*",
+      TK_MUTEX => "ZnMutex*",
+      TK_RWLOCK => "ZnRwLock*",
+      TK_ONCE => "ZnOnce*",
+      TK_BARRIER => "ZnBarrier*",
+      TK_SHARED => "ZnShared*",
     }.freeze
 
     OPT_TYPE_FOR = {
@@ -96,7 +117,15 @@ module Zinc
     end
 
     def ref_type?(kind)
-      kind == TK_STRING || kind == TK_CLASS || kind == TK_ARRAY || kind == TK_HASH
+      Zinc.ref_kind?(kind)
+    end
+
+    # Runtime retain/release function prefix for a reference type
+    # (e.g. "zn_str" for __zn_str_release, or the class name)
+    def rc_prefix(type)
+      return nil unless type
+      return type.name if type.kind == TK_CLASS
+      RC_RUNTIME_PREFIX[type.kind]
     end
 
     def expr_is_string(expr)
@@ -132,20 +161,6 @@ module Zinc
         ft = f.type
         if ft
           case ft.kind
-          when TK_STRING
-            emit_indent
-            emitf("__zn_str_release(%s.%s);\n", prefix, f.name)
-          when TK_ARRAY
-            emit_indent
-            emitf("__zn_arr_release(%s.%s);\n", prefix, f.name)
-          when TK_HASH
-            emit_indent
-            emitf("__zn_hash_release(%s.%s);\n", prefix, f.name)
-          when TK_CLASS
-            if ft.name
-              emit_indent
-              emitf("__%s_release(%s.%s);\n", ft.name, prefix, f.name)
-            end
           when TK_STRUCT
             if ft.name
               inner = @sem.lookup_struct(ft.name)
@@ -154,6 +169,11 @@ module Zinc
                 emit_value_type_field_releases(nested, inner)
               end
             end
+          else
+            if (rp = rc_prefix(ft))
+              emit_indent
+              emitf("__%s_release(%s.%s);\n", rp, prefix, f.name)
+            end
           end
         end
         f = f.next
@@ -197,43 +217,23 @@ module Zinc
     # ------------------------------------------------------------------
 
     def emit_retain_call(expr, type)
-      return unless type
-      case type.kind
-      when TK_STRING then emitf("__zn_str_retain(%s)", expr)
-      when TK_CLASS  then emitf("__%s_retain(%s)", type.name, expr) if type.name
-      when TK_ARRAY  then emitf("__zn_arr_retain(%s)", expr)
-      when TK_HASH   then emitf("__zn_hash_retain(%s)", expr)
-      end
+      rp = rc_prefix(type)
+      emitf("__%s_retain(%s)", rp, expr) if rp
     end
 
     def emit_release_call(expr, type)
-      return unless type
-      case type.kind
-      when TK_STRING then emitf("__zn_str_release(%s)", expr)
-      when TK_CLASS  then emitf("__%s_release(%s)", type.name, expr) if type.name
-      when TK_ARRAY  then emitf("__zn_arr_release(%s)", expr)
-      when TK_HASH   then emitf("__zn_hash_release(%s)", expr)
-      end
+      rp = rc_prefix(type)
+      emitf("__%s_release(%s)", rp, expr) if rp
     end
 
     def emit_retain_open(type)
-      return unless type
-      case type.kind
-      when TK_STRING then emit("__zn_str_retain(")
-      when TK_CLASS  then emitf("__%s_retain(", type.name) if type.name
-      when TK_ARRAY  then emit("__zn_arr_retain(")
-      when TK_HASH   then emit("__zn_hash_retain(")
-      end
+      rp = rc_prefix(type)
+      emitf("__%s_retain(", rp) if rp
     end
 
     def emit_release_open(type)
-      return unless type
-      case type.kind
-      when TK_STRING then emit("__zn_str_release(")
-      when TK_CLASS  then emitf("__%s_release(", type.name) if type.name
-      when TK_ARRAY  then emit("__zn_arr_release(")
-      when TK_HASH   then emit("__zn_hash_release(")
-      end
+      rp = rc_prefix(type)
+      emitf("__%s_release(", rp) if rp
     end
 
     def emit_box_call(expr, type)
@@ -242,7 +242,8 @@ module Zinc
       when TK_STRING then emitf("__zn_val_string(%s)", expr)
       when TK_ARRAY  then emitf("__zn_val_array((ZnArray*)(%s))", expr)
       when TK_HASH   then emitf("__zn_val_hash((ZnHash*)(%s))", expr)
-      when TK_CLASS  then emitf("__zn_val_ref(%s)", expr)
+      when TK_CLASS, TK_ROPE, TK_HEAP, TK_DEQUE, TK_BITSET, TK_ORDERED_MAP, TK_TRIE, TK_LRU_CACHE,
+           TK_SORTED_INDEX, TK_MATRIX, TK_SLOT_MAP, TK_CONCURRENT_HASH, TK_SHARED, *SYNC_KINDS then emitf("__zn_val_ref(%s)", expr)
       end
     end
 
@@ -289,7 +290,7 @@ module Zinc
         ast_walk(node.value, &block)
       when AST::IncDec
         ast_walk(node.target, &block)
-      when AST::Decl
+      when AST::Decl, AST::GlobalDecl
         ast_walk(node.value, &block)
       when AST::If
         ast_walk(node.cond, &block)
@@ -307,6 +308,11 @@ module Zinc
         ast_walk(node.body, &block)
       when AST::Call
         node.args.each { |a| ast_walk(a, &block) }
+      when AST::MethodCall
+        ast_walk(node.object, &block)
+        node.args.each { |a| ast_walk(a, &block) }
+      when AST::Construct
+        node.args.each { |a| ast_walk(a, &block) }
       when AST::Return
         ast_walk(node.value, &block)
       when AST::Break
@@ -317,10 +323,13 @@ module Zinc
         ast_walk(node.object, &block)
       when AST::TypeDef
         node.fields.each { |f| ast_walk(f, &block) }
+        node.handlers.each { |h| ast_walk(h, &block) }
       when AST::StructField
         ast_walk(node.default_value, &block)
       when AST::NamedArg
         ast_walk(node.value, &block)
+      when AST::InoutArg
+        ast_walk(node.target, &block)
       when AST::Tuple
         node.elements.each { |e| ast_walk(e, &block) }
       when AST::ObjectLiteral
@@ -328,6 +337,7 @@ module Zinc
       when AST::Index
         ast_walk(node.object, &block)
         ast_walk(node.index, &block)
+        ast_walk(node.col, &block)
       when AST::ArrayLiteral
         node.elems.each { |e| ast_walk(e, &block) }
       when AST::HashLiteral
@@ -409,10 +419,11 @@ module Zinc
         end
       end
 
-      # Generate class typedefs and ARC functions
+      # Generate class typedefs and ARC functions; actors add their
+      # message structs and send functions
       root.stmts.each do |s|
         if s.is_a?(AST::TypeDef) && s.is_class
-          gen_class_def(s)
+          s.is_actor ? gen_actor_def(s) : gen_class_def(s)
         end
       end
 
@@ -425,6 +436,12 @@ module Zinc
       # Generate collection helper functions (retain/release wrappers, hashcode, equals)
       gen_collection_helpers
 
+      # Generate comparators and specialized sift loops for Heap<Struct>
+      gen_heap_helpers
+
+      # Generate boxed adapters for group_count/group_sum key and value functions
+      gen_elem_fn_wrappers
+
       # Collect string literals and emit static structs
       collect_string_literals(root)
       emit("\n")
@@ -436,10 +453,15 @@ module Zinc
         end
       end
 
-      # Generate all functions
+      # Generate globals, ahead of the functions that use them
+      gen_globals(root)
+
+      # Generate all functions, and actor handlers where their actor is declared
       root.stmts.each do |s|
         if s.is_a?(AST::FuncDef)
           gen_func_def(s)
+        elsif s.is_a?(AST::TypeDef) && s.is_actor
+          gen_actor_handlers(s)
         end
       end
 
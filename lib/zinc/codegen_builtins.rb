@@ -0,0 +1,662 @@
+# frozen_string_literal: true
+
+module Zinc
+  class Codegen
+    # Runtime call argument that is passed boxed as a ZnValue
+    BoxArg = Struct.new(:node)
+
+    # C type spelling for a resolved type (temps, results)
+    def c_type_str(type)
+      if type.is_optional && opt_type_for(type.kind)
+        opt_type_for(type.kind)
+      elsif type.kind == TK_CLASS && type.name
+        "#{type.name}*"
+      elsif type.kind == TK_STRUCT && type.name
+        type.name
+      else
+        type_to_c(type.kind)
+      end
+    end
+
+    # Emit a call to a runtime function. Arguments are AST nodes, BoxArgs,
+    # raw C strings or procs that emit their own C; fresh reference-typed arguments are bound to temps and
+    # released after the call, since runtime functions only borrow them.
+    # ret_type is a Type, a raw C type string, or nil for void.
+    def gen_runtime_call(func, args, ret_type)
+      nodes = args.map { |a| a.is_a?(BoxArg) ? a.node : a }
+      fresh = nodes.map { |a| a.is_a?(AST::Node) && a.is_fresh_alloc && ref_type?(a.resolved_type&.kind) }
+      unless fresh.any?
+        emit("#{func}(")
+        args.each_with_index do |a, i|
+          emit(', ') if i > 0
+          if a.is_a?(BoxArg) then gen_box_expr(a.node)
+          elsif a.is_a?(AST::Node) then gen_expr(a)
+          elsif a.is_a?(Proc) then a.call
+          else emit(a)
+          end
+        end
+        emit(')')
+        return
+      end
+
+      t = @temp_counter; @temp_counter += 1
+      emit('({ ')
+      nodes.each_with_index do |a, i|
+        next unless fresh[i]
+        emit_ref_temp_decl("__a#{t}_#{i}", a.resolved_type)
+        gen_expr(a)
+        emit('; ')
+      end
+      is_void = ret_type.nil? || (ret_type.is_a?(Type) && ret_type.kind == TK_VOID)
+      ret_c = ret_type.is_a?(Type) ? c_type_str(ret_type) : ret_type
+      emit("#{ret_c} __r#{t} = ") unless is_void
+      emit("#{func}(")
+      args.each_with_index do |a, i|
+        emit(', ') if i > 0
+        if fresh[i]
+          a.is_a?(BoxArg) ? emit_box_call("__a#{t}_#{i}", a.node.resolved_type) : emit("__a#{t}_#{i}")
+        elsif a.is_a?(BoxArg) then gen_box_expr(a.node)
+        elsif a.is_a?(AST::Node) then gen_expr(a)
+        elsif a.is_a?(Proc) then a.call
+        else emit(a)
+        end
+      end
+      emit('); ')
+      nodes.each_with_index do |a, i|
+        next unless fresh[i]
+        emit_release_call("__a#{t}_#{i}", a.resolved_type)
+        emit('; ')
+      end
+      emit("__r#{t}; ") unless is_void
+      emit('})')
+    end
+
+    def gen_method_call_expr(expr)
+      case expr.object.resolved_type&.kind
+      when TK_STRING then gen_string_method_expr(expr)
+      when TK_ARRAY then gen_array_method_expr(expr)
+      when TK_HASH then gen_hash_method_expr(expr)
+      when TK_ROPE then gen_rope_method_expr(expr)
+      when TK_HEAP then gen_heap_method_expr(expr)
+      when TK_DEQUE then gen_deque_method_expr(expr)
+      when TK_BITSET then gen_runtime_call("__zn_bitset_#{expr.name}", [expr.object, *expr.args], expr.resolved_type)
+      when TK_CLASS then gen_runtime_call("__#{expr.object.resolved_type.name}_#{expr.name}_send", [expr.object, *expr.args], nil)
+      when TK_ORDERED_MAP then gen_ordered_map_method_expr(expr)
+      when TK_TRIE then gen_trie_method_expr(expr)
+      when TK_LRU_CACHE then gen_lru_cache_method_expr(expr)
+      when TK_SORTED_INDEX then gen_sorted_index_method_expr(expr)
+      when TK_MATRIX then gen_matrix_method_expr(expr)
+      when TK_SLOT_MAP then gen_slot_map_method_expr(expr)
+      when TK_CONCURRENT_HASH then gen_concurrent_hash_method_expr(expr)
+      when TK_SHARED then gen_shared_method_expr(expr)
+      when TK_ATOMIC_INT, TK_ATOMIC_BOOL then gen_atomic_method_expr(expr)
+      when TK_ONCE then gen_once_call_expr(expr)
+      when TK_MUTEX, TK_RWLOCK, TK_BARRIER
+        gen_runtime_call("__#{rc_prefix(expr.object.resolved_type)}_#{expr.name}", [expr.object], expr.resolved_type)
+      end
+    end
+
+    def gen_construct_expr(expr)
+      case expr.type_info.kind
+      when TK_ROPE
+        if expr.args.empty?
+          emit('__zn_rope_empty()')
+        else
+          gen_runtime_call('__zn_rope_from_str', expr.args, expr.resolved_type)
+        end
+      when TK_BITSET
+        gen_runtime_call('__zn_bitset_alloc', expr.args, expr.resolved_type)
+      when TK_HEAP
+        elem = expr.resolved_type.elem
+        if expr.args.empty?
+          emit('__zn_heap_alloc(0')
+          emit(', '); emit_elem_retain_cb(elem)
+          emit(', '); emit_elem_release_cb(elem)
+          emit(')')
+        else
+          # Boxed struct elements are copied, everything else is retained
+          gen_runtime_call("__zn_heap_from_arr_#{heap_suffix(elem)}", [expr.args[0], *boxed_copy_args(elem)],
+                           expr.resolved_type)
+        end
+      when TK_DEQUE
+        elem = expr.resolved_type.elem
+        if expr.args.empty?
+          emit('__zn_deque_alloc(0')
+          emit(', '); emit_elem_retain_cb(elem)
+          emit(', '); emit_elem_release_cb(elem)
+          emit(')')
+        else
+          gen_runtime_call('__zn_deque_from_arr', [expr.args[0], *boxed_copy_args(elem)], expr.resolved_type)
+        end
+      when TK_ORDERED_MAP
+        type = expr.resolved_type
+        if expr.args.empty?
+          emit_ordered_map_alloc(type)
+        else
+          alloc = -> { emit_ordered_map_alloc(type) }
+          gen_runtime_call('__zn_omap_from_sorted', [alloc, expr.args[0], expr.args[1], *boxed_copy_args(type.elem)], type)
+        end
+      when TK_LRU_CACHE
+        type = expr.resolved_type
+        cbs = lambda do
+          emit_elem_retain_cb(type.key)
+          emit(', '); emit_elem_release_cb(type.key)
+          emit(', '); emit_hashcode_cb(type.key)
+          emit(', '); emit_equals_cb(type.key)
+          emit(', '); emit_elem_retain_cb(type.elem)
+          emit(', '); emit_elem_release_cb(type.elem)
+        end
+        gen_runtime_call('__zn_lru_alloc', [expr.args[0], cbs], type)
+      when TK_CONCURRENT_HASH
+        type = expr.resolved_type
+        cbs = lambda do
+          emit_elem_release_cb(type.key)
+          emit(', '); emit_hashcode_cb(type.key)
+          emit(', '); emit_equals_cb(type.key)
+          emit(', '); emit_elem_release_cb(type.elem)
+        end
+        shards = expr.args.empty? ? 'ZN_CHASH_SHARDS' : expr.args[0]
+        gen_runtime_call('__zn_chash_alloc', [shards, cbs], type)
+      when TK_SHARED
+        version = shared_version(expr.resolved_type)
+        owned = -> { emit_shared_own(expr.args[0], version) }
+        gen_runtime_call('__zn_shared_alloc', [owned, -> { emit_elem_release_cb(version) }], expr.resolved_type)
+      when TK_ATOMIC_INT, TK_ATOMIC_BOOL
+        gen_runtime_call('__zn_atomic_alloc', expr.args.empty? ? ['0'] : expr.args, expr.resolved_type)
+      when TK_BARRIER
+        gen_runtime_call('__zn_barrier_alloc', expr.args, expr.resolved_type)
+      when TK_MUTEX, TK_RWLOCK, TK_ONCE
+        emit("__#{rc_prefix(expr.resolved_type)}_alloc()")
+      when TK_SLOT_MAP
+        elem = expr.resolved_type.elem
+        emit('__zn_slotmap_alloc(')
+        emit_elem_retain_cb(elem)
+        emit(', '); emit_elem_release_cb(elem)
+        emit(')')
+      when TK_MATRIX
+        func = expr.args.size > 2 ? '__zn_mat_from_arr' : '__zn_mat_alloc'
+        gen_runtime_call(func, expr.args, expr.resolved_type)
+      when TK_SORTED_INDEX
+        tag = OMAP_KEY_TAG.fetch(expr.resolved_type.elem.kind, 'ZN_TAG_INT')
+        gen_runtime_call('__zn_sidx_from_arr', [tag, expr.args[0]], expr.resolved_type)
+      when TK_TRIE
+        emit('__zn_trie_alloc(')
+        emit_elem_retain_cb(expr.resolved_type.elem)
+        emit(', '); emit_elem_release_cb(expr.resolved_type.elem)
+        emit(')')
+      end
+    end
+
+    # --- String ---
+
+    def gen_string_method_expr(expr)
+      case expr.name
+      when 'to_int', 'to_float'
+        gen_runtime_call("__zn_str_#{expr.name}", [expr.object], expr.resolved_type)
+      end
+    end
+
+    # --- Array ---
+
+    def gen_array_method_expr(expr)
+      case expr.name
+      when 'join'
+        gen_runtime_call('__zn_arr_join', [expr.object, expr.args[0]], expr.resolved_type)
+      when 'binary_search', 'lower_bound', 'upper_bound'
+        sfx = heap_suffix(expr.object.resolved_type.elem)
+        gen_runtime_call("__zn_arr_#{expr.name}_#{sfx}", [expr.object, BoxArg.new(expr.args[0])], expr.resolved_type)
+      when 'group_count', 'group_sum'
+        rt = expr.resolved_type
+        fns = expr.args.map { |a| "__zn_fnv_#{a.name}" }
+        fns = ['NULL'] if fns.empty?
+        out = -> { emit('__zn_hash_alloc(0'); emit_hash_callbacks(rt.key, rt.elem); emit(')') }
+        gen_runtime_call("__zn_arr_#{expr.name}", [expr.object, *fns, out], rt)
+      when 'distinct'
+        elem = expr.resolved_type.elem
+        out = -> { emit('__zn_arr_alloc(0'); emit_arr_callbacks(elem); emit(')') }
+        hashcode = -> { emit_hashcode_cb(elem) }
+        equals = -> { emit_equals_cb(elem) }
+        gen_runtime_call('__zn_arr_distinct', [expr.object, hashcode, equals, out], expr.resolved_type)
+      end
+    end
+
+    # Boxed adapters for the functions passed to group_count / group_sum:
+    # the runtime hands over a borrowed element and takes an owned result
+    def gen_elem_fn_wrappers
+      return if @sem.elem_fns.empty?
+      @sem.elem_fns.each do |name, elem|
+        ret = @sem.lookup(name).type
+        emit("static ZnValue __zn_fnv_#{name}(ZnValue v) {\n")
+        emit("    #{c_type_str(ret)} r = #{name}(")
+        gen_unbox_value(elem, false) { emit('v') }
+        emit(");\n")
+        emit("    return #{memo_box('r', ret)};\n")
+        emit("}\n")
+      end
+      emit("\n")
+    end
+
+    # --- Rope ---
+
+    def gen_rope_method_expr(expr)
+      recv = expr.object
+      args = expr.args
+      rt = expr.resolved_type
+      case expr.name
+      when 'concat'
+        str_suffix = args[0].resolved_type&.kind == TK_STRING ? '_str' : ''
+        gen_runtime_call("__zn_rope_concat#{str_suffix}", [recv, args[0]], rt)
+      when 'insert'
+        str_suffix = args[1].resolved_type&.kind == TK_STRING ? '_str' : ''
+        gen_runtime_call("__zn_rope_insert#{str_suffix}", [recv, args[0], args[1]], rt)
+      when 'delete', 'substring'
+        gen_runtime_call("__zn_rope_#{expr.name}", [recv, args[0], args[1]], rt)
+      when 'to_string'
+        gen_runtime_call('__zn_rope_flatten', [recv], rt)
+      end
+    end
+
+    # --- Heap ---
+
+    # Suffix of the ZN_HEAP_SPECIALIZE instance for an element type
+    def heap_suffix(elem)
+      elem.kind == TK_STRUCT ? elem.name : { TK_STRING => 'str' }.fetch(elem.kind, elem.kind.to_s)
+    end
+
+    # Size and field-retain helper the runtime copies boxed structs with;
+    # other elements are retained through the collection's callbacks
+    def boxed_copy_args(elem)
+      return %w[0 NULL] unless elem&.kind == TK_STRUCT && elem.name
+      ["sizeof(#{elem.name})", "__zn_val_ret_#{elem.name}"]
+    end
+
+    def gen_heap_method_expr(expr)
+      recv = expr.object
+      args = expr.args
+      elem = recv.resolved_type.elem
+      sfx = heap_suffix(elem)
+      case expr.name
+      when 'push'
+        gen_runtime_call("__zn_heap_push_#{sfx}", [recv, BoxArg.new(args[0])], expr.resolved_type)
+      when 'pop'
+        gen_unbox_value(elem, true) { gen_runtime_call("__zn_heap_pop_#{sfx}", [recv], 'ZnValue') }
+      when 'peek'
+        gen_unbox_value(elem, false) { gen_runtime_call('__zn_heap_peek', [recv], 'ZnValue') }
+      when 'decrease_key'
+        gen_runtime_call("__zn_heap_decrease_#{sfx}", [recv, args[0], BoxArg.new(args[1])], nil)
+      when 'contains'
+        gen_runtime_call('__zn_heap_contains', [recv, args[0]], expr.resolved_type)
+      end
+    end
+
+    # --- Deque ---
+
+    def gen_deque_method_expr(expr)
+      recv = expr.object
+      elem = recv.resolved_type.elem
+      case expr.name
+      when 'push_back', 'push_front'
+        gen_runtime_call("__zn_deque_#{expr.name}", [recv, BoxArg.new(expr.args[0])], nil)
+      when 'pop_back', 'pop_front'
+        gen_unbox_value(elem, true) { gen_runtime_call("__zn_deque_#{expr.name}", [recv], 'ZnValue') }
+      when 'front', 'back'
+        gen_unbox_value(elem, false) { gen_runtime_call("__zn_deque_#{expr.name}", [recv], 'ZnValue') }
+      end
+    end
+
+    def gen_deque_index_expr(expr)
+      gen_unbox_value(expr.resolved_type, false) do
+        gen_runtime_call('__zn_deque_get', [expr.object, expr.index], 'ZnValue')
+      end
+    end
+
+    def gen_deque_index_assign_stmt(tgt, val)
+      gen_runtime_call('__zn_deque_set', [tgt.object, tgt.index, BoxArg.new(val)], nil)
+      emit(";\n")
+    end
+
+    # --- Hash ---
+
+    def gen_hash_method_expr(expr)
+      recv = expr.object
+      type = recv.resolved_type
+      # Boxed struct keys and values are copied in and out
+      key_copy = boxed_copy_args(type.key)
+      val_copy = boxed_copy_args(type.elem)
+      case expr.name
+      when 'incremental_rehash'
+        gen_runtime_call('__zn_hash_incremental_rehash', [recv, *expr.args], expr.resolved_type)
+      when 'get_many'
+        out = -> { emit('__zn_arr_alloc(0'); emit_arr_callbacks(type.elem); emit(')') }
+        gen_runtime_call('__zn_hash_get_many', [recv, expr.args[0], out, *val_copy], expr.resolved_type)
+      when 'set_many'
+        gen_runtime_call('__zn_hash_set_many', [recv, *expr.args, *key_copy, *val_copy], expr.resolved_type)
+      end
+    end
+
+    # --- OrderedMap ---
+
+    OMAP_KEY_TAG = {
+      TK_INT => 'ZN_TAG_INT', TK_FLOAT => 'ZN_TAG_FLOAT',
+      TK_CHAR => 'ZN_TAG_CHAR', TK_STRING => 'ZN_TAG_STRING',
+    }.freeze
+
+    def emit_ordered_map_alloc(type)
+      emit("__zn_omap_alloc(#{OMAP_KEY_TAG.fetch(type.key.kind, 'ZN_TAG_INT')}")
+      emit(', '); emit_elem_retain_cb(type.key)
+      emit(', '); emit_elem_release_cb(type.key)
+      emit(', '); emit_elem_retain_cb(type.elem)
+      emit(', '); emit_elem_release_cb(type.elem)
+      emit(')')
+    end
+
+    def gen_ordered_map_method_expr(expr)
+      recv = expr.object
+      args = expr.args
+      type = recv.resolved_type
+      case expr.name
+      when 'contains', 'remove'
+        gen_runtime_call("__zn_omap_#{expr.name}", [recv, BoxArg.new(args[0])], expr.resolved_type)
+      when 'floor', 'ceiling'
+        gen_nearest_key_expr("__zn_omap_#{expr.name}", recv, args[0], type.key)
+      when 'keys', 'values', 'keys_between', 'values_between'
+        elem = expr.resolved_type.elem
+        out = -> { emit('__zn_arr_alloc(0'); emit_arr_callbacks(elem); emit(')') }
+        keys = expr.name.start_with?('keys') ? 'true' : 'false'
+        copy = keys == 'false' ? boxed_copy_args(elem) : %w[0 NULL]
+        bounds = if args.empty?
+                   ['__zn_val_int(0)', '__zn_val_int(0)', 'false']
+                 else
+                   [BoxArg.new(args[0]), BoxArg.new(args[1]), 'true']
+                 end
+        gen_runtime_call('__zn_omap_range', [recv, *bounds, out, keys, *copy], expr.resolved_type)
+      end
+    end
+
+    def gen_ordered_map_index_expr(expr)
+      gen_unbox_value(expr.resolved_type, false) do
+        gen_runtime_call('__zn_omap_get', [expr.object, BoxArg.new(expr.index)], 'ZnValue')
+      end
+    end
+
+    def gen_ordered_map_index_assign_stmt(tgt, val)
+      gen_runtime_call('__zn_omap_set', [tgt.object, BoxArg.new(tgt.index), BoxArg.new(val)], nil)
+      emit(";\n")
+    end
+
+    # --- Trie ---
+
+    def gen_trie_method_expr(expr)
+      recv = expr.object
+      case expr.name
+      when 'contains', 'remove', 'longest_prefix'
+        gen_runtime_call("__zn_trie_#{expr.name}", [recv, expr.args[0]], expr.resolved_type)
+      when 'keys_with_prefix', 'values_with_prefix'
+        elem = expr.resolved_type.elem
+        out = -> { emit('__zn_arr_alloc(0'); emit_arr_callbacks(elem); emit(')') }
+        keys = expr.name.start_with?('keys')
+        copy = keys ? %w[0 NULL] : boxed_copy_args(elem)
+        gen_runtime_call('__zn_trie_with_prefix', [recv, expr.args[0], out, keys.to_s, *copy], expr.resolved_type)
+      end
+    end
+
+    def gen_trie_index_expr(expr)
+      gen_unbox_value(expr.resolved_type, false) do
+        gen_runtime_call('__zn_trie_get', [expr.object, expr.index], 'ZnValue')
+      end
+    end
+
+    def gen_trie_index_assign_stmt(tgt, val)
+      gen_runtime_call('__zn_trie_set', [tgt.object, tgt.index, BoxArg.new(val)], nil)
+      emit(";\n")
+    end
+
+    # --- LruCache ---
+
+    def gen_lru_cache_method_expr(expr)
+      recv = expr.object
+      args = expr.args
+      case expr.name
+      when 'get'
+        gen_unbox_value(expr.resolved_type, false) do
+          gen_runtime_call('__zn_lru_get', [recv, BoxArg.new(args[0])], 'ZnValue')
+        end
+      when 'put'
+        gen_runtime_call('__zn_lru_put', [recv, BoxArg.new(args[0]), BoxArg.new(args[1])], nil)
+      when 'contains', 'remove'
+        gen_runtime_call("__zn_lru_#{expr.name}", [recv, BoxArg.new(args[0])], expr.resolved_type)
+      when 'hits', 'misses', 'capacity'
+        gen_runtime_call("__zn_lru_#{expr.name}", [recv], expr.resolved_type)
+      end
+    end
+
+    # --- ConcurrentHash ---
+
+    def gen_concurrent_hash_method_expr(expr)
+      recv = expr.object
+      args = expr.args
+      case expr.name
+      when 'contains', 'remove'
+        gen_runtime_call("__zn_chash_#{expr.name}", [recv, BoxArg.new(args[0])], expr.resolved_type)
+      when 'put_if_absent'
+        gen_runtime_call('__zn_chash_put_if_absent', [recv, BoxArg.new(args[0]), BoxArg.new(args[1])], expr.resolved_type)
+      when 'add'
+        gen_runtime_call('__zn_chash_add', [recv, BoxArg.new(args[0]), args[1]], expr.resolved_type)
+      when 'keys', 'values'
+        out = -> { emit('__zn_arr_alloc(0'); emit_arr_callbacks(expr.resolved_type.elem); emit(')') }
+        keys = expr.name == 'keys' ? 'true' : 'false'
+        gen_runtime_call('__zn_chash_collect', [recv, out, keys], expr.resolved_type)
+      when 'shards'
+        gen_runtime_call('__zn_chash_shards', [recv], expr.resolved_type)
+      end
+    end
+
+    # Reads copy the value out, so a String result is owned by the caller
+    def gen_concurrent_hash_index_expr(expr)
+      gen_unbox_value(expr.resolved_type, true) do
+        gen_runtime_call('__zn_chash_get', [expr.object, BoxArg.new(expr.index)], 'ZnValue')
+      end
+    end
+
+    def gen_concurrent_hash_index_assign_stmt(tgt, val)
+      gen_runtime_call('__zn_chash_set', [tgt.object, BoxArg.new(tgt.index), BoxArg.new(val)], nil)
+      emit(";\n")
+    end
+
+    # --- Shared ---
+
+    def gen_shared_method_expr(expr)
+      recv = expr.object
+      case expr.name
+      when 'publish'
+        version = shared_version(recv.resolved_type)
+        owned = -> { emit_shared_own(expr.args[0], version) }
+        gen_runtime_call('__zn_shared_publish', [recv, owned], nil)
+      when 'contains'
+        gen_runtime_call('__zn_shared_hash_contains', [recv, BoxArg.new(expr.args[0])], expr.resolved_type)
+      end
+    end
+
+    # Reads copy the value out, so a String result is owned by the caller
+    def gen_shared_index_expr(expr)
+      version = shared_version(expr.object.resolved_type)
+      is_str = expr.resolved_type.kind == TK_STRING ? 'true' : 'false'
+      gen_unbox_value(expr.resolved_type, true) do
+        if version.kind == TK_HASH
+          gen_runtime_call('__zn_shared_hash_get', [expr.object, BoxArg.new(expr.index), is_str], 'ZnValue')
+        else
+          gen_runtime_call('__zn_shared_arr_get', [expr.object, expr.index, is_str], 'ZnValue')
+        end
+      end
+    end
+
+    # A class field is read with the version pinned, then copied out
+    def gen_shared_field_expr(expr)
+      obj = expr.object
+      version = shared_version(obj.resolved_type)
+      unless version.kind == TK_CLASS
+        func = version.kind == TK_HASH ? '__zn_shared_hash_len' : '__zn_shared_arr_len'
+        gen_runtime_call(func, [obj], expr.resolved_type)
+        return
+      end
+      t = @temp_counter; @temp_counter += 1
+      emit("({ ZnShared *__sh#{t} = "); gen_expr(obj)
+      emit("; #{version.name} *__p#{t} = __zn_shared_pin(__sh#{t}); ")
+      emit("#{c_type_str(expr.resolved_type)} __r#{t} = ")
+      if expr.resolved_type.kind == TK_STRING
+        emit("__zn_str_clone(__p#{t}->#{expr.field})")
+      else
+        emit("__p#{t}->#{expr.field}")
+      end
+      emit('; __zn_shared_unpin(); ')
+      emit("__zn_shared_release(__sh#{t}); ") if obj.is_fresh_alloc
+      emit("__r#{t}; })")
+    end
+
+    # Hand a new version to the cell: it must hold the only reference, and
+    # any String it shares with the rest of the program is copied
+    def emit_shared_own(node, version)
+      case version.kind
+      when TK_HASH
+        str_keys = version.key.kind == TK_STRING
+        str_vals = version.elem.kind == TK_STRING
+        emit('__zn_shared_own_hash('); gen_expr(node); emit(", #{str_keys}, #{str_vals})")
+      when TK_ARRAY
+        emit('__zn_shared_own_arr('); gen_expr(node); emit(", #{version.elem.kind == TK_STRING})")
+      else
+        t = @temp_counter; @temp_counter += 1
+        emit("({ #{version.name} *__o#{t} = __zn_shared_own("); gen_expr(node); emit('); ')
+        fd = @sem.lookup_struct(version.name).fields
+        while fd
+          emit("__o#{t}->#{fd.name} = __zn_str_own(__o#{t}->#{fd.name}); ") if fd.type.kind == TK_STRING
+          fd = fd.next
+        end
+        emit("__o#{t}; })")
+      end
+    end
+
+    # The version type of a Shared<T>, with a class name resolved
+    def shared_version(type)
+      version = type.elem.clone
+      version.kind = TK_CLASS if version.kind == TK_STRUCT && @sem.lookup_struct(version.name)&.is_class
+      version
+    end
+
+    # --- Atomics and locks ---
+
+    # A failed compare_exchange only reads, so it cannot use release
+    CAS_FAILURE_ORDER = { 'acq_rel' => 'acquire', 'release' => 'relaxed' }.freeze
+
+    def gen_atomic_method_expr(expr)
+      order = expr.memory_order
+      orders = ["memory_order_#{order}"]
+      orders << "memory_order_#{CAS_FAILURE_ORDER.fetch(order, order)}" if expr.name == 'compare_exchange'
+      gen_runtime_call("__zn_atomic_#{expr.name}", [expr.object, *expr.args, *orders], expr.resolved_type)
+    end
+
+    # Once.call(f) runs f in exactly one thread; the others wait until it
+    # has finished. Either way the result says whether this call ran it.
+    def gen_once_call_expr(expr)
+      t = @temp_counter; @temp_counter += 1
+      emit("({ ZnOnce *__o#{t} = ")
+      gen_expr(expr.object)
+      emit("; bool __r#{t} = __zn_once_begin(__o#{t}); ")
+      emit("if (__r#{t}) { #{expr.args[0].name}(); __zn_once_end(__o#{t}); } __r#{t}; })")
+    end
+
+    # --- SortedIndex ---
+
+    def gen_sorted_index_method_expr(expr)
+      recv = expr.object
+      case expr.name
+      when 'contains', 'rank'
+        gen_runtime_call("__zn_sidx_#{expr.name}", [recv, BoxArg.new(expr.args[0])], expr.resolved_type)
+      when 'floor', 'ceiling'
+        gen_nearest_key_expr("__zn_sidx_#{expr.name}", recv, expr.args[0], recv.resolved_type.elem)
+      end
+    end
+
+    # --- SlotMap ---
+
+    def gen_slot_map_method_expr(expr)
+      recv = expr.object
+      case expr.name
+      when 'insert'
+        gen_runtime_call('__zn_slotmap_insert', [recv, BoxArg.new(expr.args[0])], expr.resolved_type)
+      when 'contains', 'remove'
+        gen_runtime_call("__zn_slotmap_#{expr.name}", [recv, expr.args[0]], expr.resolved_type)
+      when 'values'
+        elem = expr.resolved_type.elem
+        out = -> { emit('__zn_arr_alloc(0'); emit_arr_callbacks(elem); emit(')') }
+        gen_runtime_call('__zn_slotmap_values', [recv, out, *boxed_copy_args(elem)], expr.resolved_type)
+      when 'handles'
+        out = -> { emit('__zn_arr_alloc(0'); emit_arr_callbacks(expr.resolved_type.elem); emit(')') }
+        gen_runtime_call('__zn_slotmap_handles', [recv, out], expr.resolved_type)
+      end
+    end
+
+    def gen_slot_map_index_expr(expr)
+      gen_unbox_value(expr.resolved_type, false) do
+        gen_runtime_call('__zn_slotmap_get', [expr.object, expr.index], 'ZnValue')
+      end
+    end
+
+    def gen_slot_map_index_assign_stmt(tgt, val)
+      gen_runtime_call('__zn_slotmap_set', [tgt.object, tgt.index, BoxArg.new(val)], nil)
+      emit(";\n")
+    end
+
+    # --- Matrix ---
+
+    def gen_matrix_method_expr(expr)
+      case expr.name
+      when 'to_array'
+        out = -> { emit('__zn_arr_alloc(0'); emit_arr_callbacks(expr.resolved_type.elem); emit(')') }
+        gen_runtime_call('__zn_mat_to_array', [expr.object, out], expr.resolved_type)
+      else
+        gen_runtime_call("__zn_mat_#{expr.name}", [expr.object, *expr.args], expr.resolved_type)
+      end
+    end
+
+    def gen_matrix_index_expr(expr)
+      gen_runtime_call('__zn_mat_get', [expr.object, expr.index, expr.col], expr.resolved_type)
+    end
+
+    def gen_matrix_index_assign_stmt(tgt, val)
+      gen_runtime_call('__zn_mat_set', [tgt.object, tgt.index, tgt.col, val], nil)
+      emit(";\n")
+    end
+
+    # floor/ceiling lookups: the runtime returns the borrowed key and reports
+    # a miss through a bool out-parameter; wrap that as an optional key.
+    def gen_nearest_key_expr(func, recv, arg, key)
+      if key.kind == TK_STRING
+        # A missing String key comes back as a NULL pointer, i.e. nil
+        gen_unbox_value(key, false) { gen_runtime_call(func, [recv, BoxArg.new(arg), 'NULL'], 'ZnValue') }
+      else
+        t = @temp_counter; @temp_counter += 1
+        emit("({ bool __f#{t}; ZnValue __v#{t} = ")
+        gen_runtime_call(func, [recv, BoxArg.new(arg), "&__f#{t}"], 'ZnValue')
+        emit("; (#{opt_type_for(key.kind)}){ __f#{t}, #{unbox_func_for(key.kind)}(__v#{t}) }; })")
+      end
+    end
+
+    # Unbox the ZnValue emitted by the block. An owned struct is copied out
+    # of its box and the box freed; the copy takes over its field references.
+    def gen_unbox_value(elem, owned)
+      if elem.kind == TK_STRUCT && elem.name
+        if owned
+          t = @temp_counter; @temp_counter += 1
+          emit("({ ZnValue __v#{t} = "); yield
+          emit("; #{elem.name} __s#{t} = *(#{elem.name}*)__v#{t}.as.ptr; free(__v#{t}.as.ptr); __s#{t}; })")
+        else
+          emit("(*(#{elem.name}*)"); yield; emit('.as.ptr)')
+        end
+      elsif ref_type?(elem.kind)
+        emit("((#{c_type_str(elem)})"); yield; emit('.as.ptr)')
+      else
+        emit("#{unbox_func_for(elem.kind)}("); yield; emit(')')
+      end
+    end
+  end
+end
@@ -6,9 +6,7 @@ module Zinc
 
     def emit_elem_retain_cb(elem)
       if !elem then emit('NULL')
-      elsif elem.kind == TK_STRING then emit('(ZnElemFn)__zn_str_retain_v')
-      elsif elem.kind == TK_ARRAY then emit('(ZnElemFn)__zn_arr_retain_v')
-      elsif elem.kind == TK_HASH then emit('(ZnElemFn)__zn_hash_retain_v')
+      elsif RC_RUNTIME_PREFIX[elem.kind] then emit("(ZnElemFn)__#{RC_RUNTIME_PREFIX[elem.kind]}_retain_v")
       elsif elem.kind == TK_CLASS && elem.name then emit("(ZnElemFn)__zn_ret_#{elem.name}")
       else emit('NULL')
       end
@@ -16,9 +14,7 @@ module Zinc
 
     def emit_elem_release_cb(elem)
       if !elem then emit('NULL')
-      elsif elem.kind == TK_STRING then emit('(ZnElemFn)__zn_str_release_v')
-      elsif elem.kind == TK_ARRAY then emit('(ZnElemFn)__zn_arr_release_v')
-      elsif elem.kind == TK_HASH then emit('(ZnElemFn)__zn_hash_release_v')
+      elsif RC_RUNTIME_PREFIX[elem.kind] then emit("(ZnElemFn)__#{RC_RUNTIME_PREFIX[elem.kind]}_release_v")
       elsif elem.kind == TK_CLASS && elem.name then emit("(ZnElemFn)__zn_rel_#{elem.name}")
       elsif elem.kind == TK_STRUCT && elem.name then emit("(ZnElemFn)__zn_val_rel_#{elem.name}")
       else emit('NULL')
@@ -79,7 +75,7 @@ module Zinc
       fd = sd.fields
       while fd
         if fd.type
-          return true if [TK_STRING, TK_ARRAY, TK_HASH, TK_CLASS].include?(fd.type.kind)
+          return true if ref_type?(fd.type.kind)
           if fd.type.kind == TK_STRUCT && fd.type.name
             inner = @sem.lookup_struct(fd.type.name)
             return true if inner && struct_has_rc_fields(inner)
@@ -102,16 +98,13 @@ module Zinc
     # Track a ref-type variable in ARC scope
     def scope_track_ref(name, type)
       return unless @scope && type
-      case type.kind
-      when TK_STRING then scope_add_ref(name, 'zn_str')
-      when TK_CLASS then scope_add_ref(name, type.name) if type.name
-      when TK_ARRAY then scope_add_ref(name, 'zn_arr')
-      when TK_HASH then scope_add_ref(name, 'zn_hash')
-      when TK_STRUCT
+      if type.kind == TK_STRUCT
         if type.name
           sd = @sem.lookup_struct(type.name)
           scope_add_value_type(name, type.name) if sd && struct_has_rc_fields(sd)
         end
+      elsif (rp = rc_prefix(type))
+        scope_add_ref(name, rp)
       end
     end
 
@@ -137,7 +130,8 @@ module Zinc
       when TK_STRING then emit('__zn_val_string('); gen_expr(expr); emit(')')
       when TK_ARRAY  then emit('__zn_val_array((ZnArray*)('); gen_expr(expr); emit('))')
       when TK_HASH   then emit('__zn_val_hash((ZnHash*)('); gen_expr(expr); emit('))')
-      when TK_CLASS  then emit('__zn_val_ref('); gen_expr(expr); emit(')')
+      when TK_CLASS, TK_ROPE, TK_HEAP, TK_DEQUE, TK_BITSET, TK_ORDERED_MAP, TK_TRIE, TK_LRU_CACHE,
+           TK_SORTED_INDEX, TK_MATRIX, TK_SLOT_MAP, TK_CONCURRENT_HASH, TK_SHARED, *SYNC_KINDS then emit('__zn_val_ref('); gen_expr(expr); emit(')')
       when TK_STRUCT
         if expr.resolved_type.name
           name = expr.resolved_type.name
@@ -194,6 +188,7 @@ module Zinc
       when TK_FLOAT then emit('__zn_str_from_float(')
       when TK_BOOL  then emit('__zn_str_from_bool(')
       when TK_CHAR  then emit('__zn_str_from_char(')
+      when TK_ROPE  then gen_runtime_call('__zn_rope_flatten', [expr], 'ZnString*'); return
       else gen_expr(expr); return
       end
       gen_expr(expr)
@@ -303,7 +298,8 @@ module Zinc
         emit(expr.value.to_s)
 
       when AST::FloatLit
-        emit(sprintf('%g', expr.value))
+        # Shortest round-trip form; %g would drop digits past the sixth
+        emit(expr.value.finite? ? expr.value.to_s : sprintf('%g', expr.value))
 
       when AST::StringLit
         emit("(ZnString*)&__zn_str_#{expr.string_id}")
@@ -328,9 +324,9 @@ module Zinc
       when AST::Ident
         # Check if narrowed
         if @narrowed.include?(expr.name)
-          emit("#{expr.name}._val")
+          emit("#{ident_c(expr)}._val")
         else
-          emit(expr.name)
+          emit(ident_c(expr))
         end
 
       when AST::BinOp
@@ -364,6 +360,12 @@ module Zinc
       when AST::Call
         gen_call_expr(expr)
 
+      when AST::MethodCall
+        gen_method_call_expr(expr)
+
+      when AST::Construct
+        gen_construct_expr(expr)
+
       when AST::FieldAccess
         gen_field_access_expr(expr)
 
@@ -425,8 +427,17 @@ module Zinc
     end
 
     def gen_call_expr(expr)
+      if expr.name == 'await_actors'
+        emit('__zn_actors_wait()')
+        return
+      end
+
       # Built-in print
       if expr.name == 'print'
+        if expr.args[0]&.resolved_type&.kind == TK_ROPE
+          gen_runtime_call('__zn_rope_write', [expr.args[0], 'stdout'], nil)
+          return
+        end
         emit('({ fputs((')
         gen_expr(expr.args[0]) unless expr.args.empty?
         emit(')->_data, stdout); })')
@@ -461,7 +472,11 @@ module Zinc
           end
 
           emit("__ci_#{t}->#{fd.name} = ")
-          if val
+          # An actor gets its own copy of a String it did not create
+          cloned = sd.is_actor && fd.type.kind == TK_STRING && val && !val.is_fresh_alloc
+          if cloned
+            emit('__zn_str_clone('); gen_expr(val); emit(')')
+          elsif val
             gen_expr(val)
           elsif fd.default_value
             gen_expr(fd.default_value)
@@ -471,7 +486,7 @@ module Zinc
           emit('; ')
 
           # Retain reference-type fields (skip weak)
-          if !fd.is_weak && ref_type?(fd.type.kind)
+          if !fd.is_weak && !cloned && ref_type?(fd.type.kind)
             if !val || !val.is_fresh_alloc
               emit_retain_call("__ci_#{t}->#{fd.name}", fd.type)
               emit('; ')
@@ -564,7 +579,11 @@ module Zinc
             wrap_opt = true if opt_wrap
           end
         end
-        if wrap_opt
+        if a.is_a?(AST::InoutArg)
+          emit('&(')
+          gen_expr(a.target)
+          emit(')')
+        elsif wrap_opt
           emit("(#{opt_wrap}){._has = true, ._val = ")
           gen_expr(a)
           emit('}')
@@ -575,16 +594,40 @@ module Zinc
       emit(')')
     end
 
+    # Reads a size field of a runtime object; a fresh receiver (every Rope
+    # operation returns one) is held in a temp and released after the read
+    def gen_header_field(obj, member)
+      if obj.is_fresh_alloc && rc_prefix(obj.resolved_type)
+        t = @temp_counter; @temp_counter += 1
+        emit('({ ')
+        emit_ref_temp_decl("__fl#{t}", obj.resolved_type)
+        gen_expr(obj)
+        emit("; int64_t __n#{t} = (int64_t)(__fl#{t}->#{member}); ")
+        emit_release_call("__fl#{t}", obj.resolved_type)
+        emit("; __n#{t}; })")
+      else
+        emit('(int64_t)((')
+        gen_expr(obj)
+        emit(")->#{member})")
+      end
+    end
+
     def gen_field_access_expr(expr)
       obj = expr.object
       field = expr.field
       obj_kind = obj.resolved_type&.kind
 
-      # String/Array/Hash .length
-      if (obj_kind == TK_STRING || obj_kind == TK_ARRAY || obj_kind == TK_HASH) && field == 'length'
-        emit('(int64_t)((')
-        gen_expr(obj)
-        emit(')->_len)')
+      # String/Array/Hash/Rope .length
+      if Zinc.sized_kind?(obj_kind) && field == 'length'
+        gen_header_field(obj, '_len')
+        return
+      end
+      if obj_kind == TK_MATRIX
+        gen_header_field(obj, "_#{field}")
+        return
+      end
+      if obj_kind == TK_SHARED
+        gen_shared_field_expr(expr)
         return
       end
 
@@ -692,6 +735,23 @@ module Zinc
         gen_array_index_expr(expr)
       elsif obj_kind == TK_HASH
         gen_hash_index_expr(expr)
+      elsif obj_kind == TK_DEQUE
+        gen_deque_index_expr(expr)
+      elsif obj_kind == TK_ORDERED_MAP
+        gen_ordered_map_index_expr(expr)
+      elsif obj_kind == TK_TRIE
+        gen_trie_index_expr(expr)
+      elsif obj_kind == TK_MATRIX
+        gen_matrix_index_expr(expr)
+      elsif obj_kind == TK_SLOT_MAP
+        gen_slot_map_index_expr(expr)
+      elsif obj_kind == TK_CONCURRENT_HASH
+        gen_concurrent_hash_index_expr(expr)
+      elsif obj_kind == TK_SHARED
+        gen_shared_index_expr(expr)
+      elsif obj_kind == TK_ROPE
+        # A fresh receiver is bound and released after the read
+        gen_runtime_call('__zn_rope_char_at', [obj, expr.index], expr.resolved_type)
       else
         # String indexing
         emit('(')
@@ -704,14 +764,12 @@ module Zinc
 
     def gen_array_index_expr(expr)
       arr_elem = expr.resolved_type
-      if arr_elem&.kind == TK_ARRAY
-        emit('(ZnArray*)__zn_arr_get('); gen_expr(expr.object); emit(', '); gen_expr(expr.index); emit(').as.ptr')
-      elsif arr_elem&.kind == TK_HASH
-        emit('(ZnHash*)__zn_arr_get('); gen_expr(expr.object); emit(', '); gen_expr(expr.index); emit(').as.ptr')
+      if arr_elem && Zinc.runtime_ptr_kind?(arr_elem.kind)
+        emit("(#{type_to_c(arr_elem.kind)})__zn_arr_get("); gen_expr(expr.object); emit(', '); gen_expr(expr.index); emit(').as.ptr')
       elsif arr_elem&.kind == TK_CLASS && arr_elem.name
         emit("(#{arr_elem.name}*)__zn_arr_get("); gen_expr(expr.object); emit(', '); gen_expr(expr.index); emit(').as.ptr')
       elsif arr_elem&.kind == TK_STRUCT && arr_elem.name
-        emit("*(#{arr_elem.name}*)__zn_arr_get("); gen_expr(expr.object); emit(', '); gen_expr(expr.index); emit(').as.ptr')
+        emit("(*(#{arr_elem.name}*)__zn_arr_get("); gen_expr(expr.object); emit(', '); gen_expr(expr.index); emit(').as.ptr)')
       else
         emit("#{unbox_func_for(arr_elem&.kind || TK_UNKNOWN)}(")
         emit('__zn_arr_get('); gen_expr(expr.object); emit(', '); gen_expr(expr.index); emit('))')
@@ -720,14 +778,12 @@ module Zinc
 
     def gen_hash_index_expr(expr)
       hash_val = expr.resolved_type
-      if hash_val&.kind == TK_ARRAY
-        emit('(ZnArray*)__zn_hash_get('); gen_expr(expr.object); emit(', '); gen_box_expr(expr.index); emit(').as.ptr')
-      elsif hash_val&.kind == TK_HASH
-        emit('(ZnHash*)__zn_hash_get('); gen_expr(expr.object); emit(', '); gen_box_expr(expr.index); emit(').as.ptr')
+      if hash_val && Zinc.runtime_ptr_kind?(hash_val.kind)
+        emit("(#{type_to_c(hash_val.kind)})__zn_hash_get("); gen_expr(expr.object); emit(', '); gen_box_expr(expr.index); emit(').as.ptr')
       elsif hash_val&.kind == TK_CLASS && hash_val.name
         emit("(#{hash_val.name}*)__zn_hash_get("); gen_expr(expr.object); emit(', '); gen_box_expr(expr.index); emit(').as.ptr')
       elsif hash_val&.kind == TK_STRUCT && hash_val.name
-        emit("*(#{hash_val.name}*)__zn_hash_get("); gen_expr(expr.object); emit(', '); gen_box_expr(expr.index); emit(').as.ptr')
+        emit("(*(#{hash_val.name}*)__zn_hash_get("); gen_expr(expr.object); emit(', '); gen_box_expr(expr.index); emit(').as.ptr)')
       else
         emit("#{unbox_func_for(hash_val&.kind || TK_UNKNOWN)}(")
         emit('__zn_hash_get('); gen_expr(expr.object); emit(', '); gen_box_expr(expr.index); emit('))')
@@ -737,7 +793,9 @@ module Zinc
     def gen_array_literal_expr(expr)
       n = expr.elems.size
       t = @temp_counter; @temp_counter += 1
-      emit("({ ZnArray *__t#{t} = __zn_arr_alloc(#{n > 0 ? n : 4}")
+      # Short literals keep their elements in the header allocation
+      alloc = n > 0 && n <= ARR_INLINE_MAX ? '__zn_arr_alloc_inline' : '__zn_arr_alloc'
+      emit("({ ZnArray *__t#{t} = #{alloc}(#{n > 0 ? n : 4}")
       emit_arr_callbacks(expr.resolved_type&.elem)
       emit('); ')
       expr.elems.each do |elem|
@@ -763,7 +821,7 @@ module Zinc
     def gen_hash_literal_expr(expr)
       n = expr.pairs.size
       t = @temp_counter; @temp_counter += 1
-      emit("({ ZnHash *__t#{t} = __zn_hash_alloc(#{n > 0 ? n * 2 : 8}")
+      emit("({ ZnHash *__t#{t} = __zn_hash_alloc(#{n}")
       emit_hash_callbacks(expr.resolved_type&.key, expr.resolved_type&.elem)
       emit('); ')
       expr.pairs.each do |pair|
@@ -806,7 +864,7 @@ module Zinc
 
     def gen_typed_empty_hash_expr(expr)
       t = @temp_counter; @temp_counter += 1
-      emit("({ ZnHash *__t#{t} = __zn_hash_alloc(8")
+      emit("({ ZnHash *__t#{t} = __zn_hash_alloc(0")
       emit_hash_callbacks(expr.resolved_type&.key, expr.resolved_type&.elem)
       emit("); __t#{t}; })")
     end
@@ -818,7 +876,7 @@ module Zinc
         emit('('); gen_expr(operand); emit(' != NULL)')
       else
         if operand.is_a?(AST::Ident)
-          emit("(#{operand.name}._has)")
+          emit("(#{ident_c(operand)}._has)")
         else
           emit('('); gen_expr(operand); emit('._has)')
         end
@@ -1039,7 +1097,7 @@ module Zinc
         end
       elsif t == TK_STRUCT && vt.name
         emit("#{cq}#{vt.name} #{name} = ")
-      elsif [TK_STRING, TK_ARRAY, TK_HASH].include?(t)
+      elsif RC_RUNTIME_PREFIX.key?(t)
         emit("#{type_to_c(t)} #{name} = ")
       else
         emit("#{cq}#{type_to_c(t)} #{name} = ")
@@ -1205,42 +1263,25 @@ module Zinc
       end
 
       # Simple variable assignment
-      name = tgt.name
+      name = ident_c(tgt)
       vtype = val.resolved_type
       if vtype && ref_type?(val_kind)
-        if val_kind == TK_CLASS
-          # Class: retain-before-release
-          if !val.is_fresh_alloc
-            t = @temp_counter; @temp_counter += 1
-            emit("struct #{vtype.name} *__t#{t} = ")
-            gen_expr(val)
-            emit(";\n")
-            emit_indent
-            emit_retain_open(vtype)
-            emit("__t#{t});\n")
-            emit_indent
-            emit_release_call(name, vtype)
-            emit(";\n")
-            emit_indent
-            emit("#{name} = __t#{t};\n")
-          else
-            emit_release_call(name, vtype)
-            emit(";\n")
-            emit_indent
-            emit("#{name} = "); gen_expr(val); emit(";\n")
-          end
-        else
-          # String/Array/Hash: release-assign-retain
-          emit_release_call(name, vtype)
-          emit(";\n")
+        # Evaluate into a temp and retain before releasing the old value:
+        # the new value may be derived from it (s = s + x, r = r.concat(x))
+        t = @temp_counter; @temp_counter += 1
+        emit_ref_temp_decl("__t#{t}", vtype)
+        gen_expr(val)
+        emit(";\n")
+        unless val.is_fresh_alloc
           emit_indent
-          emit("#{name} = "); gen_expr(val); emit(";\n")
-          unless val.is_fresh_alloc
-            emit_indent
-            emit_retain_call(name, vtype)
-            emit(";\n")
-          end
+          emit_retain_call("__t#{t}", vtype)
+          emit(";\n")
         end
+        emit_indent
+        emit_release_call(name, vtype)
+        emit(";\n")
+        emit_indent
+        emit("#{name} = __t#{t};\n")
       else
         gen_expr(node)
         emit(";\n")
@@ -1303,6 +1344,18 @@ module Zinc
           gen_box_expr(val)
           emit(");\n")
         end
+      elsif obj_kind == TK_DEQUE
+        gen_deque_index_assign_stmt(tgt, val)
+      elsif obj_kind == TK_ORDERED_MAP
+        gen_ordered_map_index_assign_stmt(tgt, val)
+      elsif obj_kind == TK_TRIE
+        gen_trie_index_assign_stmt(tgt, val)
+      elsif obj_kind == TK_MATRIX
+        gen_matrix_index_assign_stmt(tgt, val)
+      elsif obj_kind == TK_SLOT_MAP
+        gen_slot_map_index_assign_stmt(tgt, val)
+      elsif obj_kind == TK_CONCURRENT_HASH
+        gen_concurrent_hash_index_assign_stmt(tgt, val)
       end
     end
 
@@ -1312,6 +1365,25 @@ module Zinc
       obj_sn = obj.resolved_type&.name
       obj_kind = obj.resolved_type&.kind || TK_UNKNOWN
 
+      # A fresh object (obj().field = v) is held in a temp and released
+      # once the store is done
+      if obj_kind == TK_CLASS && obj_sn && obj.is_fresh_alloc
+        t = @temp_counter; @temp_counter += 1
+        emit("#{obj_sn} *__fo#{t} = ")
+        gen_expr(obj)
+        emit(";\n")
+        held = AST::Ident.new("__fo#{t}")
+        held.resolved_type = obj.resolved_type
+        access = AST::FieldAccess.new(held, field)
+        access.resolved_type = tgt.resolved_type
+        emit_indent
+        gen_field_assign_stmt(access, val)
+        emit_indent
+        emit_release_call("__fo#{t}", obj.resolved_type)
+        emit(";\n")
+        return
+      end
+
       fd = nil
       if (obj_kind == TK_STRUCT || obj_kind == TK_CLASS) && obj_sn
         sd = @sem.lookup_struct(obj_sn)
@@ -1385,8 +1457,9 @@ module Zinc
     end
 
     # Generate function prototype
-    def gen_func_proto(func, to_header)
-      sym = @sem.lookup(func.name)
+    def gen_func_proto(func, to_header, c_name = func.name)
+      # Actor handlers return nothing and take their actor as self
+      sym = func.actor ? nil : @sem.lookup(func.name)
       ret_type = sym&.type&.kind || TK_VOID
 
       out = to_header ? @h_file : @c_file
@@ -1404,18 +1477,28 @@ module Zinc
       end
 
       if ret_is_class
-        out.write("#{ret_str} *#{func.name}(")
+        out.write("#{ret_str} *#{c_name}(")
       else
-        out.write("#{ret_str} #{func.name}(")
+        out.write("#{ret_str} #{c_name}(")
       end
 
       first = true
+      if func.actor
+        out.write("#{func.actor} *self")
+        first = false
+      end
       func.params.each do |p|
         out.write(', ') unless first
         ti = p.type_info
         opt = ti.is_optional ? opt_type_for(ti.kind) : nil
-        if opt
+        if p.is_inout
+          # Passed by pointer to the caller's variable
+          c = inout_param_c(ti, opt)
+          out.write(c.end_with?('*') ? "#{c.chomp('*')} **#{p.name}" : "#{c} *#{p.name}")
+        elsif opt
           out.write("const #{opt} #{p.name}")
+        elsif HANDLE_KINDS.include?(ti.kind)
+          out.write("#{type_to_c(ti.kind)} #{p.name}")
         elsif ti.kind == TK_CLASS && ti.name
           out.write("#{ti.name} *#{p.name}")
         elsif ti.kind == TK_STRUCT && ti.name
@@ -1434,6 +1517,12 @@ module Zinc
       out.write(')')
     end
 
+    def inout_param_c(ti, opt)
+      return opt if opt
+      return type_to_c(ti.kind) unless [TK_STRUCT, TK_CLASS].include?(ti.kind) && ti.name
+      ti.kind == TK_CLASS || @sem.lookup_struct(ti.name)&.is_class ? "#{ti.name}*" : ti.name
+    end
+
     # Generate function body with implicit return
     def gen_func_body(block, ret_type)
       return unless block.is_a?(AST::Block)
@@ -1454,6 +1543,18 @@ module Zinc
       last = stmts.last
       stmts[0...-1].each { |s| gen_stmt(s) }
 
+      # A trailing assignment runs as a statement, so the old value is
+      # released, and returns its target (or the stored value when reading
+      # the target again would repeat a side effect)
+      if last.is_a?(AST::Assign) && ret_type != TK_VOID && last.target.resolved_type
+        if rereadable_target?(last.target)
+          gen_stmt(last)
+          last = last.target
+        else
+          last = gen_trailing_assign(last)
+        end
+      end
+
       if last
         last_kind = last.resolved_type&.kind || TK_UNKNOWN
         if last.is_a?(AST::Return)
@@ -1492,6 +1593,55 @@ module Zinc
       emit('}')
     end
 
+    # Evaluates the value into a temp that owns one reference and stores
+    # it (the store takes its own); the temp is returned as a fresh value
+    def gen_trailing_assign(node)
+      val = node.value
+      vtype = val.resolved_type.clone
+      vtype.name ||= node.target.resolved_type.name
+      t = @temp_counter; @temp_counter += 1
+      tmp = "__v#{t}"
+      emit_indent
+      if ref_type?(vtype.kind)
+        emit_ref_temp_decl(tmp, vtype)
+      elsif vtype.kind == TK_STRUCT && vtype.name
+        emit("#{vtype.name} #{tmp} = ")
+      else
+        emit("#{type_to_c(vtype.kind)} #{tmp} = ")
+      end
+      gen_expr(val)
+      emit(";\n")
+      if ref_type?(vtype.kind) && !val.is_fresh_alloc
+        emit_indent
+        emit_retain_call(tmp, vtype)
+        emit(";\n")
+      end
+      ref = AST::Ident.new(tmp)
+      ref.line = node.line
+      ref.resolved_type = vtype
+      gen_stmt(AST::Assign.new(node.target, ref))
+      result = AST::Ident.new(tmp)
+      result.resolved_type = vtype
+      result.is_fresh_alloc = true
+      result
+    end
+
+    # A variable, or fields and elements reached from one with constant or
+    # variable subscripts
+    def rereadable_target?(t)
+      case t
+      when AST::Ident then true
+      when AST::FieldAccess then rereadable_target?(t.object)
+      when AST::Index
+        rereadable_target?(t.object) && [t.index, t.col].compact.all? { |i| plain_subscript?(i) }
+      else false
+      end
+    end
+
+    def plain_subscript?(e)
+      [AST::Ident, AST::IntLit, AST::StringLit, AST::CharLit].any? { |k| e.is_a?(k) }
+    end
+
     def gen_ref_implicit_return(last, ret_type)
       t = @temp_counter; @temp_counter += 1
       emit_indent
@@ -1502,17 +1652,10 @@ module Zinc
       end
       gen_expr(last)
       emit(";\n")
-      unless last.is_fresh_alloc
+      if !last.is_fresh_alloc && rc_prefix(last.resolved_type)
         emit_indent
-        if ret_type == TK_STRING
-          emit("__zn_str_retain(__ret#{t});\n")
-        elsif ret_type == TK_ARRAY
-          emit("__zn_arr_retain(__ret#{t});\n")
-        elsif ret_type == TK_HASH
-          emit("__zn_hash_retain(__ret#{t});\n")
-        elsif ret_type == TK_CLASS && last.resolved_type&.name
-          emit("__#{last.resolved_type.name}_retain(__ret#{t});\n")
-        end
+        emit_retain_call("__ret#{t}", last.resolved_type)
+        emit(";\n")
       end
       emit_scope_releases
       emit_indent
@@ -1520,6 +1663,8 @@ module Zinc
     end
 
     def gen_func_def(func)
+      return gen_memo_func_def(func) if func.memo?
+
       gen_func_proto(func, true)
       emit_header(";\n")
 
@@ -1532,6 +1677,218 @@ module Zinc
       emit("\n\n")
     end
 
+    # @memo: the body becomes a static __zn_memo_body_<name>, and <name> a
+    # wrapper around a lazily created table (a ZnHash, or a ZnLruCache when
+    # a capacity is given). Recursive calls in the body go through the
+    # wrapper, so they hit the table too.
+    def gen_memo_func_def(func)
+      name = func.name
+      ret = @sem.lookup(name).type
+      table = "__zn_memo_#{name}"
+      body = "__zn_memo_body_#{name}"
+      params = func.params.map { |p| [p.name, p.type_info.to_type] }
+      if func.memo_key
+        key = Type.new(TK_STRUCT)
+        key.name = func.memo_key
+        # Parameters arrive const; the tuple owns its own references
+        fields = params.each_with_index.map do |(pn, pt), i|
+          ref_type?(pt.kind) ? "._#{i} = (#{c_type_str(pt)})#{pn}" : "._#{i} = #{pn}"
+        end.join(', ')
+        key_c = "((#{key.name}){#{fields}})"
+      else
+        key = params[0][1]
+        key_c = params[0][0]
+      end
+      runtime = func.memo_capacity ? 'lru' : 'hash'
+
+      emit("static #{func.memo_capacity ? 'ZnLruCache' : 'ZnHash'} *#{table};\n")
+      emit('static ')
+      gen_func_proto(func, false, body)
+      emit(";\n\n")
+
+      gen_func_proto(func, true)
+      emit_header(";\n")
+      gen_func_proto(func, false)
+      emit(" {\n")
+      emit("    if (!#{table}) #{table} = __zn_#{runtime}_alloc(#{func.memo_capacity || 0}")
+      emit_hash_callbacks(key, ret)
+      emit(");\n")
+      emit("    ZnValue __key = #{memo_box(key_c, key)};\n")
+      emit("    ZnValue *__hit = __zn_#{runtime}_find(#{table}, __key);\n")
+      emit("    if (__hit) {\n")
+      emit("        free(__key.as.ptr);\n") if key.kind == TK_STRUCT
+      emit("        #{c_type_str(ret)} __r = ")
+      gen_unbox_value(ret, false) { emit('(*__hit)') }
+      emit(";\n")
+      if ref_type?(ret.kind)
+        emit('        '); emit_retain_call('__r', ret); emit(";\n")
+      end
+      emit("        return __r;\n")
+      emit("    }\n")
+      emit("    #{c_type_str(ret)} __r = #{body}(#{params.map(&:first).join(', ')});\n")
+      # The table releases a tuple key's fields along with it
+      params.each_with_index do |(pn, pt), i|
+        next unless func.memo_key && ref_type?(pt.kind)
+        emit("    "); emit_retain_call("((#{key.name}*)__key.as.ptr)->_#{i}", pt); emit(";\n")
+      end
+      emit("    __zn_#{runtime}_#{func.memo_capacity ? 'put' : 'set'}(#{table}, __key, #{memo_box('__r', ret)});\n")
+      emit("    return __r;\n")
+      emit("}\n\n")
+
+      gen_func_proto(func, false, body)
+      emit(' ')
+      gen_func_body(func.body, ret.kind)
+      emit("\n\n")
+    end
+
+    # A global lives in __zn_global_<name>. One that is not initialized
+    # statically is reached through __zn_global_<name>_ref, which runs the
+    # initializer on first use.
+    def ident_c(expr)
+      return "(*#{expr.name})" if expr.by_ref
+      g = expr.global
+      return expr.name unless g
+      g.is_static ? "__zn_global_#{g.name}" : "(*__zn_global_#{g.name}_ref())"
+    end
+
+    def gen_globals(root)
+      globals = root.stmts.select { |s| s.is_a?(AST::GlobalDecl) }
+      globals.each { |g| gen_global(g) }
+      gen_globals_release(globals)
+    end
+
+    # A non-threadlocal initializer runs under a Once, since the first use
+    # may come from any thread; a threadlocal one checks a per-thread flag
+    def gen_global(g)
+      type = g.value.resolved_type
+      var = "__zn_global_#{g.name}"
+      storage = g.is_threadlocal ? 'static _Thread_local ' : 'static '
+      if g.is_static
+        cq = g.is_const && !ref_type?(type.kind) ? 'const ' : ''
+        emit("#{storage}#{cq}#{c_type_str(type)} #{var} = ")
+        g.const_value.nil? ? gen_expr(g.value) : emit(const_c(g.const_value, type))
+        emit(";\n\n")
+        return
+      end
+
+      emit("#{storage}#{c_type_str(type)} #{var};\n")
+      if g.is_threadlocal
+        emit("static _Thread_local bool #{var}_ready;\n")
+      else
+        emit("static ZnOnce #{var}_once;\n")
+      end
+      ct = c_type_str(type)
+      emit("static inline #{ct}#{ct.end_with?('*') ? '' : ' '}*#{var}_ref(void) {\n")
+      if g.is_threadlocal
+        emit("    if (!#{var}_ready) {\n")
+      else
+        emit("    if (!__zn_once_done(&#{var}_once) && __zn_once_begin(&#{var}_once)) {\n")
+      end
+      @indent_level = 2
+      push_scope(false)
+      emit_indent
+      emit("#{var} = ")
+      gen_expr(g.value)
+      emit(";\n")
+      emit_retain(var, g.value, type)
+      pop_scope
+      @indent_level = 0
+      if !g.is_threadlocal
+        emit("        __zn_once_end(&#{var}_once);\n")
+      else
+        emit("        #{var}_ready = true;\n")
+        emit("        __zn_tls_track();\n") if global_needs_release?(g)
+      end
+      emit("    }\n")
+      emit("    return &#{var};\n")
+      emit("}\n\n")
+    end
+
+    def const_c(value, type)
+      case type.kind
+      when TK_BOOL then value ? 'true' : 'false'
+      when TK_CHAR then "(char)#{value}"
+      when TK_FLOAT then value.to_f.to_s
+      else value == -(2**63) ? 'INT64_MIN' : value.to_s
+      end
+    end
+
+    def global_needs_release?(g)
+      type = g.value.resolved_type
+      return true if rc_prefix(type)
+      return false unless type.kind == TK_STRUCT && type.name
+      sd = @sem.lookup_struct(type.name)
+      sd && struct_has_rc_fields(sd)
+    end
+
+    # Reference-counted globals are released at exit, last declared first,
+    # after the actors have finished (their atexit handler is registered
+    # later, so it runs earlier). Each thread releases its own threadlocal
+    # copies as it exits.
+    def gen_globals_release(globals)
+      shared, tls = globals.select { |g| global_needs_release?(g) }.partition { |g| !g.is_threadlocal }
+      return if shared.empty? && tls.empty?
+
+      @indent_level = 1
+      unless tls.empty?
+        emit("static void __zn_tls_globals_release(void) {\n")
+        tls.reverse_each do |g|
+          var = "__zn_global_#{g.name}"
+          emit("    if (#{var}_ready) {\n")
+          @indent_level = 2
+          emit_global_release(var, g)
+          @indent_level = 1
+          emit("        #{var}_ready = false;\n")
+          emit("    }\n")
+        end
+        emit("}\n\n")
+      end
+
+      emit("static void __zn_globals_release(void) {\n")
+      emit("    __zn_tls_globals_release();\n") unless tls.empty?
+      shared.reverse_each do |g|
+        var = "__zn_global_#{g.name}"
+        if g.is_static
+          emit_global_release(var, g)
+        else
+          emit("    if (__zn_once_done(&#{var}_once)) {\n")
+          @indent_level = 2
+          emit_global_release(var, g)
+          @indent_level = 1
+          emit("    }\n")
+        end
+      end
+      emit("}\n\n")
+      @indent_level = 0
+
+      emit("__attribute__((constructor)) static void __zn_globals_init(void) {\n")
+      emit("    __zn_tls_exit = __zn_tls_globals_release;\n") unless tls.empty?
+      emit("    atexit(__zn_globals_release);\n")
+      emit("}\n\n")
+    end
+
+    def emit_global_release(var, g)
+      type = g.value.resolved_type
+      if type.kind == TK_STRUCT
+        emit_value_type_field_releases(var, @sem.lookup_struct(type.name))
+      else
+        emit_indent
+        emit_release_call(var, type)
+        emit(";\n")
+      end
+    end
+
+    # Box a C expression of the given type into a ZnValue; structs are
+    # copied into a fresh allocation
+    def memo_box(c_expr, type)
+      case type.kind
+      when TK_INT, TK_FLOAT, TK_BOOL, TK_CHAR then "__zn_val_#{type.kind}(#{c_expr})"
+      when TK_STRUCT then "__zn_val_val(({ #{type.name} *__cp = malloc(sizeof(#{type.name})); *__cp = #{c_expr}; __cp; }))"
+      when TK_STRING then "__zn_val_string((ZnString*)#{c_expr})"
+      else "__zn_val_ref(#{c_expr})"
+      end
+    end
+
     private
 
     def find_named_arg(args, name)
@@ -29,34 +29,17 @@ module Zinc
 
       # Typedef to header (named struct tag for self-referential types)
       emit_header("typedef struct #{name} {\n")
-      emit_header("    int _rc;\n")
-      fd = sd.fields
-      while fd
-        case fd.type.kind
-        when TK_STRING
-          emit_header("    ZnString *#{fd.name};\n")
-        when TK_CLASS
-          if fd.type.name
-            emit_header("    struct #{fd.type.name} *#{fd.name};\n")
-          else
-            emit_header("    #{type_to_c(fd.type.kind)} #{fd.name};\n")
-          end
-        when TK_STRUCT
-          if fd.type.name
-            emit_header("    #{fd.type.name} #{fd.name};\n")
-          else
-            emit_header("    #{type_to_c(fd.type.kind)} #{fd.name};\n")
-          end
-        else
-          emit_header("    #{type_to_c(fd.type.kind)} #{fd.name};\n")
-        end
-        fd = fd.next
-      end
+      emit_header("    #{layout_prefix(sd)}int _rc;\n")
+      emit_class_fields(sd)
       emit_header("} #{name};\n\n")
 
       # Alloc function
       emit("static #{name}* __#{name}_alloc(void) {\n")
-      emit("    #{name} *self = calloc(1, sizeof(#{name}));\n")
+      if laid_out?(sd)
+        emit("    #{name} *self = memset(__zn_obj_alloc(sizeof(#{name})), 0, sizeof(#{name}));\n")
+      else
+        emit("    #{name} *self = calloc(1, sizeof(#{name}));\n")
+      end
       emit("    self->_rc = 1;\n")
       emit("    return self;\n")
       emit("}\n\n")
@@ -75,6 +58,149 @@ module Zinc
       emit("}\n\n")
     end
 
+    # Generate actor typedef (to header), reference counting, and a message
+    # struct, run and send function per handler (to C file). The handler
+    # bodies are generated with the other functions.
+    def gen_actor_def(node)
+      name = node.name
+      sd = @sem.lookup_struct(name)
+      return unless sd
+
+      emit_header("typedef struct #{name} {\n")
+      emit_header("    #{layout_prefix(sd)}ZnActor _actor;\n")
+      emit_class_fields(sd)
+      emit_header("} #{name};\n\n")
+
+      # Runs on whichever thread drops the last reference
+      emit("static void __#{name}_dispose(ZnActor *a) {\n")
+      emit("    #{name} *self = (#{name}*)a;\n")
+      emit_nested_releases('self->', sd)
+      emit("    free(self);\n")
+      emit("}\n\n")
+
+      emit("static #{name}* __#{name}_alloc(void) {\n")
+      emit("    return __zn_actor_alloc(sizeof(#{name}), __#{name}_dispose);\n")
+      emit("}\n\n")
+
+      emit("static void __#{name}_retain(#{name} *self) {\n")
+      emit("    __zn_actor_retain((ZnActor*)self);\n")
+      emit("}\n\n")
+
+      emit("static void __#{name}_release(#{name} *self) {\n")
+      emit("    __zn_actor_release((ZnActor*)self);\n")
+      emit("}\n\n")
+
+      node.handlers.each do |h|
+        emit('static ')
+        gen_func_proto(h, false, "__#{name}_#{h.name}")
+        emit(";\n")
+      end
+      emit("\n")
+      node.handlers.each { |h| gen_actor_message(sd, h) }
+    end
+
+    # The message owns its arguments: Strings are copied on send, the
+    # other sendable references retained, and all released after delivery
+    def gen_actor_message(sd, h)
+      base = "__#{sd.name}_#{h.name}"
+      params = h.params.map(&:name).zip(sd.handlers[h.name])
+
+      emit("typedef struct {\n")
+      emit("    ZnMsg _hdr;\n")
+      params.each { |pn, pt| emit("    #{c_type_str(pt)} #{pn};\n") }
+      emit("} #{base}_msg;\n\n")
+
+      emit("static void #{base}_run(ZnActor *a, ZnMsg *m) {\n")
+      emit("    #{base}_msg *msg = (#{base}_msg*)m;\n")
+      emit("    #{base}((#{sd.name}*)a#{params.map { |pn, _| ", msg->#{pn}" }.join});\n")
+      params.each do |pn, pt|
+        rp = rc_prefix(pt)
+        emit("    __#{rp}_release(msg->#{pn});\n") if rp
+      end
+      emit("    free(msg);\n")
+      emit("}\n\n")
+
+      # A String argument is only read (copied), so it may be a const parameter
+      sig = params.map { |pn, pt| ", #{pt.kind == TK_STRING ? 'const ' : ''}#{c_type_str(pt)} #{pn}" }.join
+      emit("static void #{base}_send(#{sd.name} *self#{sig}) {\n")
+      emit("    #{base}_msg *msg = malloc(sizeof(#{base}_msg));\n")
+      emit("    msg->_hdr._run = #{base}_run;\n")
+      params.each do |pn, pt|
+        if pt.kind == TK_STRING
+          emit("    msg->#{pn} = __zn_str_clone(#{pn});\n")
+        else
+          emit("    msg->#{pn} = #{pn};\n")
+          rp = rc_prefix(pt)
+          emit("    __#{rp}_retain(#{pn});\n") if rp
+        end
+      end
+      emit("    __zn_actor_send((ZnActor*)self, &msg->_hdr);\n")
+      emit("}\n\n")
+    end
+
+    def gen_actor_handlers(node)
+      node.handlers.each do |h|
+        emit('static ')
+        gen_func_proto(h, false, "__#{node.name}_#{h.name}")
+        emit(' ')
+        gen_func_body(h.body, TK_VOID)
+        emit("\n\n")
+      end
+    end
+
+    # Fields of a heap-allocated type (class, actor or anonymous object).
+    # The field after a @padded one starts a new cache line, so the padded
+    # field shares its line with nothing.
+    def emit_class_fields(sd)
+      fd = sd.fields
+      after_padded = false
+      while fd
+        pre = layout_prefix(fd)
+        pre = "_Alignas(ZN_CACHE_LINE) #{pre}" if after_padded && !fd.padded
+        case fd.type.kind
+        when TK_STRING
+          emit_header("    #{pre}ZnString *#{fd.name};\n")
+        when TK_CLASS
+          if fd.type.name
+            emit_header("    #{pre}struct #{fd.type.name} *#{fd.name};\n")
+          else
+            emit_header("    #{pre}#{type_to_c(fd.type.kind)} #{fd.name};\n")
+          end
+        when TK_STRUCT
+          if fd.type.name
+            emit_header("    #{pre}#{fd.type.name} #{fd.name};\n")
+          else
+            emit_header("    #{pre}#{type_to_c(fd.type.kind)} #{fd.name};\n")
+          end
+        else
+          emit_header("    #{pre}#{type_to_c(fd.type.kind)} #{fd.name};\n")
+        end
+        after_padded = fd.padded
+        fd = fd.next
+      end
+    end
+
+    # _Alignas specifiers for @align(n) and @padded on a type or field.
+    # On a type they go on its first member, which aligns the whole object
+    # and rounds its size up to a multiple of the alignment.
+    def layout_prefix(d)
+      pre = +''
+      pre << '_Alignas(ZN_CACHE_LINE) ' if d.padded
+      pre << "_Alignas(#{d.align}) " if d.align
+      pre
+    end
+
+    # Whether an object needs more alignment than malloc guarantees
+    def laid_out?(sd)
+      return true if sd.align || sd.padded
+      fd = sd.fields
+      while fd
+        return true if fd.align || fd.padded
+        fd = fd.next
+      end
+      false
+    end
+
     # Generate tuple typedefs (anonymous struct types with __ZnTuple prefix)
     def gen_tuple_typedefs
       @sem.struct_defs.each_value do |sd|
@@ -102,28 +228,7 @@ module Zinc
         # Typedef to header
         emit_header("typedef struct #{name} {\n")
         emit_header("    int _rc;\n")
-        fd = sd.fields
-        while fd
-          case fd.type.kind
-          when TK_STRING
-            emit_header("    ZnString *#{fd.name};\n")
-          when TK_CLASS
-            if fd.type.name
-              emit_header("    struct #{fd.type.name} *#{fd.name};\n")
-            else
-              emit_header("    #{type_to_c(fd.type.kind)} #{fd.name};\n")
-            end
-          when TK_STRUCT
-            if fd.type.name
-              emit_header("    #{fd.type.name} #{fd.name};\n")
-            else
-              emit_header("    #{type_to_c(fd.type.kind)} #{fd.name};\n")
-            end
-          else
-            emit_header("    #{type_to_c(fd.type.kind)} #{fd.name};\n")
-          end
-          fd = fd.next
-        end
+        emit_class_fields(sd)
         emit_header("} #{name};\n\n")
 
         # Alloc
@@ -148,29 +253,25 @@ module Zinc
       end
     end
 
-    # Emit release calls for ref-counted fields in a struct/class
-    def emit_nested_releases(prefix, sd)
+    # Emit release (or, with op 'retain', retain) calls for ref-counted
+    # fields in a struct/class
+    def emit_nested_releases(prefix, sd, op = 'release')
       fd = sd.fields
       while fd
         unless fd.is_weak
           ft = fd.type
           if ft
             case ft.kind
-            when TK_STRING
-              emit("        __zn_str_release(#{prefix}#{fd.name});\n")
-            when TK_CLASS
-              emit("        __#{ft.name}_release(#{prefix}#{fd.name});\n") if ft.name
-            when TK_ARRAY
-              emit("        __zn_arr_release(#{prefix}#{fd.name});\n")
-            when TK_HASH
-              emit("        __zn_hash_release(#{prefix}#{fd.name});\n")
             when TK_STRUCT
               if ft.name
                 inner = @sem.lookup_struct(ft.name)
                 if inner
-                  emit_nested_releases("#{prefix}#{fd.name}.", inner)
+                  emit_nested_releases("#{prefix}#{fd.name}.", inner, op)
                 end
               end
+            else
+              rp = rc_prefix(ft)
+              emit("        __#{rp}_#{op}(#{prefix}#{fd.name});\n") if rp
             end
           end
         end
@@ -267,8 +368,11 @@ module Zinc
           emit("static void __zn_ret_#{name}(void *p);\n")
           emit("static void __zn_rel_#{name}(void *p);\n")
         else
+          emit("static void __zn_val_ret_#{name}(void *p);\n")
           emit("static void __zn_val_rel_#{name}(void *p);\n")
         end
+        # Actors compare by identity, and their fields belong to the handlers
+        next if sd.is_actor
         emit("static unsigned int __zn_hash_#{name}(ZnValue v);\n")
         emit("static bool __zn_eq_#{name}(ZnValue a, ZnValue b);\n")
       end
@@ -285,6 +389,18 @@ module Zinc
           emit("static void __zn_rel_#{name}(void *p) { __#{name}_release((#{name}*)p); }\n")
         end
 
+        # Value-type retain, for a boxed copy that now shares the fields
+        unless sd.is_class
+          if struct_has_rc_fields(sd)
+            emit("static void __zn_val_ret_#{name}(void *p) {\n")
+            emit("    #{name} *self = (#{name}*)p;\n")
+            emit_nested_releases('self->', sd, 'retain')
+            emit("}\n")
+          else
+            emit("static void __zn_val_ret_#{name}(void *p) { (void)p; }\n")
+          end
+        end
+
         # Value-type release
         unless sd.is_class
           emit("static void __zn_val_rel_#{name}(void *p) {\n")
@@ -294,14 +410,6 @@ module Zinc
             ft = fd.type
             if ft
               case ft.kind
-              when TK_STRING
-                emit("    __zn_str_release(self->#{fd.name});\n")
-              when TK_ARRAY
-                emit("    __zn_arr_release(self->#{fd.name});\n")
-              when TK_HASH
-                emit("    __zn_hash_release(self->#{fd.name});\n")
-              when TK_CLASS
-                emit("    __#{ft.name}_release(self->#{fd.name});\n") if ft.name
               when TK_STRUCT
                 if ft.name
                   inner = @sem.lookup_struct(ft.name)
@@ -309,6 +417,9 @@ module Zinc
                     emit_nested_releases("self->#{fd.name}.", inner)
                   end
                 end
+              else
+                rp = rc_prefix(ft)
+                emit("    __#{rp}_release(self->#{fd.name});\n") if rp
               end
             end
             fd = fd.next
@@ -317,6 +428,8 @@ module Zinc
           emit("}\n")
         end
 
+        next if sd.is_actor
+
         # Hashcode — field-by-field djb2
         emit("static unsigned int __zn_hash_#{name}(ZnValue v) {\n")
         emit("    #{name} *self = (#{name}*)v.as.ptr;\n")
@@ -343,8 +456,9 @@ module Zinc
               if ft.name
                 emit("    { ZnValue __sv; __sv.tag = ZN_TAG_VAL; __sv.as.ptr = &self->#{fname}; h = ((h << 5) + h) ^ __zn_hash_#{ft.name}(__sv); }\n")
               end
-            when TK_ARRAY, TK_HASH
-              emit("    h = ((h << 5) + h) ^ (unsigned int)((uintptr_t)self->#{fname});\n")
+            else
+              # Other runtime types hash by identity
+              emit("    h = ((h << 5) + h) ^ (unsigned int)((uintptr_t)self->#{fname});\n") if ref_type?(ft.kind)
             end
           end
           fd = fd.next
@@ -368,7 +482,7 @@ module Zinc
             emit("pa->#{fname} == pb->#{fname}")
           elsif ft&.kind == TK_STRUCT && ft.name
             emit("({ ZnValue __a, __b; __a.as.ptr = &pa->#{fname}; __b.as.ptr = &pb->#{fname}; __zn_eq_#{ft.name}(__a, __b); })")
-          elsif ft && (ft.kind == TK_ARRAY || ft.kind == TK_HASH)
+          elsif ft && Zinc.runtime_ptr_kind?(ft.kind)
             emit("pa->#{fname} == pb->#{fname}")
           else
             emit("pa->#{fname} == pb->#{fname}")
@@ -381,5 +495,51 @@ module Zinc
         emit("}\n\n")
       end
     end
+
+    # Three-way comparators (lexicographic over fields) for struct and tuple
+    # Heap elements and the structs nested in them, plus one specialized
+    # set of sift loops per element type
+    def gen_heap_helpers
+      heap_elems = @sem.heap_elems.keys
+      return if heap_elems.empty?
+
+      ordered = []
+      visit = lambda do |name|
+        return if ordered.include?(name)
+        sd = @sem.lookup_struct(name)
+        return unless sd
+        fd = sd.fields
+        while fd
+          visit.call(fd.type.name) if fd.type&.kind == TK_STRUCT && fd.type.name
+          fd = fd.next
+        end
+        ordered << name
+      end
+      heap_elems.each { |name| visit.call(name) }
+
+      ordered.each do |name|
+        emit("static int __zn_cmp_#{name}(ZnValue a, ZnValue b) {\n")
+        emit("    #{name} *pa = (#{name}*)a.as.ptr, *pb = (#{name}*)b.as.ptr;\n")
+        emit("    int c;\n")
+        fd = @sem.lookup_struct(name).fields
+        while fd
+          ft = fd.type
+          fname = fd.name
+          case ft.kind
+          when TK_STRING
+            emit("    if ((c = __zn_cmp_str(__zn_val_string(pa->#{fname}), __zn_val_string(pb->#{fname})))) return c;\n")
+          when TK_STRUCT
+            emit("    { ZnValue __a, __b; __a.as.ptr = &pa->#{fname}; __b.as.ptr = &pb->#{fname}; if ((c = __zn_cmp_#{ft.name}(__a, __b))) return c; }\n")
+          else
+            emit("    if ((c = (pa->#{fname} > pb->#{fname}) - (pa->#{fname} < pb->#{fname}))) return c;\n")
+          end
+          fd = fd.next
+        end
+        emit("    return 0;\n")
+        emit("}\n")
+      end
+      heap_elems.each { |name| emit("ZN_HEAP_SPECIALIZE(#{name}, __zn_cmp_#{name})\n") }
+      emit("\n")
+    end
   end
 end
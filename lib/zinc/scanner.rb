@@ -11,9 +11,17 @@ module Zinc
       'break' => :BREAK, 'continue' => :CONTINUE,
       'func' => :FUNC, 'return' => :RETURN,
       'extern' => :EXTERN, 'struct' => :STRUCT, 'class' => :CLASS, 'weak' => :WEAK,
+      'actor' => :ACTOR, 'receive' => :RECEIVE, 'threadlocal' => :THREADLOCAL, 'inout' => :INOUT,
       'true' => :BOOL_LIT, 'false' => :BOOL_LIT,
       'int' => :TYPE_INT, 'float' => :TYPE_FLOAT,
       'String' => :TYPE_STRING, 'bool' => :TYPE_BOOL, 'char' => :TYPE_CHAR,
+      'Rope' => :TYPE_ROPE, 'Heap' => :TYPE_HEAP, 'Deque' => :TYPE_DEQUE,
+      'Bitset' => :TYPE_BITSET, 'OrderedMap' => :TYPE_ORDERED_MAP, 'Trie' => :TYPE_TRIE,
+      'LruCache' => :TYPE_LRU_CACHE, 'SortedIndex' => :TYPE_SORTED_INDEX,
+      'Matrix' => :TYPE_MATRIX, 'SlotMap' => :TYPE_SLOT_MAP,
+      'ConcurrentHash' => :TYPE_CONCURRENT_HASH, 'AtomicInt' => :TYPE_ATOMIC_INT,
+      'AtomicBool' => :TYPE_ATOMIC_BOOL, 'Mutex' => :TYPE_MUTEX, 'RwLock' => :TYPE_RWLOCK,
+      'Once' => :TYPE_ONCE, 'Barrier' => :TYPE_BARRIER, 'Shared' => :TYPE_SHARED,
     }.freeze
 
     def initialize(source)
@@ -182,6 +190,8 @@ module Zinc
       if @ss.scan(/!/)  then @tokens << [:NOT, '!', @line]; return; end
       if @ss.scan(/\./) then @tokens << [:DOT, '.', @line]; return; end
       if @ss.scan(/\?/) then @tokens << [:QUESTION, '?', @line]; return; end
+      if @ss.scan(/@/)  then @tokens << [:AT, '@', @line]; return; end
+      if @ss.scan(/&/)  then @tokens << [:AMP, '&', @line]; return; end
 
       # Unknown character
       ch = @ss.getch
@@ -2,16 +2,23 @@
 
 module Zinc
   # Struct field definition (for struct registry)
-  StructFieldDef = Struct.new(:name, :type, :has_default, :is_const, :is_weak, :default_value, :next) do
-    def initialize(name = nil, type = nil, has_default = false, is_const = false, is_weak = false, default_value = nil, next_field = nil)
-      super(name, type, has_default, is_const, is_weak, default_value, next_field)
+  # align: byte alignment from @align(n); padded: @padded gives the field
+  # a cache line of its own
+  StructFieldDef = Struct.new(:name, :type, :has_default, :is_const, :is_weak, :default_value, :next,
+                              :align, :padded) do
+    def initialize(name = nil, type = nil, has_default = false, is_const = false, is_weak = false, default_value = nil, next_field = nil,
+                   align = nil, padded = false)
+      super(name, type, has_default, is_const, is_weak, default_value, next_field, align, padded)
     end
   end
 
   # Struct definition (for struct registry)
-  StructDef = Struct.new(:name, :fields, :field_count, :is_class) do
-    def initialize(name = nil, fields = nil, field_count = 0, is_class = false)
-      super(name, fields, field_count, is_class)
+  # handlers: receive handler name -> parameter types, for actors
+  # align, padded: layout attributes of a class or actor, as on fields
+  StructDef = Struct.new(:name, :fields, :field_count, :is_class, :is_actor, :handlers, :align, :padded) do
+    def initialize(name = nil, fields = nil, field_count = 0, is_class = false, is_actor = false, handlers = nil,
+                   align = nil, padded = false)
+      super(name, fields, field_count, is_class, is_actor, handlers, align, padded)
     end
 
     def lookup_field(fname)
@@ -25,24 +32,37 @@ module Zinc
   end
 
   # Symbol table entry
-  Symbol = Struct.new(:name, :type, :is_const, :is_function, :is_extern, :param_count, :param_types) do
-    def initialize(name = nil, type = nil, is_const = false, is_function = false, is_extern = false, param_count = 0, param_types = nil)
-      super(name, type, is_const, is_function, is_extern, param_count, param_types)
+  # global: the GlobalDecl of a top-level variable
+  # uses_globals: names of the main-thread globals a function reaches,
+  # with "@f" standing for the memo table of function f
+  # is_inout: an inout parameter; inout_params: which of a function's are
+  # reaches_globals: names of the var globals a function reaches
+  Symbol = Struct.new(:name, :type, :is_const, :is_function, :is_extern, :param_count, :param_types,
+                      :global, :uses_globals, :is_inout, :inout_params, :reaches_globals) do
+    def initialize(name = nil, type = nil, is_const = false, is_function = false, is_extern = false, param_count = 0, param_types = nil,
+                   global = nil, uses_globals = [], is_inout = false, inout_params = [], reaches_globals = [])
+      super(name, type, is_const, is_function, is_extern, param_count, param_types, global, uses_globals,
+            is_inout, inout_params, reaches_globals)
     end
   end
 
   class Semantic
-    attr_reader :error_count, :struct_defs
+    attr_reader :error_count, :struct_defs, :heap_elems, :elem_fns
 
     def initialize
       @scopes = [{}]  # stack of hashes (name -> Symbol)
       @struct_defs = {}  # name -> StructDef
+      @heap_elems = {}  # struct name -> true, for Heap<T> comparator specialization
+      @elem_fns = {}  # function name -> element Type, for group_count/group_sum wrappers
       @error_count = 0
       @in_loop = 0
       @in_function = false
       @current_func_return_type = nil
+      @current_actor = nil
       @loop_result_type = nil
       @loop_result_set = false
+      @global_uses = nil  # main-thread globals reached by the function being analyzed
+      @global_reach = nil  # var globals reached by the function being analyzed
     end
 
     def analyze(root)
@@ -82,6 +102,8 @@ module Zinc
           sem_error(expr.line, "undefined variable '#{expr.name}'")
           result = TK_UNKNOWN
         else
+          note_global_use(expr, sym.global) if sym.global
+          expr.by_ref = true if sym.is_inout
           expr.resolved_type = sym.type.clone
           return expr.resolved_type
         end
@@ -108,7 +130,7 @@ module Zinc
           result = get_expr_type(expr.operand).kind
         end
       when AST::Call
-        if expr.name == 'print'
+        if expr.name == 'print' || expr.name == 'await_actors'
           result = TK_VOID
         else
           sym = lookup(expr.name)
@@ -120,8 +142,7 @@ module Zinc
             result = TK_UNKNOWN
           else
             expr.resolved_type = sym.type.clone
-            rk = sym.type.kind
-            if [TK_STRING, TK_CLASS, TK_ARRAY, TK_HASH].include?(rk)
+            if Zinc.ref_kind?(sym.type.kind)
               expr.is_fresh_alloc = true
             end
             return expr.resolved_type
@@ -133,7 +154,7 @@ module Zinc
         result = get_expr_type(expr.value).kind
       when AST::IncDec
         result = TK_INT
-      when AST::FieldAccess
+      when AST::FieldAccess, AST::MethodCall, AST::Construct
         result = expr.resolved_type ? expr.resolved_type.kind : TK_UNKNOWN
       when AST::Index
         result = expr.resolved_type ? expr.resolved_type.kind : TK_UNKNOWN
@@ -166,7 +187,7 @@ module Zinc
     private
 
     def ref_type?(kind)
-      [TK_STRING, TK_CLASS, TK_ARRAY, TK_HASH].include?(kind)
+      Zinc.ref_kind?(kind)
     end
 
     def sem_error(line, msg)
@@ -226,14 +247,24 @@ module Zinc
     TYPE_KIND_SUFFIX = {
       TK_INT => 'int', TK_FLOAT => 'float', TK_STRING => 'str',
       TK_BOOL => 'bool', TK_CHAR => 'char',
-      TK_ARRAY => 'arr', TK_HASH => 'hash',
+      TK_ARRAY => 'arr', TK_HASH => 'hash', TK_ROPE => 'rope', TK_HEAP => 'heap',
+      TK_DEQUE => 'deque', TK_BITSET => 'bitset', TK_ORDERED_MAP => 'omap',
+      TK_TRIE => 'trie', TK_LRU_CACHE => 'lru', TK_SORTED_INDEX => 'sidx', TK_MATRIX => 'mat',
+      TK_SLOT_MAP => 'slotmap', TK_CONCURRENT_HASH => 'chash', TK_ATOMIC_INT => 'atomic_int',
+      TK_ATOMIC_BOOL => 'atomic_bool', TK_MUTEX => 'mutex', TK_RWLOCK => 'rwlock', TK_ONCE => 'once',
+      TK_BARRIER => 'barrier', TK_SHARED => 'shared',
     }.freeze
 
     TYPE_KIND_NAME = {
       TK_INT => 'int', TK_FLOAT => 'float', TK_STRING => 'string',
       TK_BOOL => 'bool', TK_CHAR => 'char', TK_VOID => 'void',
       TK_STRUCT => 'struct', TK_CLASS => 'class',
-      TK_ARRAY => 'array', TK_HASH => 'hash',
+      TK_ARRAY => 'array', TK_HASH => 'hash', TK_ROPE => 'rope', TK_HEAP => 'heap',
+      TK_DEQUE => 'deque', TK_BITSET => 'bitset', TK_ORDERED_MAP => 'ordered map',
+      TK_TRIE => 'trie', TK_LRU_CACHE => 'lru cache', TK_SORTED_INDEX => 'sorted index',
+      TK_MATRIX => 'matrix', TK_SLOT_MAP => 'slot map', TK_CONCURRENT_HASH => 'concurrent hash',
+      TK_ATOMIC_INT => 'atomic int', TK_ATOMIC_BOOL => 'atomic bool', TK_MUTEX => 'mutex',
+      TK_RWLOCK => 'rwlock', TK_ONCE => 'once', TK_BARRIER => 'barrier', TK_SHARED => 'shared',
     }.freeze
 
     def type_kind_suffix(t)
@@ -300,7 +331,10 @@ module Zinc
 
     # Resolve TypeInfo with object/tuple fields into a registered struct/class
     def resolve_type_info(ti)
-      return unless ti&.fields
+      return unless ti
+      resolve_type_info(ti.key) if ti.key
+      resolve_type_info(ti.elem) if ti.elem
+      return unless ti.fields
 
       if ti.is_tuple
         # Recursively resolve nested types
@@ -418,6 +452,10 @@ module Zinc
         obj = tgt.object
         obj_kind = obj.resolved_type&.kind || TK_UNKNOWN
         obj_sn = obj.resolved_type&.name
+        if obj_kind == TK_SHARED
+          sem_error(line, "cannot #{verb} a shared value; publish a new version instead")
+          return nil
+        end
         if (obj_kind == TK_STRUCT || obj_kind == TK_CLASS) && obj_sn
           fsd = lookup_struct(obj_sn)
           if fsd
@@ -445,6 +483,10 @@ module Zinc
         obj_type = tgt.object.resolved_type&.kind || TK_UNKNOWN
         if obj_type == TK_STRING
           sem_error(line, "strings are immutable")
+        elsif obj_type == TK_ROPE
+          sem_error(line, "ropes are immutable")
+        elsif obj_type == TK_SHARED
+          sem_error(line, "cannot #{verb} a shared value; publish a new version instead")
         end
       else
         sem_error(line, "invalid assignment target")
@@ -494,6 +536,12 @@ module Zinc
       when AST::Call
         analyze_call(expr)
 
+      when AST::MethodCall
+        analyze_method_call(expr)
+
+      when AST::Construct
+        analyze_construct(expr)
+
       when AST::FieldAccess
         analyze_field_access(expr)
 
@@ -504,6 +552,11 @@ module Zinc
         analyze_expr(expr.value)
         get_expr_type(expr.value)
 
+      when AST::InoutArg
+        sem_error(expr.line, "'&' can only pass an argument to an inout parameter")
+        analyze_expr(expr.target)
+        expr.resolved_type = get_expr_type(expr.target).clone
+
       when AST::Tuple
         analyze_tuple(expr)
 
@@ -549,7 +602,10 @@ module Zinc
               sem_error(expr.line, "struct '#{name}' has no field '#{a.name}'")
             end
             analyze_expr(a.value)
-            get_expr_type(a.value)
+            vt = get_expr_type(a.value)
+            if sd.is_actor && fd && vt.kind != TK_UNKNOWN && !sendable_type?(vt)
+              sem_error(expr.line, "actor field '#{a.name}' must be initialized with a sendable value, got #{builtin_type_name(vt)}")
+            end
           else
             sem_error(expr.line, "struct '#{name}' requires named arguments")
             analyze_expr(a)
@@ -579,6 +635,16 @@ module Zinc
         return
       end
 
+      if name == 'await_actors'
+        if !expr.args.empty?
+          sem_error(expr.line, "await_actors expects no arguments, got #{expr.args.size}")
+        elsif @current_actor
+          sem_error(expr.line, "await_actors cannot be called from an actor handler")
+        end
+        expr.resolved_type = Type.new(TK_VOID)
+        return
+      end
+
       # Built-in print
       if name == 'print'
         expr.args.each do |a|
@@ -591,8 +657,8 @@ module Zinc
         else
           arg = expr.args[0]
           ak = arg.resolved_type&.kind || TK_UNKNOWN
-          if ak != TK_STRING && ak != TK_UNKNOWN
-            sem_error(expr.line, "print argument must be a String")
+          if ak != TK_STRING && ak != TK_ROPE && ak != TK_UNKNOWN
+            sem_error(expr.line, "print argument must be a String or Rope")
           end
         end
         if !expr.resolved_type
@@ -608,16 +674,39 @@ module Zinc
         sem_error(expr.line, "undefined function '#{name}'")
       elsif !sym.is_function
         sem_error(expr.line, "'#{name}' is not a function")
+      elsif !sym.uses_globals.empty?
+        if @current_actor
+          use = sym.uses_globals.first
+          if use == "@#{name}"
+            sem_error(expr.line, "actor handler cannot call @memo function '#{name}'; its cache belongs to the main thread")
+          elsif use.start_with?('@')
+            sem_error(expr.line, "actor handler cannot call '#{name}', which uses the @memo cache of '#{use[1..]}'")
+          else
+            sem_error(expr.line, "actor handler cannot call '#{name}', which uses global '#{use}'")
+          end
+        elsif @global_uses
+          @global_uses.concat(sym.uses_globals)
+        end
       end
+      @global_reach&.concat(sym.reaches_globals) if sym&.is_function
 
       # Analyze arguments
       arg_count = 0
-      expr.args.each do |a|
-        analyze_expr(a)
-        get_expr_type(a)
-        check_not_void(expr.line, a, 'as function argument')
+      inout_paths = []
+      expr.args.each_with_index do |a, i|
+        inout = sym&.is_function && sym.inout_params[i]
+        if a.is_a?(AST::InoutArg)
+          path = analyze_inout_arg(expr, a, i, inout)
+          inout_paths << [a, *path] if path
+        else
+          analyze_expr(a)
+          get_expr_type(a)
+          check_not_void(expr.line, a, 'as function argument')
+          sem_error(expr.line, "argument #{i + 1} of '#{name}' is inout; pass a variable as &name") if inout
+        end
         arg_count += 1
       end
+      check_inout_exclusive(expr, sym, inout_paths) unless inout_paths.empty?
 
       # Arity and type checking
       if sym&.is_function && sym.param_count >= 0
@@ -630,12 +719,134 @@ module Zinc
             actual = a.resolved_type&.kind || TK_UNKNOWN
             if actual != TK_UNKNOWN && expected != TK_UNKNOWN && actual != expected
               sem_error(expr.line, "argument #{i + 1} of '#{name}' expects #{type_kind_name(expected)}, got #{type_kind_name(actual)}")
+            elsif a.is_a?(AST::InoutArg) && actual == expected && !inout_type_matches?(sym.param_types[i], a.resolved_type)
+              sem_error(expr.line, "inout argument #{i + 1} of '#{name}' must have type #{builtin_type_name(sym.param_types[i])}, got #{builtin_type_name(a.resolved_type)}")
             end
           end
         end
       end
     end
 
+    # &target names a mutable variable, or a field reached from one through
+    # structs and classes. Returns the field path, root first, and the
+    # anchor: the class nearest the written field with the fields below it,
+    # since any other reference to that object reaches the same storage.
+    def analyze_inout_arg(call, arg, i, inout)
+      analyze_expr(arg.target)
+      arg.resolved_type = get_expr_type(arg.target).clone
+      unless inout
+        sem_error(call.line, "argument #{i + 1} of '#{call.name}' is not inout; pass it without '&'")
+        return nil
+      end
+      path = []
+      anchor = nil
+      cur = arg.target
+      while cur.is_a?(AST::FieldAccess)
+        ok = [TK_STRUCT, TK_CLASS].include?(cur.object.resolved_type&.kind) && cur.object.resolved_type.name
+        unless ok
+          sem_error(call.line, "inout argument must be a variable or a field of one")
+          return nil
+        end
+        path.unshift(cur.field)
+        cname = cur.object.resolved_type.name
+        anchor ||= [cname, path.dup] if lookup_struct(cname)&.is_class
+        cur = cur.object
+      end
+      unless cur.is_a?(AST::Ident)
+        sem_error(call.line, "inout argument must be a variable or a field of one")
+        return nil
+      end
+      path.unshift(cur.name)
+      check_lvalue(arg.target, call.line, 'modify')
+      [path, anchor]
+    end
+
+    # While a call runs, its inout arguments are the only way to reach
+    # their variables. A borrowed (non-scalar) argument may not mention the
+    # variable, two inout arguments may only name disjoint fields of it, and
+    # the callee may not use it as a global. Otherwise a write through one
+    # would free a reference the other still holds. A field of a class
+    # object can also be reached through any other reference to the object,
+    # so there the check is by class rather than by variable name.
+    def check_inout_exclusive(expr, sym, inout_paths)
+      borrowed = expr.args.reject { |a| a.is_a?(AST::InoutArg) || SCALAR_KINDS.include?(a.resolved_type&.kind) }
+      others = []
+      borrowed.each { |a| collect_idents(a, others) }
+      inout_paths.each_with_index do |(arg, path, anchor), k|
+        root = path.first
+        if others.include?(root)
+          sem_error(expr.line, "overlapping access to '#{root}': it is passed inout to '#{expr.name}' and used by another argument")
+        elsif anchor && borrowed.any? { |a| mentions_class?(a, anchor.first) }
+          sem_error(expr.line, "overlapping access to '#{root}': another argument may refer to the same #{anchor.first} object")
+        end
+        inout_paths[0...k].each do |_, prev, prev_anchor|
+          n = [path.size, prev.size].min
+          if prev[0, n] == path[0, n]
+            sem_error(expr.line, "overlapping access to '#{root}': it is passed inout to '#{expr.name}' twice")
+          elsif anchor && prev_anchor && anchor.first == prev_anchor.first &&
+                anchor.last[0, [anchor.last.size, prev_anchor.last.size].min] ==
+                prev_anchor.last[0, [anchor.last.size, prev_anchor.last.size].min]
+            sem_error(expr.line, "overlapping access to '#{root}': another inout argument may name the same #{anchor.first} field")
+          end
+        end
+        g = root_global(arg.target)
+        if g && sym.reaches_globals.include?(g.name)
+          sem_error(expr.line, "overlapping access to '#{root}': '#{expr.name}' also uses the global")
+        end
+      end
+    end
+
+    # The callee writes through the pointer, so the types must agree exactly
+    def inout_type_matches?(param, arg)
+      return true if param.kind == TK_UNKNOWN || arg.kind == TK_UNKNOWN
+      return false if param.is_optional != arg.is_optional
+      return param.name == arg.name if [TK_STRUCT, TK_CLASS].include?(param.kind)
+      builtin_arg_matches?(param, arg) && builtin_arg_matches?(arg, param)
+    end
+
+    def root_global(target)
+      target = target.object while target.is_a?(AST::FieldAccess)
+      target.global
+    end
+
+    # Whether any part of the expression has a type through which an object
+    # of class cname can be reached
+    def mentions_class?(node, cname)
+      case node
+      when AST::Node
+        return true if node.resolved_type && type_reaches_class?(node.resolved_type, cname, {})
+        node.instance_variables.any? { |iv| mentions_class?(node.instance_variable_get(iv), cname) }
+      when Array then node.any? { |n| mentions_class?(n, cname) }
+      else false
+      end
+    end
+
+    def type_reaches_class?(type, cname, seen)
+      return false unless type
+      return true if type_reaches_class?(type.elem, cname, seen) || type_reaches_class?(type.key, cname, seen)
+      return false unless [TK_STRUCT, TK_CLASS].include?(type.kind) && type.name
+      return true if type.name == cname
+      return false if seen[type.name]
+      seen[type.name] = true
+      sd = lookup_struct(type.name)
+      fd = sd&.fields
+      while fd
+        return true if type_reaches_class?(fd.type, cname, seen)
+        fd = fd.next
+      end
+      false
+    end
+
+    def collect_idents(node, out)
+      case node
+      when AST::Ident then out << node.name
+      when AST::Node
+        node.instance_variables.each { |iv| collect_idents(node.instance_variable_get(iv), out) }
+      when Array then node.each { |n| collect_idents(n, out) }
+      end
+      out
+    end
+
     def analyze_field_access(expr)
       analyze_expr(expr.object)
       get_expr_type(expr.object)
@@ -654,12 +865,21 @@ module Zinc
         return
       end
 
-      # Array/Hash .length
-      if (obj_kind == TK_ARRAY || obj_kind == TK_HASH) && field == 'length'
+      # .length of the other runtime types
+      if Zinc.sized_kind?(obj_kind) && field == 'length'
         if !expr.resolved_type then expr.resolved_type = Type.new(TK_INT)
         else expr.resolved_type.kind = TK_INT end
         return
       end
+      if obj_kind == TK_MATRIX && (field == 'rows' || field == 'cols')
+        expr.resolved_type = Type.new(TK_INT)
+        return
+      end
+
+      if obj_kind == TK_SHARED
+        analyze_shared_field(expr)
+        return
+      end
 
       # Struct/class field access
       obj_struct_name = obj.resolved_type&.name
@@ -688,6 +908,9 @@ module Zinc
         sem_error(expr.line, "struct '#{obj_struct_name}' has no field '#{field}'")
         return
       end
+      if sd.is_actor && !(obj.is_a?(AST::Ident) && obj.name == 'self' && @current_actor == sd.name)
+        sem_error(expr.line, "state of actor '#{sd.name}' is only accessible through self in its handlers")
+      end
 
       expr.resolved_type = fd.type.clone
     end
@@ -695,26 +918,79 @@ module Zinc
     def analyze_index(expr)
       analyze_expr(expr.object)
       analyze_expr(expr.index)
+      analyze_expr(expr.col)
       obj_type = get_expr_type(expr.object).kind
       idx_type = get_expr_type(expr.index).kind
 
-      if obj_type == TK_ARRAY
+      if obj_type == TK_MATRIX
+        expr.resolved_type = Type.new(TK_FLOAT)
+        col_type = expr.col ? get_expr_type(expr.col).kind : TK_UNKNOWN
+        if !expr.col
+          sem_error(expr.line, "matrix index needs a row and a column, as m[i, j]")
+        elsif [idx_type, col_type].any? { |k| k != TK_INT && k != TK_UNKNOWN }
+          sem_error(expr.line, "matrix indices must be int")
+        end
+      elsif expr.col && obj_type != TK_UNKNOWN
+        sem_error(expr.line, "only a matrix takes two indices")
+      elsif obj_type == TK_ARRAY || obj_type == TK_DEQUE
         obj_t = expr.object.resolved_type
         expr.resolved_type = (obj_t&.elem) ? obj_t.elem.clone : Type.new(TK_UNKNOWN)
         if idx_type != TK_INT
-          sem_error(expr.line, "array index must be an int")
+          sem_error(expr.line, "#{type_kind_name(obj_type)} index must be an int")
         end
       elsif obj_type == TK_HASH
         obj_t = expr.object.resolved_type
         expr.resolved_type = (obj_t&.elem) ? obj_t.elem.clone : Type.new(TK_UNKNOWN)
-      elsif obj_type == TK_STRING
+      elsif obj_type == TK_ORDERED_MAP
+        obj_t = expr.object.resolved_type
+        expr.resolved_type = (obj_t&.elem) ? obj_t.elem.clone : Type.new(TK_UNKNOWN)
+        key = obj_t&.key&.kind || TK_UNKNOWN
+        if idx_type != key && idx_type != TK_UNKNOWN && key != TK_UNKNOWN
+          sem_error(expr.line, "ordered map key must be #{type_kind_name(key)}, got #{type_kind_name(idx_type)}")
+        end
+      elsif obj_type == TK_CONCURRENT_HASH
+        obj_t = expr.object.resolved_type
+        expr.resolved_type = (obj_t&.elem) ? obj_t.elem.clone : Type.new(TK_UNKNOWN)
+        # A read hands back the table's value copied, so the caller owns it
+        expr.is_fresh_alloc = true if Zinc.ref_kind?(expr.resolved_type.kind)
+        key = obj_t&.key&.kind || TK_UNKNOWN
+        if idx_type != key && idx_type != TK_UNKNOWN && key != TK_UNKNOWN
+          sem_error(expr.line, "concurrent hash key must be #{type_kind_name(key)}, got #{type_kind_name(idx_type)}")
+        end
+      elsif obj_type == TK_SHARED
+        version = shared_version(expr.object.resolved_type)
+        if version.kind == TK_HASH || version.kind == TK_ARRAY
+          expr.resolved_type = version.elem ? version.elem.clone : Type.new(TK_UNKNOWN)
+          # Copied out of the version, so the caller owns it
+          expr.is_fresh_alloc = true if Zinc.ref_kind?(expr.resolved_type.kind)
+          key = version.kind == TK_HASH ? version.key&.kind || TK_UNKNOWN : TK_INT
+          if idx_type != key && idx_type != TK_UNKNOWN && key != TK_UNKNOWN
+            what = version.kind == TK_HASH ? 'key' : 'index'
+            sem_error(expr.line, "shared #{type_kind_name(version.kind)} #{what} must be #{type_kind_name(key)}, got #{type_kind_name(idx_type)}")
+          end
+        elsif version.kind != TK_UNKNOWN
+          sem_error(expr.line, "#{builtin_type_name(expr.object.resolved_type)} cannot be indexed")
+        end
+      elsif obj_type == TK_SLOT_MAP
+        obj_t = expr.object.resolved_type
+        expr.resolved_type = (obj_t&.elem) ? obj_t.elem.clone : Type.new(TK_UNKNOWN)
+        if idx_type != TK_INT && idx_type != TK_UNKNOWN
+          sem_error(expr.line, "slot map handle must be an int")
+        end
+      elsif obj_type == TK_TRIE
+        obj_t = expr.object.resolved_type
+        expr.resolved_type = (obj_t&.elem) ? obj_t.elem.clone : Type.new(TK_UNKNOWN)
+        if idx_type != TK_STRING && idx_type != TK_UNKNOWN
+          sem_error(expr.line, "trie key must be string, got #{type_kind_name(idx_type)}")
+        end
+      elsif obj_type == TK_STRING || obj_type == TK_ROPE
         if !expr.resolved_type then expr.resolved_type = Type.new(TK_CHAR)
         else expr.resolved_type.kind = TK_CHAR end
         if idx_type != TK_INT && idx_type != TK_UNKNOWN
-          sem_error(expr.line, "string index must be an integer")
+          sem_error(expr.line, "#{type_kind_name(obj_type)} index must be an integer")
         end
       elsif obj_type != TK_UNKNOWN
-        sem_error(expr.line, "index operator requires an array, hash, or string")
+        sem_error(expr.line, "index operator requires an array, deque, hash, concurrent hash, ordered map, trie, slot map, string, rope, or matrix")
       end
     end
 
@@ -955,6 +1231,9 @@ module Zinc
         type = get_expr_type(node.value)
         add_symbol(node.line, node.name, type, node.is_const)
 
+      when AST::GlobalDecl
+        analyze_global_decl(node)
+
       when AST::If
         analyze_if(node)
 
@@ -1166,6 +1445,7 @@ module Zinc
         return
       end
       sd = register_struct(def_name, is_class)
+      check_layout_attrs(node, sd, is_class)
 
       fields_head = nil
       fields_tail = nil
@@ -1190,6 +1470,7 @@ module Zinc
         fd.name = field.name
         fd.is_const = field.is_const
         fd.is_weak = field.is_weak if is_class
+        check_layout_attrs(field, fd, is_class)
 
         if field.type_info
           resolve_type_info(field.type_info)
@@ -1207,6 +1488,7 @@ module Zinc
             fsd = lookup_struct(sn)
             fd.type.kind = TK_CLASS if fsd&.is_class
           end
+          check_type_params(field.line, fd.type)
           fd.has_default = false
         elsif field.default_value
           analyze_expr(field.default_value)
@@ -1235,6 +1517,217 @@ module Zinc
 
       sd.fields = fields_head
       sd.field_count = field_count
+      analyze_actor_handlers(node, sd) if node.is_actor
+    end
+
+    # @align(n) and @padded lay out a class or actor, or one of its fields,
+    # on n-byte or cache-line boundaries. A struct is copied inline into
+    # arrays, hashes and other values, which do not keep such alignment,
+    # so structs take no layout attributes.
+    def check_layout_attrs(node, target, is_class)
+      what = node.is_a?(AST::StructField) ? 'field' : 'type'
+      node.attrs.each do |a|
+        case a.name
+        when 'align'
+          n = a.arg
+          if n.nil? || n < 1 || n > 4096 || (n & (n - 1)) != 0
+            sem_error(a.line, "@align needs a power of two up to 4096, as @align(64)")
+          end
+          target.align = n
+        when 'padded'
+          sem_error(a.line, "@padded takes no argument") if a.arg
+          target.padded = true
+        else
+          sem_error(a.line, "unknown #{what} attribute '@#{a.name}'")
+          next
+        end
+        unless is_class
+          sem_error(a.line, "@#{a.name} applies to classes and actors; a struct is copied inline")
+        end
+      end
+    end
+
+    # Handler signatures are registered before any body is analyzed, so a
+    # handler can send to its own actor's other handlers.
+    def analyze_actor_handlers(node, sd)
+      sd.is_actor = true
+      sd.handlers = {}
+      sigs = node.handlers.map do |h|
+        h.params.each { |p| resolve_type_info(p.type_info) }
+        types = h.params.map do |p|
+          pt = p.type_info.to_type
+          if pt.kind == TK_STRUCT && p.type_info.name
+            psd = lookup_struct(p.type_info.name)
+            pt.kind = TK_CLASS if psd&.is_class
+          end
+          check_type_params(p.line, pt)
+          sem_error(p.line, "parameter '#{p.name}' of handler '#{h.name}' cannot be inout") if p.is_inout
+          unless sendable_type?(pt)
+            sem_error(p.line, "parameter '#{p.name}' of handler '#{h.name}' must be sendable, got #{builtin_type_name(pt)}")
+          end
+          pt
+        end
+        if sd.handlers.key?(h.name)
+          sem_error(h.line, "duplicate handler '#{h.name}' in actor '#{node.name}'")
+        else
+          sd.handlers[h.name] = types
+        end
+        types
+      end
+      node.handlers.each_with_index { |h, i| analyze_actor_handler(node.name, h, sigs[i]) }
+    end
+
+    # A handler runs with its actor as self; what it returns is dropped
+    def analyze_actor_handler(actor, node, param_types)
+      push_scope
+      self_type = Type.new(TK_CLASS)
+      self_type.name = actor
+      add_symbol(node.line, 'self', self_type, true)
+      node.params.each_with_index { |p, i| add_symbol(p.line, p.name, param_types[i], true) }
+
+      old_in_function = @in_function
+      old_return_type = @current_func_return_type
+      old_actor = @current_actor
+      @in_function = true
+      @current_func_return_type = nil
+      @current_actor = actor
+      analyze_stmts(node.body.stmts) if node.body.is_a?(AST::Block)
+      if @current_func_return_type
+        sem_error(node.line, "handler '#{node.name}' of actor '#{actor}' cannot return a value")
+      end
+      @in_function = old_in_function
+      @current_func_return_type = old_return_type
+      @current_actor = old_actor
+      pop_scope
+    end
+
+    # A top-level variable. Its initializer runs before main when it folds
+    # to a constant, and otherwise on first use, on whichever thread gets
+    # there first; a threadlocal var runs it once in each thread.
+    def analyze_global_decl(node)
+      @global_uses = []
+      analyze_expr(node.value)
+      check_not_void(node.line, node.value, 'as initializer')
+      node.init_uses = @global_uses.uniq
+      @global_uses = nil
+      type = get_expr_type(node.value)
+      node.const_value = fold_const(node.value)
+      # A String literal is static too, except in a threadlocal, which
+      # must be initialized lazily to learn that its thread needs releasing
+      node.is_static = !node.const_value.nil? || (node.value.is_a?(AST::StringLit) && !node.is_threadlocal)
+      sym = add_symbol(node.line, node.name, type, node.is_const)
+      sym.global = node if sym
+    end
+
+    # Actor handlers run on worker threads, so they may use a global only
+    # when every thread can: a threadlocal var, or a let holding a constant
+    # or a value that is safe to share (see sendable_type?; Strings are
+    # sent as copies, so a shared String would race on its count)
+    def handler_safe_global?(g)
+      return false unless g.init_uses.empty?
+      return true if g.is_threadlocal
+      return false unless g.is_const
+      return true if g.is_static
+      t = g.value.resolved_type
+      t.kind != TK_STRING && sendable_type?(t)
+    end
+
+    def note_global_use(expr, g)
+      expr.global = g
+      @global_reach << g.name if @global_reach && !g.is_const
+      return if handler_safe_global?(g)
+      if @current_actor
+        sem_error(expr.line, "actor handler cannot use global '#{g.name}'; make it threadlocal, or a let of a sendable type")
+      elsif @global_uses
+        @global_uses << g.name
+      end
+    end
+
+    # The value of a scalar initializer built from literals, operators and
+    # folded let globals, with C's int64 semantics; nil when it does not
+    # fold or would overflow, divide by zero, or leave the finite floats
+    def fold_const(expr)
+      v = case expr
+          when AST::IntLit, AST::FloatLit, AST::BoolLit then expr.value
+          when AST::CharLit then expr.value.ord
+          when AST::Ident
+            g = lookup(expr.name)&.global
+            g.const_value if g && g.is_const && !g.is_threadlocal
+          when AST::UnaryOp then fold_unary(expr.op, fold_const(expr.operand))
+          when AST::BinOp
+            l = fold_const(expr.left)
+            r = fold_const(expr.right)
+            fold_binop(expr.op, l, r) unless l.nil? || r.nil?
+          end
+      return nil if v.is_a?(Integer) && (v < -(2**63) || v >= 2**63)
+      return nil if v.is_a?(Float) && !v.finite?
+      v
+    end
+
+    def fold_unary(op, v)
+      case op
+      when Op::NOT then !v if v == true || v == false
+      when Op::NEG then -v if v.is_a?(Numeric)
+      when Op::POS then v if v.is_a?(Numeric)
+      end
+    end
+
+    def fold_binop(op, l, r)
+      bools = [true, false]
+      if op == Op::AND || op == Op::OR
+        return nil unless bools.include?(l) && bools.include?(r)
+        return op == Op::AND ? (l && r) : (l || r)
+      end
+      if op == Op::EQ || op == Op::NE
+        return nil unless (l.is_a?(Numeric) && r.is_a?(Numeric)) || (bools.include?(l) && bools.include?(r))
+        return op == Op::EQ ? l == r : l != r
+      end
+      return nil unless l.is_a?(Numeric) && r.is_a?(Numeric)
+      case op
+      when Op::LT then l < r
+      when Op::GT then l > r
+      when Op::LE then l <= r
+      when Op::GE then l >= r
+      when Op::ADD then l + r
+      when Op::SUB then l - r
+      when Op::MUL then l * r
+      when Op::DIV, Op::MOD
+        if l.is_a?(Float) || r.is_a?(Float)
+          op == Op::DIV ? l.to_f / r : nil
+        elsif r != 0
+          q = l.abs / r.abs
+          q = -q if (l < 0) != (r < 0)
+          op == Op::DIV ? q : l - r * q
+        end
+      end
+    end
+
+    # Values that may cross to another thread: copies (scalars, Strings,
+    # structs without references) or types whose reference count is atomic
+    def sendable_type?(type)
+      return false if type.is_optional
+      case type.kind
+      when TK_INT, TK_FLOAT, TK_BOOL, TK_CHAR, TK_STRING, TK_CONCURRENT_HASH, TK_SHARED, *SYNC_KINDS then true
+      when TK_CLASS then lookup_struct(type.name)&.is_actor || false
+      when TK_STRUCT then memo_result_type?(type)
+      else false
+      end
+    end
+
+    # a.name(args) on an actor queues a message and returns at once
+    def analyze_actor_send(expr, recv)
+      sd = recv.name && lookup_struct(recv.name)
+      unless sd&.is_actor
+        sem_error(expr.line, "class has no method '#{expr.name}'")
+        return
+      end
+      types = sd.handlers[expr.name]
+      if types
+        check_builtin_args(expr, expr.name, types, 'handler')
+      else
+        sem_error(expr.line, "actor '#{sd.name}' has no handler '#{expr.name}'")
+      end
+      expr.resolved_type = Type.new(TK_VOID)
     end
 
     def analyze_func_def(node)
@@ -1251,6 +1744,7 @@ module Zinc
           psd = lookup_struct(p.type_info.name)
           pt.kind = TK_CLASS if psd&.is_class
         end
+        check_type_params(p.line, pt)
         pt
       end
 
@@ -1258,24 +1752,31 @@ module Zinc
       void_type = Type.new(TK_VOID)
       func_sym = add_function(node.line, node.name, void_type,
                                param_types.size, param_types, false)
+      func_sym.inout_params = node.params.map(&:is_inout) if func_sym
 
       # Analyze function body in new scope
       push_scope
 
-      # Add parameters to function scope (const by default)
+      # Add parameters to function scope (const by default; an inout
+      # parameter writes through to the caller's variable)
       node.params.each do |p|
         ptype = p.type_info.to_type
         if ptype.kind == TK_STRUCT && p.type_info.name
           psd = lookup_struct(p.type_info.name)
           ptype.kind = TK_CLASS if psd&.is_class
         end
-        add_symbol(p.line, p.name, ptype, true)
+        psym = add_symbol(p.line, p.name, ptype, !p.is_inout)
+        psym.is_inout = p.is_inout if psym
       end
 
       old_in_function = @in_function
       old_return_type = @current_func_return_type
+      old_global_uses = @global_uses
+      old_global_reach = @global_reach
       @in_function = true
       @current_func_return_type = nil
+      @global_uses = []
+      @global_reach = []
 
       if node.body.is_a?(AST::Block)
         analyze_stmts(node.body.stmts)
@@ -1293,13 +1794,89 @@ module Zinc
       if func_sym && @current_func_return_type
         func_sym.type = @current_func_return_type.clone
       end
+      check_func_attrs(node, param_types, @current_func_return_type)
+      if func_sym
+        # A memo table is an unsynchronized main-thread global, recorded
+        # as "@name" so handlers that reach it are rejected
+        @global_uses.unshift("@#{node.name}") if node.memo?
+        func_sym.uses_globals = @global_uses.uniq
+        func_sym.reaches_globals = @global_reach.uniq
+      end
 
       @in_function = old_in_function
       @current_func_return_type = old_return_type
+      @global_uses = old_global_uses
+      @global_reach = old_global_reach
       pop_scope
     end
 
+    def check_func_attrs(node, param_types, ret_type)
+      node.attrs.each do |a|
+        if a.name == 'memo'
+          check_memo_func(node, a, param_types, ret_type)
+        else
+          sem_error(a.line, "unknown function attribute '@#{a.name}'")
+        end
+      end
+    end
+
+    # @memo caches results in a table keyed on the arguments: a single
+    # argument is the key itself, several are packed into their tuple type
+    # so the tuple's hash and equality helpers apply. @memo(n) bounds the
+    # table to n entries, evicting the least recently used.
+    def check_memo_func(node, attr, param_types, ret_type)
+      if attr.arg && attr.arg < 1
+        sem_error(attr.line, "@memo capacity must be positive")
+      end
+      node.memo_capacity = attr.arg
+      if param_types.empty?
+        sem_error(attr.line, "@memo function '#{node.name}' needs at least one parameter")
+        return
+      end
+      node.params.each_with_index do |p, i|
+        sem_error(p.line, "@memo parameter '#{p.name}' cannot be inout") if p.is_inout
+        next if orderable_type?(param_types[i])
+        sem_error(p.line, "@memo parameter '#{p.name}' must be a scalar, String, or struct of those, got #{builtin_type_name(param_types[i])}")
+      end
+      unless ret_type && memo_result_type?(ret_type)
+        got = ret_type ? builtin_type_name(ret_type) : 'void'
+        sem_error(attr.line, "@memo function '#{node.name}' must return a value without struct references, got #{got}")
+      end
+      node.memo_key = register_tuple_type(param_types) if param_types.size > 1
+    end
+
+    # Cached results are copied out on every hit, so a struct result must
+    # not hold references that the copy would share without retaining.
+    def memo_result_type?(type)
+      return false if type.is_optional || type.kind == TK_VOID || type.kind == TK_UNKNOWN
+      return true unless type.kind == TK_STRUCT
+      sd = type.name && lookup_struct(type.name)
+      return false unless sd && !sd.is_class
+      fd = sd.fields
+      while fd
+        return false if fd.type && (Zinc.ref_kind?(fd.type.kind) || !memo_result_type?(fd.type))
+        fd = fd.next
+      end
+      true
+    end
+
+    # Register (once) the positional tuple type with the given element types
+    def register_tuple_type(types)
+      canonical = '__ZnTuple' + types.map { |t| "_#{get_suffix(t.kind, t)}" }.join
+      unless lookup_struct(canonical)
+        sd = register_struct(canonical, false)
+        fields_data = types.each_with_index.map { |t, i| { name: "_#{i}", type: t.clone, is_const: false } }
+        head, count = build_field_defs(fields_data)
+        sd.fields = head
+        sd.field_count = count
+      end
+      canonical
+    end
+
     def analyze_extern_func(node)
+      node.params.each do |p|
+        sem_error(p.line, "parameter '#{p.name}' of extern function '#{node.name}' cannot be inout") if p.is_inout
+      end
       param_types = node.params.map { |p| p.type_info.to_type }
       ret_type = node.return_type ? node.return_type.to_type : Type.new(TK_VOID)
       add_function(node.line, node.name, ret_type, param_types.size, param_types, true)
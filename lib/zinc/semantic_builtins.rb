@@ -0,0 +1,824 @@
+# frozen_string_literal: true
+
+module Zinc
+  # Semantic analysis for builtin runtime types: constructors and methods
+  class Semantic
+    # Element types the runtime can binary-search without a comparator
+    SEARCHABLE_KINDS = [TK_INT, TK_FLOAT, TK_CHAR, TK_STRING].freeze
+    # Element types the runtime can hash and compare without helpers
+    GROUPABLE_KINDS = [TK_INT, TK_FLOAT, TK_BOOL, TK_CHAR, TK_STRING].freeze
+    # Argument types passed by value, so a call never borrows them
+    SCALAR_KINDS = [TK_INT, TK_FLOAT, TK_BOOL, TK_CHAR].freeze
+
+    private
+
+    def analyze_method_call(expr)
+      analyze_expr(expr.object)
+      recv = get_expr_type(expr.object)
+      expr.args.each do |a|
+        analyze_expr(a)
+        get_expr_type(a)
+        check_not_void(expr.line, a, 'as method argument')
+      end
+
+      case recv.kind
+      when TK_STRING
+        analyze_string_method(expr)
+      when TK_ARRAY
+        analyze_array_method(expr, recv)
+      when TK_HASH
+        analyze_hash_method(expr, recv)
+      when TK_ROPE
+        analyze_rope_method(expr)
+      when TK_HEAP
+        analyze_heap_method(expr, recv)
+      when TK_DEQUE
+        analyze_deque_method(expr, recv)
+      when TK_BITSET
+        analyze_bitset_method(expr)
+      when TK_ORDERED_MAP
+        analyze_ordered_map_method(expr, recv)
+      when TK_TRIE
+        analyze_trie_method(expr, recv)
+      when TK_LRU_CACHE
+        analyze_lru_cache_method(expr, recv)
+      when TK_SORTED_INDEX
+        analyze_sorted_index_method(expr, recv)
+      when TK_MATRIX
+        analyze_matrix_method(expr)
+      when TK_SLOT_MAP
+        analyze_slot_map_method(expr, recv)
+      when TK_CONCURRENT_HASH
+        analyze_concurrent_hash_method(expr, recv)
+      when TK_SHARED
+        analyze_shared_method(expr, recv)
+      when TK_ATOMIC_INT, TK_ATOMIC_BOOL
+        analyze_atomic_method(expr, recv)
+      when TK_MUTEX, TK_RWLOCK, TK_ONCE, TK_BARRIER
+        analyze_sync_method(expr, recv)
+      when TK_CLASS
+        analyze_actor_send(expr, recv)
+      when TK_UNKNOWN
+        nil
+      else
+        sem_error(expr.line, "#{type_kind_name(recv.kind)} has no method '#{expr.name}'")
+      end
+    end
+
+    def analyze_construct(expr)
+      resolve_type_info(expr.type_info)
+      expr.args.each do |a|
+        analyze_expr(a)
+        get_expr_type(a)
+        check_not_void(expr.line, a, 'as constructor argument')
+      end
+
+      case expr.type_info.kind
+      when TK_ROPE
+        # Rope() or Rope(s)
+        check_builtin_args(expr, 'Rope', [TK_STRING], 'constructor') unless expr.args.empty?
+      when TK_HEAP
+        # Heap<T>() or Heap<T>(items), heapified in O(n)
+        items = Type.new(TK_ARRAY)
+        items.elem = expr.type_info.elem&.to_type
+        check_builtin_args(expr, 'Heap', [items], 'constructor') unless expr.args.empty?
+      when TK_DEQUE
+        # Deque<T>() or Deque<T>(items)
+        items = Type.new(TK_ARRAY)
+        items.elem = expr.type_info.elem&.to_type
+        check_builtin_args(expr, 'Deque', [items], 'constructor') unless expr.args.empty?
+      when TK_BITSET
+        # Bitset(n): n bits, all clear
+        check_builtin_args(expr, 'Bitset', [TK_INT], 'constructor')
+      when TK_ORDERED_MAP
+        # OrderedMap<K, V>() or OrderedMap<K, V>(keys, values) from sorted keys
+        keys = Type.new(TK_ARRAY)
+        keys.elem = expr.type_info.key&.to_type
+        vals = Type.new(TK_ARRAY)
+        vals.elem = expr.type_info.elem&.to_type
+        check_builtin_args(expr, 'OrderedMap', [keys, vals], 'constructor') unless expr.args.empty?
+      when TK_TRIE
+        # Trie<V>(), keyed by String
+        check_builtin_args(expr, 'Trie', [], 'constructor')
+      when TK_LRU_CACHE
+        # LruCache<K, V>(capacity)
+        check_builtin_args(expr, 'LruCache', [TK_INT], 'constructor')
+      when TK_SORTED_INDEX
+        # SortedIndex<T>(items), items in any order
+        items = Type.new(TK_ARRAY)
+        items.elem = expr.type_info.elem&.to_type
+        check_builtin_args(expr, 'SortedIndex', [items], 'constructor')
+      when TK_MATRIX
+        # Matrix(rows, cols), all zero, or Matrix(rows, cols, values) row-major
+        values = Type.new(TK_ARRAY)
+        values.elem = Type.new(TK_FLOAT)
+        expected = [TK_INT, TK_INT]
+        expected << values if expr.args.size > 2
+        check_builtin_args(expr, 'Matrix', expected, 'constructor')
+      when TK_SLOT_MAP
+        # SlotMap<T>(), values reached through the handles insert returns
+        check_builtin_args(expr, 'SlotMap', [], 'constructor')
+      when TK_CONCURRENT_HASH
+        # ConcurrentHash<K, V>() or ConcurrentHash<K, V>(shards)
+        check_builtin_args(expr, 'ConcurrentHash', [TK_INT], 'constructor') unless expr.args.empty?
+      when TK_SHARED
+        # Shared<T>(v): v is the first version
+        check_shared_version(expr, 'Shared', shared_version(expr.type_info.to_type), 'constructor')
+      when TK_ATOMIC_INT, TK_ATOMIC_BOOL
+        # AtomicInt(), AtomicInt(v), AtomicBool() or AtomicBool(v)
+        name = expr.type_info.kind == TK_ATOMIC_INT ? 'AtomicInt' : 'AtomicBool'
+        value = expr.type_info.kind == TK_ATOMIC_INT ? TK_INT : TK_BOOL
+        check_builtin_args(expr, name, [value], 'constructor') unless expr.args.empty?
+      when TK_BARRIER
+        # Barrier(n): released each time n threads have arrived
+        check_builtin_args(expr, 'Barrier', [TK_INT], 'constructor')
+      when TK_MUTEX, TK_RWLOCK, TK_ONCE
+        name = { TK_MUTEX => 'Mutex', TK_RWLOCK => 'RwLock', TK_ONCE => 'Once' }[expr.type_info.kind]
+        check_builtin_args(expr, name, [], 'constructor')
+      end
+
+      expr.resolved_type = expr.type_info.to_type
+      check_type_params(expr.line, expr.resolved_type)
+      expr.is_fresh_alloc = true
+    end
+
+    def analyze_string_method(expr)
+      case expr.name
+      when 'to_int', 'to_float'
+        check_builtin_args(expr, expr.name, [])
+        result = Type.new(expr.name == 'to_int' ? TK_INT : TK_FLOAT)
+        result.is_optional = true
+        set_method_result(expr, result)
+      else
+        sem_error(expr.line, "string has no method '#{expr.name}'")
+      end
+    end
+
+    def analyze_array_method(expr, recv)
+      elem = recv.elem&.kind || TK_UNKNOWN
+      case expr.name
+      when 'join'
+        check_builtin_args(expr, expr.name, [TK_STRING])
+        unless [TK_STRING, TK_INT, TK_FLOAT, TK_BOOL, TK_CHAR, TK_UNKNOWN].include?(elem)
+          sem_error(expr.line, "cannot join array of #{type_kind_name(elem)}")
+        end
+        set_method_result(expr, Type.new(TK_STRING))
+      when 'binary_search', 'lower_bound', 'upper_bound'
+        # The array must already be sorted ascending
+        check_builtin_args(expr, expr.name, [recv.elem || Type.new(TK_UNKNOWN)])
+        unless SEARCHABLE_KINDS.include?(elem) || elem == TK_UNKNOWN
+          sem_error(expr.line, "cannot search array of #{type_kind_name(elem)}")
+        end
+        result = Type.new(TK_INT)
+        result.is_optional = expr.name == 'binary_search'
+        expr.resolved_type = result
+      when 'group_count'
+        # group_count() counts equal elements; group_count(f) counts by f(e)
+        if expr.args.size > 1
+          sem_error(expr.line, "method 'group_count' expects 0 or 1 argument(s), got #{expr.args.size}")
+          return
+        end
+        key = if expr.args.empty?
+                check_groupable_elem(expr, recv)
+              else
+                analyze_elem_fn(expr, expr.args[0], recv, 'key')
+              end
+        set_method_result(expr, group_result(key, Type.new(TK_INT)))
+      when 'group_sum'
+        # group_sum(key_fn, value_fn) totals value_fn(e) per key_fn(e)
+        unless expr.args.size == 2
+          sem_error(expr.line, "method 'group_sum' expects 2 argument(s), got #{expr.args.size}")
+          return
+        end
+        key = analyze_elem_fn(expr, expr.args[0], recv, 'key')
+        sum = analyze_elem_fn(expr, expr.args[1], recv, 'value')
+        if sum && (sum.is_optional || ![TK_INT, TK_FLOAT].include?(sum.kind))
+          sem_error(expr.line, "value function of 'group_sum' must return int or float, got #{builtin_type_name(sum)}")
+        end
+        set_method_result(expr, group_result(key, sum))
+      when 'distinct'
+        check_builtin_args(expr, expr.name, [])
+        check_groupable_elem(expr, recv)
+        set_method_result(expr, recv.clone)
+      else
+        sem_error(expr.line, "array has no method '#{expr.name}'")
+      end
+    end
+
+    def check_groupable_elem(expr, recv)
+      elem = recv.elem
+      return nil unless elem && elem.kind != TK_UNKNOWN
+      unless GROUPABLE_KINDS.include?(elem.kind)
+        hint = expr.name == 'group_count' ? ' without a key function' : ''
+        sem_error(expr.line, "cannot #{expr.name} array of #{builtin_type_name(elem)}#{hint}")
+        return nil
+      end
+      elem
+    end
+
+    # A key or value function is the bare name of a function declared
+    # earlier that takes one element. Returns the function's result type.
+    def analyze_elem_fn(expr, arg, recv, role)
+      sym = arg.is_a?(AST::Ident) ? lookup(arg.name) : nil
+      unless sym&.is_function && !sym.is_extern
+        sem_error(expr.line, "#{role} function of '#{expr.name}' must name a function")
+        return nil
+      end
+      if sym.inout_params.first
+        sem_error(expr.line, "#{role} function '#{arg.name}' cannot take an inout parameter")
+        return nil
+      end
+      if @current_actor && !sym.uses_globals.empty?
+        sem_error(expr.line, "actor handler cannot use #{role} function '#{arg.name}', which uses main-thread state")
+        return nil
+      end
+      @global_uses&.concat(sym.uses_globals)
+      elem = recv.elem
+      param = sym.param_types&.first
+      if sym.param_count != 1 || (elem && param && elem.kind != TK_UNKNOWN && !builtin_arg_matches?(elem, param))
+        sem_error(expr.line, "#{role} function '#{arg.name}' must take one #{elem ? builtin_type_name(elem) : 'element'}")
+        return nil
+      end
+      ret = sym.type
+      if role == 'key' && (ret.is_optional || ![*GROUPABLE_KINDS, TK_STRUCT].include?(ret.kind))
+        sem_error(expr.line, "key function '#{arg.name}' must return a scalar, String or struct, got #{builtin_type_name(ret)}")
+        return nil
+      end
+      @elem_fns[arg.name] = param
+      ret
+    end
+
+    def group_result(key, val)
+      result = Type.new(TK_HASH)
+      result.key = key&.clone || Type.new(TK_UNKNOWN)
+      result.elem = val&.clone || Type.new(TK_UNKNOWN)
+      result
+    end
+
+    def analyze_hash_method(expr, recv)
+      keys = Type.new(TK_ARRAY)
+      keys.elem = recv.key&.clone
+      vals = Type.new(TK_ARRAY)
+      vals.elem = recv.elem&.clone
+      case expr.name
+      when 'incremental_rehash'
+        check_builtin_args(expr, expr.name, [TK_BOOL])
+        set_method_result(expr, Type.new(TK_VOID))
+      when 'get_many'
+        check_builtin_args(expr, expr.name, [keys])
+        set_method_result(expr, vals)
+      when 'set_many'
+        check_builtin_args(expr, expr.name, [keys, vals])
+        set_method_result(expr, Type.new(TK_VOID))
+      else
+        sem_error(expr.line, "hash has no method '#{expr.name}'")
+      end
+    end
+
+    def analyze_rope_method(expr)
+      text = [TK_ROPE, TK_STRING]
+      case expr.name
+      when 'concat'
+        check_builtin_args(expr, expr.name, [text])
+        set_method_result(expr, Type.new(TK_ROPE))
+      when 'insert'
+        check_builtin_args(expr, expr.name, [TK_INT, text])
+        set_method_result(expr, Type.new(TK_ROPE))
+      when 'delete', 'substring'
+        check_builtin_args(expr, expr.name, [TK_INT, TK_INT])
+        set_method_result(expr, Type.new(TK_ROPE))
+      when 'to_string'
+        check_builtin_args(expr, expr.name, [])
+        set_method_result(expr, Type.new(TK_STRING))
+      else
+        sem_error(expr.line, "rope has no method '#{expr.name}'")
+      end
+    end
+
+    def analyze_heap_method(expr, recv)
+      elem = recv.elem || Type.new(TK_UNKNOWN)
+      case expr.name
+      when 'push'
+        check_builtin_args(expr, expr.name, [elem])
+        set_method_result(expr, Type.new(TK_INT))
+      when 'pop', 'peek'
+        check_builtin_args(expr, expr.name, [])
+        expr.resolved_type = elem.clone
+        # pop hands the element's reference over to the caller
+        expr.is_fresh_alloc = true if expr.name == 'pop' && Zinc.ref_kind?(elem.kind)
+      when 'decrease_key'
+        check_builtin_args(expr, expr.name, [TK_INT, elem])
+        set_method_result(expr, Type.new(TK_VOID))
+      when 'contains'
+        check_builtin_args(expr, expr.name, [TK_INT])
+        set_method_result(expr, Type.new(TK_BOOL))
+      else
+        sem_error(expr.line, "heap has no method '#{expr.name}'")
+      end
+    end
+
+    def analyze_deque_method(expr, recv)
+      elem = recv.elem || Type.new(TK_UNKNOWN)
+      case expr.name
+      when 'push_back', 'push_front'
+        check_builtin_args(expr, expr.name, [elem])
+        set_method_result(expr, Type.new(TK_VOID))
+      when 'pop_back', 'pop_front', 'front', 'back'
+        check_builtin_args(expr, expr.name, [])
+        expr.resolved_type = elem.clone
+        # pops hand the element's reference over to the caller
+        expr.is_fresh_alloc = true if expr.name.start_with?('pop') && Zinc.ref_kind?(elem.kind)
+      else
+        sem_error(expr.line, "deque has no method '#{expr.name}'")
+      end
+    end
+
+    def analyze_bitset_method(expr)
+      case expr.name
+      when 'get'
+        check_builtin_args(expr, expr.name, [TK_INT])
+        set_method_result(expr, Type.new(TK_BOOL))
+      when 'set', 'clear', 'flip'
+        check_builtin_args(expr, expr.name, [TK_INT])
+        set_method_result(expr, Type.new(TK_VOID))
+      when 'count'
+        check_builtin_args(expr, expr.name, [])
+        set_method_result(expr, Type.new(TK_INT))
+      when 'next_set'
+        check_builtin_args(expr, expr.name, [TK_INT])
+        set_method_result(expr, Type.new(TK_INT))
+      when 'and', 'or', 'xor', 'and_not'
+        check_builtin_args(expr, expr.name, [TK_BITSET])
+        set_method_result(expr, Type.new(TK_BITSET))
+      else
+        sem_error(expr.line, "bitset has no method '#{expr.name}'")
+      end
+    end
+
+    def analyze_ordered_map_method(expr, recv)
+      key = recv.key || Type.new(TK_UNKNOWN)
+      val = recv.elem || Type.new(TK_UNKNOWN)
+      case expr.name
+      when 'contains', 'remove'
+        check_builtin_args(expr, expr.name, [key])
+        set_method_result(expr, Type.new(TK_BOOL))
+      when 'floor', 'ceiling'
+        # Nearest key at or below (floor) or at or above (ceiling) the argument
+        check_builtin_args(expr, expr.name, [key])
+        result = key.clone
+        result.is_optional = true
+        expr.resolved_type = result
+      when 'keys', 'values', 'keys_between', 'values_between'
+        # Entries in key order; the _between forms take an inclusive range
+        bounds = expr.name.end_with?('_between') ? [key, key] : []
+        check_builtin_args(expr, expr.name, bounds)
+        result = Type.new(TK_ARRAY)
+        result.elem = (expr.name.start_with?('keys') ? key : val).clone
+        set_method_result(expr, result)
+      else
+        sem_error(expr.line, "ordered map has no method '#{expr.name}'")
+      end
+    end
+
+    def analyze_trie_method(expr, recv)
+      val = recv.elem || Type.new(TK_UNKNOWN)
+      case expr.name
+      when 'contains', 'remove'
+        check_builtin_args(expr, expr.name, [TK_STRING])
+        set_method_result(expr, Type.new(TK_BOOL))
+      when 'longest_prefix'
+        # Longest stored key that is a prefix of the argument; borrowed
+        check_builtin_args(expr, expr.name, [TK_STRING])
+        result = Type.new(TK_STRING)
+        result.is_optional = true
+        expr.resolved_type = result
+      when 'keys_with_prefix', 'values_with_prefix'
+        check_builtin_args(expr, expr.name, [TK_STRING])
+        result = Type.new(TK_ARRAY)
+        result.elem = expr.name.start_with?('keys') ? Type.new(TK_STRING) : val.clone
+        set_method_result(expr, result)
+      else
+        sem_error(expr.line, "trie has no method '#{expr.name}'")
+      end
+    end
+
+    def analyze_sorted_index_method(expr, recv)
+      elem = recv.elem || Type.new(TK_UNKNOWN)
+      case expr.name
+      when 'contains'
+        check_builtin_args(expr, expr.name, [elem])
+        set_method_result(expr, Type.new(TK_BOOL))
+      when 'floor', 'ceiling'
+        check_builtin_args(expr, expr.name, [elem])
+        result = elem.clone
+        result.is_optional = true
+        expr.resolved_type = result
+      when 'rank'
+        # Number of stored items less than the argument
+        check_builtin_args(expr, expr.name, [elem])
+        set_method_result(expr, Type.new(TK_INT))
+      else
+        sem_error(expr.line, "sorted index has no method '#{expr.name}'")
+      end
+    end
+
+    def analyze_matrix_method(expr)
+      case expr.name
+      when 'row', 'col'
+        check_builtin_args(expr, expr.name, [TK_INT])
+        set_method_result(expr, Type.new(TK_MATRIX))
+      when 'slice'
+        # slice(r0, r1, c0, c1): rows r0...r1 and columns c0...c1
+        check_builtin_args(expr, expr.name, [TK_INT, TK_INT, TK_INT, TK_INT])
+        set_method_result(expr, Type.new(TK_MATRIX))
+      when 'transpose', 'copy'
+        check_builtin_args(expr, expr.name, [])
+        set_method_result(expr, Type.new(TK_MATRIX))
+      when 'matmul'
+        check_builtin_args(expr, expr.name, [TK_MATRIX])
+        set_method_result(expr, Type.new(TK_MATRIX))
+      when 'to_array'
+        check_builtin_args(expr, expr.name, [])
+        values = Type.new(TK_ARRAY)
+        values.elem = Type.new(TK_FLOAT)
+        set_method_result(expr, values)
+      when 'sum'
+        check_builtin_args(expr, expr.name, [])
+        set_method_result(expr, Type.new(TK_FLOAT))
+      when 'fill'
+        check_builtin_args(expr, expr.name, [TK_FLOAT])
+        set_method_result(expr, Type.new(TK_VOID))
+      else
+        sem_error(expr.line, "matrix has no method '#{expr.name}'")
+      end
+    end
+
+    def analyze_slot_map_method(expr, recv)
+      elem = recv.elem || Type.new(TK_UNKNOWN)
+      case expr.name
+      when 'insert'
+        check_builtin_args(expr, expr.name, [elem])
+        set_method_result(expr, Type.new(TK_INT))
+      when 'contains', 'remove'
+        check_builtin_args(expr, expr.name, [TK_INT])
+        set_method_result(expr, Type.new(TK_BOOL))
+      when 'values'
+        check_builtin_args(expr, expr.name, [])
+        values = Type.new(TK_ARRAY)
+        values.elem = elem.clone
+        set_method_result(expr, values)
+      when 'handles'
+        check_builtin_args(expr, expr.name, [])
+        handles = Type.new(TK_ARRAY)
+        handles.elem = Type.new(TK_INT)
+        set_method_result(expr, handles)
+      else
+        sem_error(expr.line, "slot map has no method '#{expr.name}'")
+      end
+    end
+
+    def analyze_concurrent_hash_method(expr, recv)
+      key = recv.key || Type.new(TK_UNKNOWN)
+      val = recv.elem || Type.new(TK_UNKNOWN)
+      case expr.name
+      when 'contains', 'remove'
+        check_builtin_args(expr, expr.name, [key])
+        set_method_result(expr, Type.new(TK_BOOL))
+      when 'put_if_absent'
+        check_builtin_args(expr, expr.name, [key, val])
+        set_method_result(expr, Type.new(TK_BOOL))
+      when 'add'
+        # Atomic read-modify-write of an int counter, which starts at 0
+        check_builtin_args(expr, expr.name, [key, TK_INT])
+        unless [TK_INT, TK_UNKNOWN].include?(val.kind)
+          sem_error(expr.line, "method 'add' needs int values, got #{builtin_type_name(val)}")
+        end
+        set_method_result(expr, Type.new(TK_INT))
+      when 'keys', 'values'
+        check_builtin_args(expr, expr.name, [])
+        result = Type.new(TK_ARRAY)
+        result.elem = (expr.name == 'keys' ? key : val).clone
+        set_method_result(expr, result)
+      when 'shards'
+        check_builtin_args(expr, expr.name, [])
+        set_method_result(expr, Type.new(TK_INT))
+      else
+        sem_error(expr.line, "concurrent hash has no method '#{expr.name}'")
+      end
+    end
+
+    # Reads through a Shared each pin the version current when they start,
+    # so they never see it change; publish replaces it for later reads
+    def analyze_shared_method(expr, recv)
+      version = shared_version(recv)
+      case expr.name
+      when 'publish'
+        check_shared_version(expr, expr.name, version)
+        set_method_result(expr, Type.new(TK_VOID))
+      when 'contains'
+        if version.kind == TK_HASH
+          check_builtin_args(expr, expr.name, [version.key || Type.new(TK_UNKNOWN)])
+        elsif version.kind != TK_UNKNOWN
+          sem_error(expr.line, "method 'contains' needs a shared hash, got #{builtin_type_name(recv)}")
+        end
+        set_method_result(expr, Type.new(TK_BOOL))
+      else
+        sem_error(expr.line, "shared has no method '#{expr.name}'")
+      end
+    end
+
+    # .length of a shared hash or array, or a field of a shared class
+    def analyze_shared_field(expr)
+      recv = expr.object.resolved_type
+      version = shared_version(recv)
+      if [TK_HASH, TK_ARRAY].include?(version.kind) && expr.field == 'length'
+        expr.resolved_type = Type.new(TK_INT)
+        return
+      end
+      sd = version.kind == TK_CLASS && version.name && lookup_struct(version.name)
+      fd = sd && sd.lookup_field(expr.field)
+      unless fd
+        sem_error(expr.line, "#{builtin_type_name(recv)} has no field '#{expr.field}'") unless version.kind == TK_UNKNOWN
+        return
+      end
+      expr.resolved_type = fd.type.clone
+      # Copied out of the version, so the caller owns it
+      expr.is_fresh_alloc = true if fd.type.kind == TK_STRING
+    end
+
+    # The cell takes over a new version outright, so it must be one nothing
+    # else holds yet: a literal, constructor or call result
+    def check_shared_version(expr, name, version, what = 'method')
+      return unless check_builtin_args(expr, name, [version], what)
+      arg = expr.args[0]
+      return if arg.is_fresh_alloc || !Zinc.ref_kind?(arg.resolved_type&.kind)
+      sem_error(expr.line, "argument of '#{name}' must be a new value, not one that is already referenced")
+    end
+
+    # The version type of a Shared<T>, with a class name resolved
+    def shared_version(type)
+      version = type&.elem ? type.elem.clone : Type.new(TK_UNKNOWN)
+      if version.kind == TK_STRUCT && version.name && lookup_struct(version.name)&.is_class
+        version.kind = TK_CLASS
+      end
+      version
+    end
+
+    MEMORY_ORDERS = %w[relaxed acquire release acq_rel seq_cst].freeze
+    # Orderings each kind of access may use, as in C11
+    LOAD_ORDERS = %w[relaxed acquire seq_cst].freeze
+    STORE_ORDERS = %w[relaxed release seq_cst].freeze
+
+    # Atomic methods take an optional trailing memory ordering, a string
+    # literal naming one of MEMORY_ORDERS; seq_cst when left out
+    def analyze_atomic_method(expr, recv)
+      value = recv.kind == TK_ATOMIC_INT ? TK_INT : TK_BOOL
+      params, orders, result =
+        case expr.name
+        when 'load' then [[], LOAD_ORDERS, value]
+        when 'store' then [[value], STORE_ORDERS, TK_VOID]
+        when 'exchange' then [[value], MEMORY_ORDERS, value]
+        when 'compare_exchange' then [[value, value], MEMORY_ORDERS, TK_BOOL]
+        when 'fetch_add', 'fetch_sub'
+          [[TK_INT], MEMORY_ORDERS, TK_INT] if value == TK_INT
+        end
+      unless params
+        sem_error(expr.line, "#{type_kind_name(recv.kind)} has no method '#{expr.name}'")
+        return
+      end
+      set_method_result(expr, Type.new(result))
+      expr.memory_order = 'seq_cst'
+      if expr.args.size == params.size + 1
+        return unless check_memory_order(expr, expr.args.last, orders)
+        # Spliced into the generated call rather than evaluated
+        expr.memory_order = expr.args.pop.value
+      end
+      check_builtin_args(expr, expr.name, params)
+    end
+
+    def check_memory_order(expr, arg, allowed)
+      unless arg.is_a?(AST::StringLit) && MEMORY_ORDERS.include?(arg.value)
+        sem_error(expr.line, "memory ordering of '#{expr.name}' must be one of #{MEMORY_ORDERS.map { |o| "\"#{o}\"" }.join(', ')}")
+        return false
+      end
+      return true if allowed.include?(arg.value)
+      sem_error(expr.line, "'#{expr.name}' cannot use #{arg.value} ordering")
+      false
+    end
+
+    def analyze_sync_method(expr, recv)
+      methods = {
+        TK_MUTEX => { 'lock' => TK_VOID, 'unlock' => TK_VOID, 'try_lock' => TK_BOOL },
+        TK_RWLOCK => { 'read_lock' => TK_VOID, 'read_unlock' => TK_VOID,
+                       'write_lock' => TK_VOID, 'write_unlock' => TK_VOID },
+        TK_ONCE => { 'call' => TK_BOOL },
+        TK_BARRIER => { 'wait' => TK_BOOL },
+      }[recv.kind]
+      result = methods[expr.name]
+      unless result
+        sem_error(expr.line, "#{type_kind_name(recv.kind)} has no method '#{expr.name}'")
+        return
+      end
+      if expr.name == 'call'
+        analyze_once_fn(expr)
+      else
+        check_builtin_args(expr, expr.name, [])
+      end
+      set_method_result(expr, Type.new(result))
+    end
+
+    # Once.call(f): f names a function taking no arguments whose result,
+    # if any, is a scalar and is dropped
+    def analyze_once_fn(expr)
+      unless expr.args.size == 1
+        sem_error(expr.line, "method 'call' expects 1 argument(s), got #{expr.args.size}")
+        return
+      end
+      arg = expr.args[0]
+      sym = arg.is_a?(AST::Ident) ? lookup(arg.name) : nil
+      unless sym&.is_function
+        sem_error(expr.line, "argument of 'call' must name a function")
+        return
+      end
+      if sym.param_count != 0
+        sem_error(expr.line, "function '#{arg.name}' passed to 'call' must take no arguments")
+      elsif Zinc.ref_kind?(sym.type.kind) || sym.type.kind == TK_STRUCT
+        sem_error(expr.line, "function '#{arg.name}' passed to 'call' must return a scalar or nothing")
+      end
+    end
+
+    def analyze_lru_cache_method(expr, recv)
+      key = recv.key || Type.new(TK_UNKNOWN)
+      val = recv.elem || Type.new(TK_UNKNOWN)
+      case expr.name
+      when 'get'
+        # Counts a hit or miss; a miss reads as the zero value
+        check_builtin_args(expr, expr.name, [key])
+        expr.resolved_type = val.clone
+      when 'put'
+        check_builtin_args(expr, expr.name, [key, val])
+        set_method_result(expr, Type.new(TK_VOID))
+      when 'contains', 'remove'
+        check_builtin_args(expr, expr.name, [key])
+        set_method_result(expr, Type.new(TK_BOOL))
+      when 'hits', 'misses', 'capacity'
+        check_builtin_args(expr, expr.name, [])
+        set_method_result(expr, Type.new(TK_INT))
+      else
+        sem_error(expr.line, "lru cache has no method '#{expr.name}'")
+      end
+    end
+
+    # Check the type parameters of builtin collections. Heap<T> needs a
+    # total order on T: scalars, strings, and structs or tuples made of
+    # those (compared field by field). Struct element types are recorded
+    # so codegen can emit a specialized comparator. OrderedMap and LruCache
+    # keys and SortedIndex elements are compared and hashed by the runtime
+    # directly, so they are limited to the types it knows. ConcurrentHash
+    # copies its keys and values rather than sharing refcounts between
+    # threads, so it takes scalars and strings only. A Shared version is
+    # read by many threads without refcounts, so it is a hash or array of
+    # those, or a class whose fields all are.
+    def check_type_params(line, type)
+      return unless type
+      check_type_params(line, type.key)
+      check_type_params(line, type.elem)
+      if type.kind == TK_SHARED && type.elem
+        type.elem = shared_version(type)
+        unless shareable_version?(type.elem)
+          sem_error(line, "Shared type must be a hash or array of int, float, char, bool, or String, or a class with only such fields, got #{builtin_type_name(type.elem)}")
+        end
+      end
+      if type.kind == TK_ORDERED_MAP && type.key
+        key = type.key
+        unless !key.is_optional && [TK_INT, TK_FLOAT, TK_CHAR, TK_STRING].include?(key.kind)
+          sem_error(line, "OrderedMap key type must be int, float, char, or String, got #{builtin_type_name(key)}")
+        end
+      end
+      if type.kind == TK_SORTED_INDEX && type.elem
+        elem = type.elem
+        unless !elem.is_optional && SEARCHABLE_KINDS.include?(elem.kind)
+          sem_error(line, "SortedIndex element type must be int, float, char, or String, got #{builtin_type_name(elem)}")
+        end
+      end
+      if type.kind == TK_MATRIX && type.elem
+        sem_error(line, "matrix elements must be float, got #{builtin_type_name(type.elem)}[,]")
+      end
+      if type.kind == TK_LRU_CACHE && type.key
+        key = type.key
+        unless !key.is_optional && [TK_INT, TK_FLOAT, TK_CHAR, TK_BOOL, TK_STRING].include?(key.kind)
+          sem_error(line, "LruCache key type must be int, float, char, bool, or String, got #{builtin_type_name(key)}")
+        end
+      end
+      if type.kind == TK_CONCURRENT_HASH
+        { 'key' => type.key, 'value' => type.elem }.each do |what, t|
+          next if !t || (!t.is_optional && GROUPABLE_KINDS.include?(t.kind))
+          sem_error(line, "ConcurrentHash #{what} type must be int, float, char, bool, or String, got #{builtin_type_name(t)}")
+        end
+      end
+      return unless type.kind == TK_HEAP && type.elem
+      elem = type.elem
+      if orderable_type?(elem)
+        @heap_elems[elem.name] = true if elem.kind == TK_STRUCT
+      else
+        sem_error(line, "Heap element type must be ordered, got #{builtin_type_name(elem)}")
+      end
+    end
+
+    def shareable_version?(type)
+      plain = ->(t) { t && !t.is_optional && GROUPABLE_KINDS.include?(t.kind) }
+      case type.kind
+      when TK_HASH then plain.(type.key) && plain.(type.elem)
+      when TK_ARRAY then plain.(type.elem)
+      when TK_CLASS
+        sd = lookup_struct(type.name)
+        return false if !sd || sd.is_actor
+        fd = sd.fields
+        while fd
+          return false unless plain.(fd.type)
+          fd = fd.next
+        end
+        true
+      else false
+      end
+    end
+
+    def orderable_type?(type)
+      return false if type.is_optional
+      case type.kind
+      when TK_INT, TK_FLOAT, TK_CHAR, TK_BOOL, TK_STRING
+        true
+      when TK_STRUCT
+        sd = type.name && lookup_struct(type.name)
+        return false if !sd || sd.is_class
+        fd = sd.fields
+        while fd
+          return false unless fd.type && orderable_type?(fd.type)
+          fd = fd.next
+        end
+        true
+      else
+        false
+      end
+    end
+
+    # Check builtin call arguments against expected parameter types. Each
+    # entry is a kind, a Type (matched exactly), or an array of allowed kinds.
+    def check_builtin_args(expr, name, expected, what = 'method')
+      if expr.args.size != expected.size
+        sem_error(expr.line, "#{what} '#{name}' expects #{expected.size} argument(s), got #{expr.args.size}")
+        return false
+      end
+      ok = true
+      expr.args.each_with_index do |a, i|
+        actual = a.resolved_type || Type.new(TK_UNKNOWN)
+        next if actual.kind == TK_UNKNOWN
+        want = expected[i]
+        matches = case want
+                  when Type then want.kind == TK_UNKNOWN || builtin_arg_matches?(actual, want)
+                  when Array then want.include?(actual.kind)
+                  else actual.kind == want
+                  end
+        next if matches
+        wname = case want
+                when Type then builtin_type_name(want)
+                when Array then want.map { |k| type_kind_name(k) }.join(' or ')
+                else type_kind_name(want)
+                end
+        got = want.is_a?(Type) ? builtin_type_name(actual) : type_kind_name(actual.kind)
+        sem_error(expr.line, "argument #{i + 1} of '#{name}' expects #{wname}, got #{got}")
+        ok = false
+      end
+      ok
+    end
+
+    def builtin_arg_matches?(actual, want)
+      return false unless actual.kind == want.kind
+      return actual.name == want.name if want.kind == TK_STRUCT || want.kind == TK_CLASS
+      return false if actual.key && want.key && !builtin_arg_matches?(actual.key, want.key)
+      return builtin_arg_matches?(actual.elem, want.elem) if actual.elem && want.elem
+      true
+    end
+
+    # Type name for argument errors, spelling out array element types
+    def builtin_type_name(type)
+      name = if type.kind == TK_ARRAY && type.elem
+               "#{builtin_type_name(type.elem)}[]"
+             elsif type.kind == TK_HASH && type.key && type.elem
+               "[#{builtin_type_name(type.key)}: #{builtin_type_name(type.elem)}]"
+             elsif type.kind == TK_SHARED && type.elem
+               "Shared<#{builtin_type_name(type.elem)}>"
+             elsif (type.kind == TK_STRUCT || type.kind == TK_CLASS) && type.name && !type.name.start_with?('__')
+               type.name
+             else
+               type_kind_name(type.kind)
+             end
+      type.is_optional ? "#{name}?" : name
+    end
+
+    def set_method_result(expr, type)
+      expr.resolved_type = type
+      expr.is_fresh_alloc = true if Zinc.ref_kind?(type.kind)
+    end
+  end
+end
@@ -13,13 +13,31 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 /* --- Type definitions --- */
 
+/* Data written by different threads is kept on separate cache lines of
+ * this size. Build with -DZN_CACHE_LINE=128 for 128-byte lines. */
+#ifndef ZN_CACHE_LINE
+#define ZN_CACHE_LINE 64
+#endif
+
 typedef struct { int32_t _rc; int32_t _len; char _data[]; } ZnString;
 
 typedef enum { ZN_TAG_INT = 0, ZN_TAG_FLOAT = 1, ZN_TAG_BOOL = 2, ZN_TAG_CHAR = 3,
@@ -31,14 +49,179 @@ typedef void (*ZnElemFn)(void*);
 typedef unsigned int (*ZnHashFn)(ZnValue);
 typedef bool (*ZnEqFn)(ZnValue, ZnValue);
 
+/* Array: _data points either at a separate block or, for arrays made by
+ * __zn_arr_alloc_inline, at _inline in the same allocation until growth. */
+#define ZN_ARR_INLINE 8
 typedef struct { int32_t _rc; int32_t _len; int32_t _cap; ZnValue *_data;
                  ZnElemFn _elem_retain; ZnElemFn _elem_release;
-                 ZnHashFn _elem_hashcode; ZnEqFn _elem_equals; } ZnArray;
+                 ZnHashFn _elem_hashcode; ZnEqFn _elem_equals; ZnValue _inline[]; } ZnArray;
 typedef struct ZnHashEntry { ZnValue key; ZnValue value; struct ZnHashEntry *next; } ZnHashEntry;
+
+/* Hash: up to ZN_HASH_SMALL entries live in the _small block and are found
+ * by linear scan over the one-byte hash tags in _tags (_buckets stays NULL);
+ * past that they move to a chained bucket table and the block is freed, so
+ * a spilled or presized hash does not carry it. The block is allocated on
+ * the first insert. An incremental hash grows by keeping the old
+ * table in _old and moving ZN_HASH_REHASH_STEP of its buckets per set or
+ * lookup; _moved counts the old buckets already emptied. Build with
+ * -DZN_HASH_INCREMENTAL=1 to make every hash incremental. */
+#define ZN_HASH_SMALL 8
+#define ZN_HASH_REHASH_STEP 4
+#ifndef ZN_HASH_INCREMENTAL
+#define ZN_HASH_INCREMENTAL 0
+#endif
+typedef struct { ZnValue _keys[ZN_HASH_SMALL]; ZnValue _vals[ZN_HASH_SMALL]; } ZnHashSmall;
 typedef struct { int32_t _rc; int32_t _len; int32_t _cap; ZnHashEntry **_buckets;
                  ZnElemFn _key_retain; ZnElemFn _key_release;
                  ZnHashFn _key_hashcode; ZnEqFn _key_equals;
-                 ZnElemFn _val_retain; ZnElemFn _val_release; } ZnHash;
+                 ZnElemFn _val_retain; ZnElemFn _val_release;
+                 bool _incremental; int32_t _old_cap; int32_t _moved; ZnHashEntry **_old;
+                 uint64_t _tags; ZnHashSmall *_small; } ZnHash;
+
+/* Rope: immutable AVL tree of string chunks. Leaves reference a slice of a
+ * retained ZnString (never copied); concat nodes own their two children. */
+typedef struct ZnRope { int32_t _rc; int32_t _depth; int64_t _len;
+                        ZnString *_str; int32_t _off;
+                        struct ZnRope *_left, *_right;
+                        ZnString *_flat; } ZnRope;
+
+/* Heap: implicit 4-ary min-heap. Every live element owns a handle slot;
+ * _slot maps heap position -> slot and _pos maps slot -> position (or, for
+ * a free slot, the next free slot encoded as -(next + 2)). */
+typedef struct { int32_t _rc; int32_t _len; int32_t _cap; ZnValue *_data;
+                 int32_t *_slot; int32_t *_pos; uint32_t *_gen;
+                 int32_t _nslots; int32_t _free;
+                 ZnElemFn _elem_retain; ZnElemFn _elem_release; } ZnHeap;
+
+/* Deque: ring buffer with power-of-two capacity; element i lives at
+ * _data[(_head + i) & (_cap - 1)]. */
+typedef struct { int32_t _rc; int32_t _len; int32_t _cap; int32_t _head; ZnValue *_data;
+                 ZnElemFn _elem_retain; ZnElemFn _elem_release; } ZnDeque;
+
+/* Bitset: _len bits packed into 64-bit words; bits past _len stay zero */
+typedef struct { int32_t _rc; int32_t _len; int32_t _nwords; uint64_t _words[]; } ZnBitset;
+
+/* OrderedMap: B-tree of minimum degree ZN_OMAP_T. Keys and values sit in
+ * parallel arrays so in-node search scans contiguous keys; leaf nodes are
+ * allocated without the child array. */
+#define ZN_OMAP_T 16
+#define ZN_OMAP_MAX (2 * ZN_OMAP_T - 1)
+typedef struct ZnOMapNode { int32_t _n; bool _leaf;
+                            ZnValue _keys[ZN_OMAP_MAX]; ZnValue _vals[ZN_OMAP_MAX];
+                            struct ZnOMapNode *_kids[ZN_OMAP_MAX + 1]; } ZnOMapNode;
+typedef struct { int32_t _rc; int32_t _len; ZnTag _key_tag; ZnOMapNode *_root;
+                 ZnElemFn _key_retain; ZnElemFn _key_release;
+                 ZnElemFn _val_retain; ZnElemFn _val_release; } ZnOrderedMap;
+
+/* Trie: adaptive radix tree over string bytes. Every node carries up to
+ * ZN_TRIE_PREFIX bytes of compressed path, then branches on one byte
+ * through a 4-, 16-, 48- or 256-way child table, growing as it fills and
+ * shrinking as removals empty it. A node where a key ends holds that key
+ * and its value. */
+#define ZN_TRIE_PREFIX 8
+enum { ZN_TRIE_N4, ZN_TRIE_N16, ZN_TRIE_N48, ZN_TRIE_N256 };
+typedef struct ZnTrieNode { uint8_t _type; uint8_t _plen; uint16_t _n; bool _has;
+                            uint8_t _prefix[ZN_TRIE_PREFIX]; ZnString *_key; ZnValue _val; } ZnTrieNode;
+typedef struct { ZnTrieNode _h; uint8_t _keys[4]; ZnTrieNode *_kids[4]; } ZnTrieNode4;
+typedef struct { ZnTrieNode _h; uint8_t _keys[16]; ZnTrieNode *_kids[16]; } ZnTrieNode16;
+typedef struct { ZnTrieNode _h; uint8_t _index[256]; ZnTrieNode *_kids[48]; } ZnTrieNode48;
+typedef struct { ZnTrieNode _h; ZnTrieNode *_kids[256]; } ZnTrieNode256;
+typedef struct { int32_t _rc; int32_t _len; ZnTrieNode *_root;
+                 ZnElemFn _val_retain; ZnElemFn _val_release; } ZnTrie;
+
+/* LruCache: a fixed-size hash table whose entries also sit on an
+ * intrusive doubly-linked recency list; _list is its sentinel, with the
+ * most recently used entry at _list._next. */
+typedef struct ZnLruEntry { ZnValue _key; ZnValue _val; unsigned int _hash;
+                            struct ZnLruEntry *_hnext, *_prev, *_next; } ZnLruEntry;
+typedef struct { int32_t _rc; int32_t _len; int32_t _cap; uint32_t _mask;
+                 ZnLruEntry **_buckets; ZnLruEntry _list; int64_t _hits; int64_t _misses;
+                 ZnElemFn _key_retain; ZnElemFn _key_release;
+                 ZnHashFn _key_hashcode; ZnEqFn _key_equals;
+                 ZnElemFn _val_retain; ZnElemFn _val_release; } ZnLruCache;
+
+/* SortedIndex: a read-only sorted set in Eytzinger (BFS) order. _keys[1.._len]
+ * hold the keys with the children of k at 2k and 2k + 1, so the top levels
+ * of every search share cache lines and deeper levels can be prefetched;
+ * _rank[k] is the sorted position of _keys[k]. Keys are stored unboxed:
+ * int64 (int and char), double, or ZnString* according to _tag. */
+typedef union { int64_t i; double f; ZnString *s; } ZnIdxKey;
+typedef struct { int32_t _rc; int32_t _len; ZnTag _tag; ZnIdxKey *_keys; int32_t *_rank; } ZnSortedIndex;
+
+/* Matrix: a _rows x _cols view of doubles in a shared, 64-byte-aligned
+ * buffer; element (i, j) is _data[i * _rs + j * _cs]. Constructors,
+ * transpose, matmul and copy make contiguous row-major matrices
+ * (_rs = _cols, _cs = 1); row, col and slice make views that share _buf
+ * and see each other's writes. */
+typedef struct { int32_t _rc; _Alignas(64) double _data[]; } ZnMatBuf;
+typedef struct { int32_t _rc; int32_t _rows; int32_t _cols; int64_t _len;
+                 int64_t _rs; int64_t _cs; double *_data; ZnMatBuf *_buf; } ZnMatrix;
+
+/* SlotMap: values packed densely in _vals[0.._len), with _owner[d] the
+ * slot of _vals[d]; removal moves the last value into the hole. Slot s
+ * holds a generation that is odd while the slot is live and, then, the
+ * value's dense index, or else the next free slot. A handle is
+ * (generation << 32) | slot, so it stops resolving once its value is
+ * removed, even after the slot is reused; 0 is never a handle. */
+typedef struct { uint32_t _gen; int32_t _idx; } ZnSlot;
+typedef struct { int32_t _rc; int32_t _len; int32_t _cap; int32_t _nslots; int32_t _free;
+                 ZnValue *_vals; int32_t *_owner; ZnSlot *_slots;
+                 ZnElemFn _elem_retain; ZnElemFn _elem_release; } ZnSlotMap;
+
+/* ConcurrentHash: keys are spread over a power-of-two number of shards,
+ * each a ZnHash behind its own reader-writer lock, so threads working on
+ * different shards never contend and readers of one shard run side by
+ * side. Every shard owns a cache line, so neighbouring locks do not
+ * false-share. String keys and values are copied in and out: the table
+ * never shares a refcount with its callers. _rc and _len are atomic, and
+ * written by every insert and handle copy, so they sit on a line apart
+ * from the fields every lookup reads. */
+#define ZN_CHASH_SHARDS 64
+typedef struct { _Alignas(ZN_CACHE_LINE) _Atomic uint32_t _lock; ZnHash *_map; } ZnChashShard;
+typedef struct { _Atomic int32_t _rc; _Atomic int32_t _len;
+                 _Alignas(ZN_CACHE_LINE) int32_t _nshards; uint32_t _shift;
+                 ZnChashShard *_shards; bool _str_keys; bool _str_vals; } ZnConcurrentHash;
+
+/* Synchronization types (AtomicInt and AtomicBool share ZnAtomic). They
+ * exist to be shared between threads, so the refcount is atomic, and each
+ * is allocated on a cache line of its own. The lock words are futexes:
+ * waiters spin for a while, then park in the kernel. */
+typedef struct { _Alignas(ZN_CACHE_LINE) _Atomic int32_t _rc; _Atomic int64_t _v; } ZnAtomic;
+typedef struct { _Alignas(ZN_CACHE_LINE) _Atomic int32_t _rc; _Atomic uint32_t _state; } ZnMutex;
+typedef struct { _Alignas(ZN_CACHE_LINE) _Atomic int32_t _rc; _Atomic uint32_t _state;
+                 _Atomic uint32_t _seq; _Atomic int32_t _waiters; } ZnRwLock;
+typedef struct { _Alignas(ZN_CACHE_LINE) _Atomic int32_t _rc; _Atomic uint32_t _state; } ZnOnce;
+typedef struct { _Alignas(ZN_CACHE_LINE) _Atomic int32_t _rc; int32_t _n;
+                 _Atomic int32_t _count; _Atomic uint32_t _gen; } ZnBarrier;
+
+/* Shared: a cell holding the current immutable version of a hash, array
+ * or class instance. Readers take neither a lock nor a refcount; a
+ * replaced version is freed with _release once no reader can still be
+ * looking at it. _rc is atomic; handle copies write it, so _cur, which
+ * every read loads, is on the next line. */
+typedef struct { _Alignas(ZN_CACHE_LINE) _Atomic int32_t _rc;
+                 _Alignas(ZN_CACHE_LINE) _Atomic(void*) _cur; ZnElemFn _release; } ZnShared;
+
+/* A message is an intrusive node: generated code extends it with the
+ * handler's arguments and a _run that delivers and frees it. */
+struct ZnActor;
+
+typedef struct ZnMsg {
+    _Atomic(struct ZnMsg*) _next;
+    void (*_run)(struct ZnActor *a, struct ZnMsg *m);
+} ZnMsg;
+
+/* Header of every actor. Senders only touch _head; the consumer's end of
+ * the mailbox sits on its own cache line. */
+typedef struct ZnActor {
+    _Atomic int32_t _rc;
+    _Atomic uint32_t _sched;
+    void (*_dispose)(struct ZnActor *a);
+    struct ZnActor *_next;
+    _Atomic(ZnMsg*) _head;
+    _Alignas(ZN_CACHE_LINE) ZnMsg *_tail;
+    ZnMsg _stub;
+} ZnActor;
 
 typedef struct { bool _has; int64_t _val; } ZnOpt_int;
 typedef struct { bool _has; double _val; } ZnOpt_float;
@@ -95,6 +278,152 @@ static ZnString *__zn_str_from_char(char c) {
     return __zn_str_alloc(&c, 1);
 }
 
+/* --- Number parsing (String.to_int / String.to_float) ---
+ * Parsers take a pointer and length, so they work on any slice without a
+ * NUL terminator or a copy. Input must be the whole number: an optional
+ * sign, then digits (and for floats an optional fraction and exponent);
+ * anything else, including surrounding whitespace, yields no value. */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define ZN_SWAR_DIGITS 1
+#endif
+
+#ifdef ZN_SWAR_DIGITS
+/* True if all 8 bytes of a little-endian word are ASCII digits */
+static inline bool __zn_is_8digits(uint64_t v) {
+    return !(((v + 0x4646464646464646ULL) | (v - 0x3030303030303030ULL)) & 0x8080808080808080ULL);
+}
+
+/* Convert 8 ASCII digits to their value with three multiplies */
+static inline uint32_t __zn_parse_8digits(uint64_t v) {
+    v -= 0x3030303030303030ULL;
+    v = (v * 10) + (v >> 8);
+    v = (((v & 0x000000FF000000FFULL) * 0x000F424000000064ULL) +
+         (((v >> 16) & 0x000000FF000000FFULL) * 0x0000271000000001ULL)) >> 32;
+    return (uint32_t)v;
+}
+#endif
+
+/* Accumulate a run of digits into *acc, at most max_digits of them.
+ * Returns the number of digits consumed. */
+static inline int32_t __zn_scan_digits(const char *p, int32_t n, uint64_t *acc, int32_t max_digits) {
+    int32_t i = 0;
+    uint64_t v = *acc;
+#ifdef ZN_SWAR_DIGITS
+    while (n - i >= 8 && max_digits - i >= 8) {
+        uint64_t w; memcpy(&w, p + i, 8);
+        if (!__zn_is_8digits(w)) break;
+        v = v * 100000000ULL + __zn_parse_8digits(w);
+        i += 8;
+    }
+#endif
+    while (i < n && i < max_digits && (unsigned)(p[i] - '0') < 10) {
+        v = v * 10 + (uint64_t)(p[i] - '0');
+        i++;
+    }
+    *acc = v;
+    return i;
+}
+
+static ZnOpt_int __zn_parse_int(const char *p, int32_t n) {
+    ZnOpt_int r = { false, 0 };
+    int32_t i = 0;
+    bool neg = false;
+    if (i < n && (p[i] == '-' || p[i] == '+')) { neg = p[i] == '-'; i++; }
+    int32_t start = i;
+    while (i < n && p[i] == '0') i++;
+    uint64_t v = 0;
+    /* 19 digits always fit in a uint64_t; a 20th can only overflow int64 */
+    int32_t nd = __zn_scan_digits(p + i, n - i, &v, 19);
+    i += nd;
+    if (i == start || i != n) return r;
+    if (v > (uint64_t)INT64_MAX + (neg ? 1 : 0)) return r;
+    r._has = true;
+    r._val = neg ? (int64_t)(0 - v) : (int64_t)v;
+    return r;
+}
+
+static ZnOpt_float __zn_parse_float(const char *p, int32_t n) {
+    static const double p10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+    ZnOpt_float r = { false, 0.0 };
+    int32_t i = 0;
+    bool neg = false;
+    if (i < n && (p[i] == '-' || p[i] == '+')) { neg = p[i] == '-'; i++; }
+
+    /* Mantissa: keep up to 19 significant digits, count the rest */
+    uint64_t m = 0;
+    int32_t sig = 0, dropped = 0, frac_digits = 0, digits = 0;
+    bool truncated = false;
+    while (i < n && p[i] == '0') { i++; digits++; }
+    int32_t nd = __zn_scan_digits(p + i, n - i, &m, 19);
+    i += nd; sig += nd; digits += nd;
+    while (i < n && (unsigned)(p[i] - '0') < 10) { truncated |= p[i] != '0'; i++; dropped++; digits++; }
+    if (i < n && p[i] == '.') {
+        i++;
+        if (sig == 0) while (i < n && p[i] == '0') { i++; frac_digits++; digits++; }
+        if (dropped == 0) {
+            nd = __zn_scan_digits(p + i, n - i, &m, 19 - sig);
+            i += nd; sig += nd; frac_digits += nd; digits += nd;
+        }
+        while (i < n && (unsigned)(p[i] - '0') < 10) { truncated |= p[i] != '0'; i++; digits++; }
+    }
+    if (digits == 0) return r;
+
+    int64_t exp10 = 0;
+    if (i < n && (p[i] == 'e' || p[i] == 'E')) {
+        i++;
+        bool eneg = false;
+        if (i < n && (p[i] == '-' || p[i] == '+')) { eneg = p[i] == '-'; i++; }
+        if (i >= n || (unsigned)(p[i] - '0') >= 10) return r;
+        while (i < n && (unsigned)(p[i] - '0') < 10) {
+            if (exp10 < 100000) exp10 = exp10 * 10 + (p[i] - '0');
+            i++;
+        }
+        if (eneg) exp10 = -exp10;
+    }
+    if (i != n) return r;
+    r._has = true;
+
+    /* Clinger's fast path: an exactly representable mantissa scaled by an
+     * exactly representable power of ten rounds correctly in one operation */
+    exp10 += dropped - frac_digits;
+    if (m == 0) { r._val = neg ? -0.0 : 0.0; return r; }
+    if (!truncated && m <= (1ULL << 53)) {
+        double d = (double)m;
+        if (exp10 >= -22 && exp10 <= 22) {
+            d = exp10 < 0 ? d / p10[-exp10] : d * p10[exp10];
+            r._val = neg ? -d : d;
+            return r;
+        }
+        /* e.g. 123e25: move the excess exponent into the mantissa if it stays exact */
+        if (exp10 > 22 && exp10 <= 22 + 15) {
+            uint64_t scaled = m;
+            int64_t e = exp10 - 22;
+            while (e > 0 && scaled <= (1ULL << 53) / 10) { scaled *= 10; e--; }
+            if (e == 0) {
+                d = (double)scaled * p10[22];
+                r._val = neg ? -d : d;
+                return r;
+            }
+        }
+    }
+
+    /* Slow path: correctly rounded conversion by the C library */
+    char stack[64];
+    char *buf = n < (int32_t)sizeof(stack) ? stack : malloc(n + 1);
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    r._val = strtod(buf, NULL);
+    if (buf != stack) free(buf);
+    return r;
+}
+
+static ZnOpt_int __zn_str_to_int(ZnString *s) { return __zn_parse_int(s->_data, s->_len); }
+static ZnOpt_float __zn_str_to_float(ZnString *s) { return __zn_parse_float(s->_data, s->_len); }
+
 /* --- ZnValue boxing/unboxing --- */
 
 static ZnValue __zn_val_int(int64_t v) { ZnValue r; r.tag = ZN_TAG_INT; r.as.i = v; return r; }
@@ -107,6 +436,24 @@ static ZnValue __zn_val_hash(ZnHash *v) { ZnValue r; r.tag = ZN_TAG_HASH; r.as.p
 static ZnValue __zn_val_ref(void *v) { ZnValue r; r.tag = ZN_TAG_REF; r.as.ptr = v; return r; }
 static ZnValue __zn_val_val(void *v) { ZnValue r; r.tag = ZN_TAG_VAL; r.as.ptr = v; return r; }
 
+/* Copy a boxed struct of size bytes; ret (codegen's __zn_val_ret_<T>)
+ * retains the reference fields the copy now shares with the original. */
+static void *__zn_val_dup(const void *p, size_t size, ZnElemFn ret) {
+    void *cp = memcpy(malloc(size), p, size);
+    if (ret) ret(cp);
+    return cp;
+}
+
+/* Memory for an object. A type aligned to n bytes has a size that is a
+ * multiple of n, so the lowest set bit of the size is an alignment that
+ * honors @align and @padded; an unattributed type whose size happens to
+ * be a multiple of 32 is over-aligned, which is harmless. */
+static inline void *__zn_obj_alloc(size_t size) {
+    size_t align = size & -size;
+    if (align <= 16) return malloc(size);
+    return aligned_alloc(align > 4096 ? 4096 : align, size);
+}
+
 static int64_t __zn_val_as_int(ZnValue v) { return v.as.i; }
 static double __zn_val_as_float(ZnValue v) { return v.as.f; }
 static bool __zn_val_as_bool(ZnValue v) { return v.as.b; }
@@ -154,6 +501,18 @@ static ZnArray *__zn_arr_alloc(int cap, ZnElemFn retain, ZnElemFn release, ZnHas
     return a;
 }
 
+/* Header and element storage in one allocation, for short literals */
+static ZnArray *__zn_arr_alloc_inline(int cap, ZnElemFn retain, ZnElemFn release, ZnHashFn hashcode, ZnEqFn equals) {
+    ZnArray *a = malloc(sizeof(ZnArray) + cap * sizeof(ZnValue));
+    a->_rc = 1; a->_len = 0; a->_cap = cap;
+    a->_data = a->_inline;
+    a->_elem_retain = retain;
+    a->_elem_release = release;
+    a->_elem_hashcode = hashcode;
+    a->_elem_equals = equals;
+    return a;
+}
+
 static void __zn_arr_retain(ZnArray *a) { if (a) a->_rc++; }
 
 static void __zn_arr_release(ZnArray *a) {
@@ -164,7 +523,7 @@ static void __zn_arr_release(ZnArray *a) {
                 if (a->_data[i].as.ptr) a->_elem_release(a->_data[i].as.ptr);
             }
         }
-        free(a->_data);
+        if (a->_data != a->_inline) free(a->_data);
         free(a);
     }
 }
@@ -172,7 +531,12 @@ static void __zn_arr_release(ZnArray *a) {
 static void __zn_arr_push(ZnArray *a, ZnValue v) {
     if (a->_len >= a->_cap) {
         a->_cap = a->_cap > 0 ? a->_cap * 2 : 4;
-        a->_data = realloc(a->_data, a->_cap * sizeof(ZnValue));
+        if (a->_data == a->_inline) {
+            /* Spill: the inline slots stay behind, unused */
+            a->_data = memcpy(malloc(a->_cap * sizeof(ZnValue)), a->_inline, a->_len * sizeof(ZnValue));
+        } else {
+            a->_data = realloc(a->_data, a->_cap * sizeof(ZnValue));
+        }
     }
     if (a->_elem_retain && v.as.ptr) a->_elem_retain(v.as.ptr);
     a->_data[a->_len++] = v;
@@ -191,14 +555,79 @@ static void __zn_arr_set(ZnArray *a, int64_t idx, ZnValue v) {
     a->_data[idx] = v;
 }
 
+/* Format a scalar element straight into dst; returns bytes written.
+ * __zn_val_fmt_max gives an upper bound so join can allocate once. */
+static const char __zn_digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static int32_t __zn_fmt_int(char *dst, int64_t v) {
+    char buf[20]; char *p = buf + 20;
+    uint64_t u = v < 0 ? 0 - (uint64_t)v : (uint64_t)v;
+    while (u >= 100) { p -= 2; memcpy(p, __zn_digit_pairs + (u % 100) * 2, 2); u /= 100; }
+    if (u >= 10) { p -= 2; memcpy(p, __zn_digit_pairs + u * 2, 2); }
+    else *--p = (char)('0' + u);
+    int32_t n = (int32_t)(buf + 20 - p), neg = v < 0;
+    if (neg) *dst++ = '-';
+    memcpy(dst, p, n);
+    return n + neg;
+}
+
+static int32_t __zn_val_fmt_max(ZnValue v) {
+    switch (v.tag) {
+    case ZN_TAG_INT: return 20;
+    case ZN_TAG_FLOAT: return 32;
+    case ZN_TAG_BOOL: return 5;
+    case ZN_TAG_CHAR: return 1;
+    case ZN_TAG_STRING: return ((ZnString*)v.as.ptr)->_len;
+    default: return 0;
+    }
+}
+
+static int32_t __zn_val_fmt(char *dst, ZnValue v) {
+    switch (v.tag) {
+    case ZN_TAG_INT: return __zn_fmt_int(dst, v.as.i);
+    case ZN_TAG_FLOAT: return snprintf(dst, 32, "%g", v.as.f);
+    case ZN_TAG_BOOL: if (v.as.b) { memcpy(dst, "true", 4); return 4; } memcpy(dst, "false", 5); return 5;
+    case ZN_TAG_CHAR: *dst = v.as.c; return 1;
+    case ZN_TAG_STRING: { ZnString *s = (ZnString*)v.as.ptr; memcpy(dst, s->_data, s->_len); return s->_len; }
+    default: return 0;
+    }
+}
+
+/* Join elements with sep: size the result in one pass, allocate once */
+static ZnString *__zn_arr_join(ZnArray *a, ZnString *sep) {
+    int64_t cap = a->_len > 0 ? (int64_t)sep->_len * (a->_len - 1) : 0;
+    for (int i = 0; i < a->_len; i++) cap += __zn_val_fmt_max(a->_data[i]);
+    if (cap > INT32_MAX) { fprintf(stderr, "Array join result too large: %lld bytes\n", (long long)cap); exit(1); }
+    ZnString *s = malloc(sizeof(ZnString) + cap + 1);
+    char *p = s->_data;
+    for (int i = 0; i < a->_len; i++) {
+        if (i > 0) { memcpy(p, sep->_data, sep->_len); p += sep->_len; }
+        p += __zn_val_fmt(p, a->_data[i]);
+    }
+    *p = '\0';
+    s->_rc = 1;
+    s->_len = (int32_t)(p - s->_data);
+    /* Numeric widths are estimates; give back a large unused tail */
+    if (cap - s->_len > 4096) s = realloc(s, sizeof(ZnString) + s->_len + 1);
+    return s;
+}
+
 /* --- Hash runtime (callback-based) --- */
 
+/* cap is the expected entry count; small hashes start with no buckets */
 static ZnHash *__zn_hash_alloc(int cap, ZnElemFn key_retain, ZnElemFn key_release,
                                 ZnHashFn key_hashcode, ZnEqFn key_equals,
                                 ZnElemFn val_retain, ZnElemFn val_release) {
     ZnHash *h = malloc(sizeof(ZnHash));
-    h->_rc = 1; h->_len = 0; h->_cap = cap > 0 ? cap : 8;
-    h->_buckets = calloc(h->_cap, sizeof(ZnHashEntry*));
+    h->_rc = 1; h->_len = 0; h->_cap = 0; h->_buckets = NULL; h->_tags = 0; h->_small = NULL;
+    h->_incremental = ZN_HASH_INCREMENTAL; h->_old = NULL; h->_old_cap = 0; h->_moved = 0;
+    if (cap > ZN_HASH_SMALL) {
+        h->_cap = cap * 2;
+        h->_buckets = calloc(h->_cap, sizeof(ZnHashEntry*));
+    }
     h->_key_retain = key_retain;
     h->_key_release = key_release;
     h->_key_hashcode = key_hashcode;
@@ -210,59 +639,174 @@ static ZnHash *__zn_hash_alloc(int cap, ZnElemFn key_retain, ZnElemFn key_releas
 
 static void __zn_hash_retain(ZnHash *h) { if (h) h->_rc++; }
 
+static void __zn_hash_free_buckets(ZnHash *h, ZnHashEntry **buckets, int cap) {
+    for (int i = 0; i < cap; i++) {
+        ZnHashEntry *e = buckets[i];
+        while (e) {
+            ZnHashEntry *next = e->next;
+            if (h->_key_release && e->key.as.ptr) h->_key_release(e->key.as.ptr);
+            if (h->_val_release && e->value.as.ptr) h->_val_release(e->value.as.ptr);
+            free(e);
+            e = next;
+        }
+    }
+    free(buckets);
+}
+
 static void __zn_hash_release(ZnHash *h) {
     if (!h) return;
     if (--(h->_rc) == 0) {
-        for (int i = 0; i < h->_cap; i++) {
-            ZnHashEntry *e = h->_buckets[i];
-            while (e) {
-                ZnHashEntry *next = e->next;
-                if (h->_key_release && e->key.as.ptr) h->_key_release(e->key.as.ptr);
-                if (h->_val_release && e->value.as.ptr) h->_val_release(e->value.as.ptr);
-                free(e);
-                e = next;
+        if (!h->_buckets) {
+            for (int i = 0; i < h->_len; i++) {
+                if (h->_key_release && h->_small->_keys[i].as.ptr) h->_key_release(h->_small->_keys[i].as.ptr);
+                if (h->_val_release && h->_small->_vals[i].as.ptr) h->_val_release(h->_small->_vals[i].as.ptr);
             }
+            free(h->_small);
+            free(h);
+            return;
+        }
+        if (h->_old) __zn_hash_free_buckets(h, h->_old, h->_old_cap);
+        __zn_hash_free_buckets(h, h->_buckets, h->_cap);
+        free(h);
+    }
+}
+
+static void __zn_hash_incremental_rehash(ZnHash *h, bool on) { h->_incremental = on; }
+
+/* Key hashes are often the identity on small ints; mix before taking the
+ * top seven bits. The high bit marks the tag as used. */
+static inline uint64_t __zn_hash_tag(unsigned int hc) {
+    return 0x80 | ((hc * 0x9E3779B1u) >> 25);
+}
+
+/* Bitmask with the high bit of every small slot whose tag matches:
+ * a SWAR byte compare of all eight tags at once. A borrow can flag a byte
+ * above a real match; callers confirm with the key's equals anyway. */
+static inline uint64_t __zn_hash_small_match(const ZnHash *h, uint64_t tag) {
+    uint64_t x = h->_tags ^ (tag * 0x0101010101010101ULL);
+    return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+}
+
+static int __zn_hash_small_index(ZnHash *h, ZnValue key, uint64_t tag) {
+    for (uint64_t m = __zn_hash_small_match(h, tag); m; m &= m - 1) {
+        int i = __builtin_ctzll(m) >> 3;
+        if (i < h->_len && h->_key_equals(h->_small->_keys[i], key)) return i;
+    }
+    return -1;
+}
+
+/* Move the chain in old bucket i into the current table */
+static void __zn_hash_move_bucket(ZnHash *h, ZnHashEntry **old_buckets, int i) {
+    ZnHashEntry *e = old_buckets[i];
+    while (e) {
+        ZnHashEntry *next = e->next;
+        unsigned int idx = h->_key_hashcode(e->key) % h->_cap;
+        e->next = h->_buckets[idx];
+        h->_buckets[idx] = e;
+        e = next;
+    }
+    old_buckets[i] = NULL;
+}
+
+/* Empty up to `steps` more non-empty old buckets, visiting at most ten
+ * times that many empty ones, so each call does bounded work */
+static void __zn_hash_migrate(ZnHash *h, int steps) {
+    int empty_visits = steps * 10;
+    while (steps > 0 && h->_moved < h->_old_cap) {
+        if (!h->_old[h->_moved]) {
+            h->_moved++;
+            if (--empty_visits == 0) break;
+            continue;
         }
-        free(h->_buckets); free(h);
+        __zn_hash_move_bucket(h, h->_old, h->_moved++);
+        steps--;
+    }
+    if (h->_moved == h->_old_cap) {
+        free(h->_old);
+        h->_old = NULL; h->_old_cap = 0; h->_moved = 0;
     }
 }
 
 static void __zn_hash_resize(ZnHash *h, int new_cap) {
+    /* A table still draining finishes first, so at most two exist */
+    if (h->_old) __zn_hash_migrate(h, h->_old_cap);
     ZnHashEntry **old_buckets = h->_buckets;
     int old_cap = h->_cap;
     h->_buckets = calloc(new_cap, sizeof(ZnHashEntry*));
     h->_cap = new_cap;
-    for (int i = 0; i < old_cap; i++) {
-        ZnHashEntry *e = old_buckets[i];
-        while (e) {
-            ZnHashEntry *next = e->next;
-            unsigned int idx = h->_key_hashcode(e->key) % new_cap;
-            e->next = h->_buckets[idx];
-            h->_buckets[idx] = e;
-            e = next;
-        }
+    if (h->_incremental) {
+        h->_old = old_buckets; h->_old_cap = old_cap; h->_moved = 0;
+        return;
     }
+    for (int i = 0; i < old_cap; i++) __zn_hash_move_bucket(h, old_buckets, i);
     free(old_buckets);
 }
 
-static ZnValue __zn_hash_get(ZnHash *h, ZnValue key) {
-    unsigned int idx = h->_key_hashcode(key) % h->_cap;
-    for (ZnHashEntry *e = h->_buckets[idx]; e; e = e->next) {
-        if (h->_key_equals(e->key, key)) return e->value;
+/* The entry for key in either table, or NULL; hc is the key's hashcode */
+static ZnHashEntry *__zn_hash_entry(ZnHash *h, ZnValue key, unsigned int hc) {
+    for (ZnHashEntry *e = h->_buckets[hc % h->_cap]; e; e = e->next) {
+        if (h->_key_equals(e->key, key)) return e;
+    }
+    if (h->_old) {
+        for (ZnHashEntry *e = h->_old[hc % h->_old_cap]; e; e = e->next) {
+            if (h->_key_equals(e->key, key)) return e;
+        }
+    }
+    return NULL;
+}
+
+/* Move the small entries out into a bucket table of cap buckets and free
+ * their block; ownership moves along */
+static void __zn_hash_spill(ZnHash *h, int cap) {
+    h->_cap = cap;
+    h->_buckets = calloc(h->_cap, sizeof(ZnHashEntry*));
+    for (int i = 0; i < h->_len; i++) {
+        ZnHashEntry *e = malloc(sizeof(ZnHashEntry));
+        unsigned int idx = h->_key_hashcode(h->_small->_keys[i]) % h->_cap;
+        e->key = h->_small->_keys[i]; e->value = h->_small->_vals[i];
+        e->next = h->_buckets[idx];
+        h->_buckets[idx] = e;
+    }
+    h->_tags = 0;
+    free(h->_small);
+    h->_small = NULL;
+}
+
+/* The stored value for key, or NULL when absent; hc is the key's hashcode.
+ * Only an incremental hash is modified by a lookup. */
+static ZnValue *__zn_hash_find_hashed(ZnHash *h, ZnValue key, unsigned int hc) {
+    if (!h->_buckets) {
+        if (h->_len == 0) return NULL;
+        int i = __zn_hash_small_index(h, key, __zn_hash_tag(hc));
+        return i >= 0 ? &h->_small->_vals[i] : NULL;
     }
+    if (h->_old) __zn_hash_migrate(h, ZN_HASH_REHASH_STEP);
+    ZnHashEntry *e = __zn_hash_entry(h, key, hc);
+    return e ? &e->value : NULL;
+}
+
+static ZnValue *__zn_hash_find(ZnHash *h, ZnValue key) {
+    return __zn_hash_find_hashed(h, key, h->_key_hashcode(key));
+}
+
+static ZnValue __zn_hash_get(ZnHash *h, ZnValue key) {
+    ZnValue *v = __zn_hash_find(h, key);
+    if (v) return *v;
     ZnValue nil; nil.tag = ZN_TAG_INT; nil.as.i = 0; return nil;
 }
 
-static void __zn_hash_set(ZnHash *h, ZnValue key, ZnValue value) {
-    unsigned int idx = h->_key_hashcode(key) % h->_cap;
-    for (ZnHashEntry *e = h->_buckets[idx]; e; e = e->next) {
-        if (h->_key_equals(e->key, key)) {
-            if (h->_val_release && e->value.as.ptr) h->_val_release(e->value.as.ptr);
-            if (h->_val_retain && value.as.ptr) h->_val_retain(value.as.ptr);
-            e->value = value;
-            return;
-        }
+/* Bucket-table insert or update with the key's hashcode already known;
+ * false when the key was present and only its value was replaced */
+static bool __zn_hash_put(ZnHash *h, ZnValue key, ZnValue value, unsigned int hc) {
+    if (h->_old) __zn_hash_migrate(h, ZN_HASH_REHASH_STEP);
+    ZnHashEntry *e = __zn_hash_entry(h, key, hc);
+    if (e) {
+        if (h->_val_release && e->value.as.ptr) h->_val_release(e->value.as.ptr);
+        if (h->_val_retain && value.as.ptr) h->_val_retain(value.as.ptr);
+        e->value = value;
+        return false;
     }
+    unsigned int idx = hc % h->_cap;
     ZnHashEntry *ne = malloc(sizeof(ZnHashEntry));
     if (h->_key_retain && key.as.ptr) h->_key_retain(key.as.ptr);
     if (h->_val_retain && value.as.ptr) h->_val_retain(value.as.ptr);
@@ -273,6 +817,3045 @@ static void __zn_hash_set(ZnHash *h, ZnValue key, ZnValue value) {
     if (h->_len * 4 > h->_cap * 3) {
         __zn_hash_resize(h, h->_cap * 2);
     }
+    return true;
+}
+
+static bool __zn_hash_set_hashed(ZnHash *h, ZnValue key, ZnValue value, unsigned int hc) {
+    if (!h->_buckets) {
+        uint64_t tag = __zn_hash_tag(hc);
+        int i = __zn_hash_small_index(h, key, tag);
+        if (i >= 0) {
+            if (h->_val_release && h->_small->_vals[i].as.ptr) h->_val_release(h->_small->_vals[i].as.ptr);
+            if (h->_val_retain && value.as.ptr) h->_val_retain(value.as.ptr);
+            h->_small->_vals[i] = value;
+            return false;
+        }
+        if (h->_len < ZN_HASH_SMALL) {
+            if (!h->_small) h->_small = malloc(sizeof(ZnHashSmall));
+            if (h->_key_retain && key.as.ptr) h->_key_retain(key.as.ptr);
+            if (h->_val_retain && value.as.ptr) h->_val_retain(value.as.ptr);
+            i = h->_len++;
+            h->_small->_keys[i] = key; h->_small->_vals[i] = value;
+            h->_tags |= tag << (i * 8);
+            return true;
+        }
+        __zn_hash_spill(h, ZN_HASH_SMALL * 4);
+    }
+    return __zn_hash_put(h, key, value, hc);
+}
+
+static void __zn_hash_set(ZnHash *h, ZnValue key, ZnValue value) {
+    __zn_hash_set_hashed(h, key, value, h->_key_hashcode(key));
+}
+
+/* Size the bucket table for n entries up front, so filling it never resizes */
+static void __zn_hash_reserve(ZnHash *h, int32_t n) {
+    if (n <= ZN_HASH_SMALL || (h->_buckets && h->_cap >= n * 2)) return;
+    if (!h->_buckets) __zn_hash_spill(h, n * 2);
+    else __zn_hash_resize(h, n * 2);
+}
+
+/* The value slot for key, holding `zero` if the key was absent: a single
+ * probe either way. An owned key is consumed, released again when already
+ * present; a borrowed key is retained only when inserted. */
+static ZnValue *__zn_hash_upsert(ZnHash *h, ZnValue key, unsigned int hc, ZnValue zero, bool owned) {
+    if (!h->_buckets) {
+        uint64_t tag = __zn_hash_tag(hc);
+        int i = h->_len ? __zn_hash_small_index(h, key, tag) : -1;
+        if (i >= 0) {
+            if (owned && h->_key_release && key.as.ptr) h->_key_release(key.as.ptr);
+            return &h->_small->_vals[i];
+        }
+        if (h->_len < ZN_HASH_SMALL) {
+            if (!h->_small) h->_small = malloc(sizeof(ZnHashSmall));
+            if (!owned && h->_key_retain && key.as.ptr) h->_key_retain(key.as.ptr);
+            i = h->_len++;
+            h->_small->_keys[i] = key; h->_small->_vals[i] = zero;
+            h->_tags |= tag << (i * 8);
+            return &h->_small->_vals[i];
+        }
+        __zn_hash_spill(h, ZN_HASH_SMALL * 4);
+    }
+    if (h->_old) __zn_hash_migrate(h, ZN_HASH_REHASH_STEP);
+    ZnHashEntry *e = __zn_hash_entry(h, key, hc);
+    if (e) {
+        if (owned && h->_key_release && key.as.ptr) h->_key_release(key.as.ptr);
+        return &e->value;
+    }
+    unsigned int idx = hc % h->_cap;
+    e = malloc(sizeof(ZnHashEntry));
+    if (!owned && h->_key_retain && key.as.ptr) h->_key_retain(key.as.ptr);
+    e->key = key; e->value = zero;
+    e->next = h->_buckets[idx];
+    h->_buckets[idx] = e;
+    /* Entries are never moved by a resize, only relinked */
+    if (++h->_len * 4 > h->_cap * 3) __zn_hash_resize(h, h->_cap * 2);
+    return &e->value;
+}
+
+/* Drop key's entry, releasing its key and value; false when absent */
+static bool __zn_hash_remove_hashed(ZnHash *h, ZnValue key, unsigned int hc) {
+    if (!h->_buckets) {
+        int i = h->_len ? __zn_hash_small_index(h, key, __zn_hash_tag(hc)) : -1;
+        if (i < 0) return false;
+        if (h->_key_release && h->_small->_keys[i].as.ptr) h->_key_release(h->_small->_keys[i].as.ptr);
+        if (h->_val_release && h->_small->_vals[i].as.ptr) h->_val_release(h->_small->_vals[i].as.ptr);
+        /* The last small entry, tag and all, fills the hole */
+        int last = --h->_len;
+        uint64_t tag = (h->_tags >> (last * 8)) & 0xFF;
+        h->_small->_keys[i] = h->_small->_keys[last]; h->_small->_vals[i] = h->_small->_vals[last];
+        h->_tags = (h->_tags & ~(0xFFULL << (i * 8))) | (tag << (i * 8));
+        h->_tags &= ~(0xFFULL << (last * 8));
+        return true;
+    }
+    if (h->_old) __zn_hash_migrate(h, ZN_HASH_REHASH_STEP);
+    for (int t = 0; t < 2; t++) {
+        ZnHashEntry **buckets = t ? h->_old : h->_buckets;
+        if (!buckets) break;
+        for (ZnHashEntry **p = &buckets[hc % (t ? h->_old_cap : h->_cap)]; *p; p = &(*p)->next) {
+            ZnHashEntry *e = *p;
+            if (!h->_key_equals(e->key, key)) continue;
+            *p = e->next;
+            if (h->_key_release && e->key.as.ptr) h->_key_release(e->key.as.ptr);
+            if (h->_val_release && e->value.as.ptr) h->_val_release(e->value.as.ptr);
+            free(e);
+            h->_len--;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Batched access for tables much larger than cache. Each batch of
+ * ZN_HASH_BATCH keys is hashed and its bucket heads prefetched, then the
+ * first entry of every chain is prefetched, then the batch is resolved:
+ * the misses of a whole batch overlap instead of being paid one by one. */
+#define ZN_HASH_BATCH 16
+
+static void __zn_hash_prefetch_batch(ZnHash *h, ZnValue *keys, int32_t n, unsigned int *hc) {
+    for (int32_t i = 0; i < n; i++) {
+        hc[i] = h->_key_hashcode(keys[i]);
+        if (h->_buckets) __builtin_prefetch(&h->_buckets[hc[i] % h->_cap]);
+    }
+    if (!h->_buckets) return;
+    for (int32_t i = 0; i < n; i++) {
+        ZnHashEntry *e = h->_buckets[hc[i] % h->_cap];
+        if (e) __builtin_prefetch(e);
+    }
+}
+
+/* Values for keys, in order, pushed onto out. A missing key gives the
+ * same zero value as a lookup; boxed values of val_size bytes are copied
+ * through val_ret. */
+static ZnArray *__zn_hash_get_many(ZnHash *h, ZnArray *keys, ZnArray *out, size_t val_size, ZnElemFn val_ret) {
+    unsigned int hc[ZN_HASH_BATCH];
+    for (int32_t base = 0; base < keys->_len; base += ZN_HASH_BATCH) {
+        int32_t n = keys->_len - base < ZN_HASH_BATCH ? keys->_len - base : ZN_HASH_BATCH;
+        ZnValue *batch = keys->_data + base;
+        if (h->_old) __zn_hash_migrate(h, ZN_HASH_REHASH_STEP);
+        __zn_hash_prefetch_batch(h, batch, n, hc);
+        for (int32_t i = 0; i < n; i++) {
+            ZnValue *found;
+            if (h->_buckets) {
+                ZnHashEntry *e = __zn_hash_entry(h, batch[i], hc[i]);
+                found = e ? &e->value : NULL;
+            } else {
+                int j = h->_len ? __zn_hash_small_index(h, batch[i], __zn_hash_tag(hc[i])) : -1;
+                found = j >= 0 ? &h->_small->_vals[j] : NULL;
+            }
+            ZnValue v;
+            if (found) v = *found;
+            else { v.tag = ZN_TAG_INT; v.as.i = 0; }
+            if (val_size) {
+                void *cp = found ? __zn_val_dup(v.as.ptr, val_size, val_ret) : calloc(1, val_size);
+                v.tag = ZN_TAG_VAL; v.as.ptr = cp;
+            }
+            __zn_arr_push(out, v);
+        }
+    }
+    return out;
+}
+
+/* h[keys[i]] = vals[i] for every i, batched like get_many. Boxed keys and
+ * values of key_size / val_size bytes are copied into the table through
+ * key_ret / val_ret; the key copy is dropped again if the key was present. */
+static void __zn_hash_set_many(ZnHash *h, ZnArray *keys, ZnArray *vals,
+                               size_t key_size, ZnElemFn key_ret, size_t val_size, ZnElemFn val_ret) {
+    if (vals->_len != keys->_len) {
+        fprintf(stderr, "set_many needs as many values as keys: %d keys, %d values\n", keys->_len, vals->_len);
+        exit(1);
+    }
+    unsigned int hc[ZN_HASH_BATCH];
+    for (int32_t base = 0; base < keys->_len; base += ZN_HASH_BATCH) {
+        int32_t n = keys->_len - base < ZN_HASH_BATCH ? keys->_len - base : ZN_HASH_BATCH;
+        __zn_hash_prefetch_batch(h, keys->_data + base, n, hc);
+        for (int32_t i = 0; i < n; i++) {
+            ZnValue k = keys->_data[base + i], v = vals->_data[base + i];
+            if (key_size) k.as.ptr = __zn_val_dup(k.as.ptr, key_size, key_ret);
+            if (val_size) v.as.ptr = __zn_val_dup(v.as.ptr, val_size, val_ret);
+            if (!__zn_hash_set_hashed(h, k, v, hc[i]) && key_size) h->_key_release(k.as.ptr);
+        }
+    }
+}
+
+/* --- Grouping runtime (group_count / group_sum / distinct) ---
+ * Key and value functions take a borrowed element and return an owned
+ * boxed result. Result tables are presized for up to ZN_GROUP_PRESIZE
+ * groups, and every element costs one upsert probe. */
+
+typedef ZnValue (*ZnElemMapFn)(ZnValue);
+
+#define ZN_GROUP_PRESIZE 4096
+
+static int32_t __zn_group_presize(ZnArray *a) {
+    return a->_len < ZN_GROUP_PRESIZE ? a->_len : ZN_GROUP_PRESIZE;
+}
+
+/* Element count per key; a NULL key_fn groups by the element itself */
+static ZnHash *__zn_arr_group_count(ZnArray *a, ZnElemMapFn key_fn, ZnHash *out) {
+    __zn_hash_reserve(out, __zn_group_presize(a));
+    ZnValue zero; zero.tag = ZN_TAG_INT; zero.as.i = 0;
+    for (int32_t i = 0; i < a->_len; i++) {
+        ZnValue k = key_fn ? key_fn(a->_data[i]) : a->_data[i];
+        __zn_hash_upsert(out, k, out->_key_hashcode(k), zero, key_fn != NULL)->as.i++;
+    }
+    return out;
+}
+
+/* Sum of val_fn over the elements of each key; sums are int or float,
+ * following val_fn's result */
+static ZnHash *__zn_arr_group_sum(ZnArray *a, ZnElemMapFn key_fn, ZnElemMapFn val_fn, ZnHash *out) {
+    __zn_hash_reserve(out, __zn_group_presize(a));
+    for (int32_t i = 0; i < a->_len; i++) {
+        ZnValue k = key_fn(a->_data[i]);
+        ZnValue v = val_fn(a->_data[i]);
+        ZnValue zero; zero.tag = v.tag; zero.as.i = 0;
+        ZnValue *sum = __zn_hash_upsert(out, k, out->_key_hashcode(k), zero, true);
+        if (v.tag == ZN_TAG_FLOAT) sum->as.f += v.as.f;
+        else sum->as.i += v.as.i;
+    }
+    return out;
+}
+
+/* The elements of a without repeats, in first-occurrence order, pushed
+ * onto out. The seen-set borrows its keys from a. */
+static ZnArray *__zn_arr_distinct(ZnArray *a, ZnHashFn hashcode, ZnEqFn equals, ZnArray *out) {
+    ZnHash *seen = __zn_hash_alloc(0, NULL, NULL, hashcode, equals, NULL, NULL);
+    __zn_hash_reserve(seen, __zn_group_presize(a));
+    ZnValue unseen; unseen.tag = ZN_TAG_BOOL; unseen.as.i = 0;
+    for (int32_t i = 0; i < a->_len; i++) {
+        ZnValue e = a->_data[i];
+        ZnValue *mark = __zn_hash_upsert(seen, e, seen->_key_hashcode(e), unseen, false);
+        if (!mark->as.b) {
+            mark->as.b = true;
+            __zn_arr_push(out, e);
+        }
+    }
+    __zn_hash_release(seen);
+    return out;
+}
+
+/* --- Rope runtime (persistent balanced tree of string chunks) --- */
+
+/* Appending a leaf shorter than this onto a rope ending in a short leaf
+ * copies both into one chunk, so append-heavy building keeps leaves dense. */
+#define ZN_ROPE_SHORT 64
+
+static struct { int32_t _rc; int32_t _len; char _data[1]; } __zn_rope_empty_str = {-1, 0, ""};
+
+static void __zn_rope_retain(ZnRope *r) { if (r) r->_rc++; }
+
+static void __zn_rope_release(ZnRope *r) {
+    while (r && --(r->_rc) == 0) {
+        ZnRope *right = r->_right;
+        __zn_str_release(r->_str);
+        __zn_str_release(r->_flat);
+        __zn_rope_release(r->_left);
+        free(r);
+        r = right;
+    }
+}
+
+static ZnRope *__zn_rope_leaf(ZnString *s, int32_t off, int32_t len) {
+    ZnRope *r = malloc(sizeof(ZnRope));
+    r->_rc = 1; r->_depth = 0; r->_len = len;
+    r->_str = s; r->_off = off;
+    r->_left = NULL; r->_right = NULL; r->_flat = NULL;
+    __zn_str_retain(s);
+    return r;
+}
+
+static ZnRope *__zn_rope_empty(void) {
+    return __zn_rope_leaf((ZnString*)&__zn_rope_empty_str, 0, 0);
+}
+
+static ZnRope *__zn_rope_from_str(ZnString *s) {
+    return __zn_rope_leaf(s, 0, s->_len);
+}
+
+/* Concat node over two borrowed subtrees */
+static ZnRope *__zn_rope_node(ZnRope *l, ZnRope *r) {
+    ZnRope *n = malloc(sizeof(ZnRope));
+    n->_rc = 1;
+    n->_depth = (l->_depth > r->_depth ? l->_depth : r->_depth) + 1;
+    n->_len = l->_len + r->_len;
+    n->_str = NULL; n->_off = 0; n->_flat = NULL;
+    n->_left = l; n->_right = r;
+    l->_rc++; r->_rc++;
+    return n;
+}
+
+/* (a, (b, c)) -> ((a, b), c) */
+static ZnRope *__zn_rope_rotl(ZnRope *n) {
+    ZnRope *ab = __zn_rope_node(n->_left, n->_right->_left);
+    ZnRope *res = __zn_rope_node(ab, n->_right->_right);
+    __zn_rope_release(ab);
+    return res;
+}
+
+/* ((a, b), c) -> (a, (b, c)) */
+static ZnRope *__zn_rope_rotr(ZnRope *n) {
+    ZnRope *bc = __zn_rope_node(n->_left->_right, n->_right);
+    ZnRope *res = __zn_rope_node(n->_left->_left, bc);
+    __zn_rope_release(bc);
+    return res;
+}
+
+/* AVL join where l is more than one level deeper than r: walk down l's
+ * right spine to a subtree of matching depth and rebalance on the way up. */
+static ZnRope *__zn_rope_join_right(ZnRope *l, ZnRope *r) {
+    ZnRope *ll = l->_left, *c = l->_right, *t, *n, *res;
+    if (c->_depth <= r->_depth + 1) {
+        t = __zn_rope_node(c, r);
+        if (t->_depth <= ll->_depth + 1) {
+            res = __zn_rope_node(ll, t);
+        } else {
+            ZnRope *rt = __zn_rope_rotr(t);
+            n = __zn_rope_node(ll, rt);
+            res = __zn_rope_rotl(n);
+            __zn_rope_release(rt); __zn_rope_release(n);
+        }
+    } else {
+        t = __zn_rope_join_right(c, r);
+        if (t->_depth <= ll->_depth + 1) {
+            res = __zn_rope_node(ll, t);
+        } else {
+            n = __zn_rope_node(ll, t);
+            res = __zn_rope_rotl(n);
+            __zn_rope_release(n);
+        }
+    }
+    __zn_rope_release(t);
+    return res;
+}
+
+/* Mirror of __zn_rope_join_right for a deeper right operand */
+static ZnRope *__zn_rope_join_left(ZnRope *l, ZnRope *r) {
+    ZnRope *c = r->_left, *rr = r->_right, *t, *n, *res;
+    if (c->_depth <= l->_depth + 1) {
+        t = __zn_rope_node(l, c);
+        if (t->_depth <= rr->_depth + 1) {
+            res = __zn_rope_node(t, rr);
+        } else {
+            ZnRope *lt = __zn_rope_rotl(t);
+            n = __zn_rope_node(lt, rr);
+            res = __zn_rope_rotr(n);
+            __zn_rope_release(lt); __zn_rope_release(n);
+        }
+    } else {
+        t = __zn_rope_join_left(l, c);
+        if (t->_depth <= rr->_depth + 1) {
+            res = __zn_rope_node(t, rr);
+        } else {
+            n = __zn_rope_node(t, rr);
+            res = __zn_rope_rotr(n);
+            __zn_rope_release(n);
+        }
+    }
+    __zn_rope_release(t);
+    return res;
+}
+
+/* O(log n) balanced concatenation of two borrowed ropes */
+static ZnRope *__zn_rope_join(ZnRope *l, ZnRope *r) {
+    if (l->_len == 0) { r->_rc++; return r; }
+    if (r->_len == 0) { l->_rc++; return l; }
+    if (l->_depth > r->_depth + 1) return __zn_rope_join_right(l, r);
+    if (r->_depth > l->_depth + 1) return __zn_rope_join_left(l, r);
+    return __zn_rope_node(l, r);
+}
+
+/* Merge short leaf b into the rightmost leaf of a, rebuilding a's right
+ * spine (depths are unchanged). Returns NULL if the chunks don't fit. */
+static ZnRope *__zn_rope_append_short(ZnRope *a, ZnRope *b) {
+    if (a->_depth == 0) {
+        int32_t len = (int32_t)(a->_len + b->_len);
+        if (len > ZN_ROPE_SHORT) return NULL;
+        ZnString *s = malloc(sizeof(ZnString) + len + 1);
+        s->_rc = 1; s->_len = len;
+        memcpy(s->_data, a->_str->_data + a->_off, a->_len);
+        memcpy(s->_data + a->_len, b->_str->_data + b->_off, b->_len);
+        s->_data[len] = '\0';
+        ZnRope *res = __zn_rope_leaf(s, 0, len);
+        __zn_str_release(s);
+        return res;
+    }
+    ZnRope *t = __zn_rope_append_short(a->_right, b);
+    if (!t) return NULL;
+    ZnRope *res = __zn_rope_node(a->_left, t);
+    __zn_rope_release(t);
+    return res;
+}
+
+static ZnRope *__zn_rope_concat(ZnRope *a, ZnRope *b) {
+    if (b->_depth == 0 && b->_len > 0 && b->_len < ZN_ROPE_SHORT && a->_len > 0) {
+        ZnRope *res = __zn_rope_append_short(a, b);
+        if (res) return res;
+    }
+    return __zn_rope_join(a, b);
+}
+
+static ZnRope *__zn_rope_concat_str(ZnRope *a, ZnString *s) {
+    ZnRope *leaf = __zn_rope_from_str(s);
+    ZnRope *res = __zn_rope_concat(a, leaf);
+    __zn_rope_release(leaf);
+    return res;
+}
+
+/* Split r at byte offset i into owned halves [0, i) and [i, len) */
+static void __zn_rope_split(ZnRope *r, int64_t i, ZnRope **lo, ZnRope **hi) {
+    if (i <= 0) { *lo = __zn_rope_empty(); r->_rc++; *hi = r; return; }
+    if (i >= r->_len) { r->_rc++; *lo = r; *hi = __zn_rope_empty(); return; }
+    if (r->_depth == 0) {
+        *lo = __zn_rope_leaf(r->_str, r->_off, (int32_t)i);
+        *hi = __zn_rope_leaf(r->_str, r->_off + (int32_t)i, (int32_t)(r->_len - i));
+        return;
+    }
+    ZnRope *a, *b;
+    int64_t ll = r->_left->_len;
+    if (i < ll) {
+        __zn_rope_split(r->_left, i, &a, &b);
+        *lo = a;
+        *hi = __zn_rope_join(b, r->_right);
+        __zn_rope_release(b);
+    } else if (i == ll) {
+        r->_left->_rc++; r->_right->_rc++;
+        *lo = r->_left; *hi = r->_right;
+    } else {
+        __zn_rope_split(r->_right, i - ll, &a, &b);
+        *lo = __zn_rope_join(r->_left, a);
+        *hi = b;
+        __zn_rope_release(a);
+    }
+}
+
+static void __zn_rope_check_range(ZnRope *r, int64_t i, int64_t n) {
+    if (i < 0 || n < 0 || i + n > r->_len) {
+        fprintf(stderr, "Rope range out of bounds: %lld+%lld (length %lld)\n", (long long)i, (long long)n, (long long)r->_len);
+        exit(1);
+    }
+}
+
+static ZnRope *__zn_rope_insert(ZnRope *r, int64_t i, ZnRope *ins) {
+    __zn_rope_check_range(r, i, 0);
+    ZnRope *lo, *hi;
+    __zn_rope_split(r, i, &lo, &hi);
+    ZnRope *t = __zn_rope_join(lo, ins);
+    ZnRope *res = __zn_rope_join(t, hi);
+    __zn_rope_release(lo); __zn_rope_release(hi); __zn_rope_release(t);
+    return res;
+}
+
+static ZnRope *__zn_rope_insert_str(ZnRope *r, int64_t i, ZnString *s) {
+    ZnRope *leaf = __zn_rope_from_str(s);
+    ZnRope *res = __zn_rope_insert(r, i, leaf);
+    __zn_rope_release(leaf);
+    return res;
+}
+
+static ZnRope *__zn_rope_delete(ZnRope *r, int64_t i, int64_t n) {
+    __zn_rope_check_range(r, i, n);
+    ZnRope *a, *rest, *mid, *c;
+    __zn_rope_split(r, i, &a, &rest);
+    __zn_rope_split(rest, n, &mid, &c);
+    ZnRope *res = __zn_rope_join(a, c);
+    __zn_rope_release(a); __zn_rope_release(rest);
+    __zn_rope_release(mid); __zn_rope_release(c);
+    return res;
+}
+
+static ZnRope *__zn_rope_substring(ZnRope *r, int64_t i, int64_t n) {
+    __zn_rope_check_range(r, i, n);
+    ZnRope *a, *rest, *mid, *c;
+    __zn_rope_split(r, i, &a, &rest);
+    __zn_rope_split(rest, n, &mid, &c);
+    __zn_rope_release(a); __zn_rope_release(rest); __zn_rope_release(c);
+    return mid;
+}
+
+static char __zn_rope_char_at(ZnRope *r, int64_t i) {
+    if (i < 0 || i >= r->_len) { fprintf(stderr, "Rope index out of bounds: %lld (length %lld)\n", (long long)i, (long long)r->_len); exit(1); }
+    while (r->_depth > 0) {
+        if (i < r->_left->_len) r = r->_left;
+        else { i -= r->_left->_len; r = r->_right; }
+    }
+    return r->_str->_data[r->_off + i];
+}
+
+/* Zero-copy in-order walk over the rope's chunks */
+typedef void (*ZnChunkFn)(const char *data, int32_t len, void *ctx);
+
+static void __zn_rope_foreach(ZnRope *r, ZnChunkFn fn, void *ctx) {
+    while (r->_depth > 0) {
+        __zn_rope_foreach(r->_left, fn, ctx);
+        r = r->_right;
+    }
+    if (r->_len > 0) fn(r->_str->_data + r->_off, (int32_t)r->_len, ctx);
+}
+
+static void __zn_rope_write_chunk(const char *data, int32_t len, void *ctx) {
+    fwrite(data, 1, len, (FILE*)ctx);
+}
+
+static void __zn_rope_write(ZnRope *r, FILE *out) {
+    __zn_rope_foreach(r, __zn_rope_write_chunk, out);
+}
+
+static void __zn_rope_copy_chunk(const char *data, int32_t len, void *ctx) {
+    char **dst = (char**)ctx;
+    memcpy(*dst, data, len);
+    *dst += len;
+}
+
+/* Flatten into a ZnString; the result is cached on the (immutable) node */
+static ZnString *__zn_rope_flatten(ZnRope *r) {
+    if (r->_depth == 0 && r->_off == 0 && r->_len == r->_str->_len) {
+        __zn_str_retain(r->_str);
+        return r->_str;
+    }
+    if (!r->_flat) {
+        if (r->_len > INT32_MAX) { fprintf(stderr, "Rope too large to flatten: %lld bytes\n", (long long)r->_len); exit(1); }
+        ZnString *s = malloc(sizeof(ZnString) + r->_len + 1);
+        s->_rc = 1; s->_len = (int32_t)r->_len;
+        char *dst = s->_data;
+        __zn_rope_foreach(r, __zn_rope_copy_chunk, &dst);
+        s->_data[s->_len] = '\0';
+        r->_flat = s;
+    }
+    __zn_str_retain(r->_flat);
+    return r->_flat;
+}
+
+/* --- Heap runtime (4-ary min-heap with stable handles) ---
+ * A fan-out of 4 halves the tree height of a binary heap and keeps the
+ * children of a node contiguous, so sift-down touches fewer cache lines.
+ * Handles pack (generation << 32 | slot); popping an element bumps its
+ * slot's generation, so stale handles are caught after the slot is reused.
+ * Sift loops are instantiated per element type by ZN_HEAP_SPECIALIZE with
+ * a direct comparator call instead of a function pointer. */
+
+static ZnHeap *__zn_heap_alloc(int32_t cap, ZnElemFn retain, ZnElemFn release) {
+    ZnHeap *h = malloc(sizeof(ZnHeap));
+    h->_rc = 1; h->_len = 0; h->_cap = cap; h->_nslots = 0; h->_free = -1;
+    h->_data = cap > 0 ? malloc(cap * sizeof(ZnValue)) : NULL;
+    h->_slot = cap > 0 ? malloc(cap * sizeof(int32_t)) : NULL;
+    h->_pos = cap > 0 ? malloc(cap * sizeof(int32_t)) : NULL;
+    h->_gen = cap > 0 ? malloc(cap * sizeof(uint32_t)) : NULL;
+    h->_elem_retain = retain;
+    h->_elem_release = release;
+    return h;
+}
+
+static void __zn_heap_retain(ZnHeap *h) { if (h) h->_rc++; }
+
+static void __zn_heap_release(ZnHeap *h) {
+    if (!h) return;
+    if (--(h->_rc) == 0) {
+        if (h->_elem_release) {
+            for (int32_t i = 0; i < h->_len; i++) {
+                if (h->_data[i].as.ptr) h->_elem_release(h->_data[i].as.ptr);
+            }
+        }
+        free(h->_data); free(h->_slot); free(h->_pos); free(h->_gen);
+        free(h);
+    }
+}
+
+/* Live slots never outnumber elements, so all four arrays share _cap */
+static void __zn_heap_grow(ZnHeap *h) {
+    h->_cap = h->_cap > 0 ? h->_cap * 2 : 8;
+    h->_data = realloc(h->_data, h->_cap * sizeof(ZnValue));
+    h->_slot = realloc(h->_slot, h->_cap * sizeof(int32_t));
+    h->_pos = realloc(h->_pos, h->_cap * sizeof(int32_t));
+    h->_gen = realloc(h->_gen, h->_cap * sizeof(uint32_t));
+}
+
+static int32_t __zn_heap_take_slot(ZnHeap *h) {
+    int32_t s = h->_free;
+    if (s >= 0) { h->_free = -h->_pos[s] - 2; return s; }
+    h->_gen[h->_nslots] = 0;
+    return h->_nslots++;
+}
+
+static void __zn_heap_drop_slot(ZnHeap *h, int32_t s) {
+    h->_gen[s]++;
+    h->_pos[s] = -h->_free - 2;
+    h->_free = s;
+}
+
+static int64_t __zn_heap_handle(ZnHeap *h, int32_t s) {
+    return (int64_t)(((uint64_t)h->_gen[s] << 32) | (uint32_t)s);
+}
+
+/* Position of a handle's element, or -1 if it was popped */
+static int32_t __zn_heap_find(ZnHeap *h, int64_t handle) {
+    uint64_t u = (uint64_t)handle;
+    uint32_t s = (uint32_t)u;
+    if (s >= (uint32_t)h->_nslots || h->_gen[s] != (uint32_t)(u >> 32)) return -1;
+    return h->_pos[s] >= 0 ? h->_pos[s] : -1;
+}
+
+static bool __zn_heap_contains(ZnHeap *h, int64_t handle) {
+    return __zn_heap_find(h, handle) >= 0;
+}
+
+static ZnValue __zn_heap_peek(ZnHeap *h) {
+    if (h->_len == 0) { fprintf(stderr, "Heap is empty\n"); exit(1); }
+    return h->_data[0];
+}
+
+/* Three-way comparators for the builtin element types */
+static inline int __zn_cmp_int(ZnValue a, ZnValue b) { return (a.as.i > b.as.i) - (a.as.i < b.as.i); }
+static inline int __zn_cmp_float(ZnValue a, ZnValue b) { return (a.as.f > b.as.f) - (a.as.f < b.as.f); }
+static inline int __zn_cmp_char(ZnValue a, ZnValue b) { return (a.as.c > b.as.c) - (a.as.c < b.as.c); }
+static inline int __zn_cmp_bool(ZnValue a, ZnValue b) { return (int)a.as.b - (int)b.as.b; }
+
+static int __zn_cmp_str(ZnValue a, ZnValue b) {
+    ZnString *x = (ZnString*)a.as.ptr, *y = (ZnString*)b.as.ptr;
+    int c = memcmp(x->_data, y->_data, x->_len < y->_len ? x->_len : y->_len);
+    return c ? c : (x->_len > y->_len) - (x->_len < y->_len);
+}
+
+/* Both sifts move a hole instead of swapping, writing each entry once.
+ * pop transfers the element's reference to the caller. from_arr copies the
+ * array's elements (boxed values of val_size bytes are duplicated through
+ * val_ret) and heapifies bottom-up in O(n). */
+#define ZN_HEAP_SPECIALIZE(SFX, CMP) \
+static inline void __zn_heap_up_##SFX(ZnHeap *h, int32_t i) { \
+    ZnValue v = h->_data[i]; int32_t s = h->_slot[i]; \
+    while (i > 0) { \
+        int32_t p = (i - 1) >> 2; \
+        if (CMP(v, h->_data[p]) >= 0) break; \
+        h->_data[i] = h->_data[p]; h->_slot[i] = h->_slot[p]; h->_pos[h->_slot[i]] = i; \
+        i = p; \
+    } \
+    h->_data[i] = v; h->_slot[i] = s; h->_pos[s] = i; \
+} \
+static inline void __zn_heap_down_##SFX(ZnHeap *h, int32_t i) { \
+    ZnValue v = h->_data[i]; int32_t s = h->_slot[i], n = h->_len; \
+    for (;;) { \
+        int32_t c = 4 * i + 1, m = c, end = c + 4 < n ? c + 4 : n; \
+        if (c >= n) break; \
+        for (int32_t k = c + 1; k < end; k++) \
+            if (CMP(h->_data[k], h->_data[m]) < 0) m = k; \
+        if (CMP(h->_data[m], v) >= 0) break; \
+        h->_data[i] = h->_data[m]; h->_slot[i] = h->_slot[m]; h->_pos[h->_slot[i]] = i; \
+        i = m; \
+    } \
+    h->_data[i] = v; h->_slot[i] = s; h->_pos[s] = i; \
+} \
+static inline int64_t __zn_heap_push_##SFX(ZnHeap *h, ZnValue v) { \
+    if (h->_len >= h->_cap) __zn_heap_grow(h); \
+    if (h->_elem_retain && v.as.ptr) h->_elem_retain(v.as.ptr); \
+    int32_t s = __zn_heap_take_slot(h), i = h->_len++; \
+    h->_data[i] = v; h->_slot[i] = s; \
+    __zn_heap_up_##SFX(h, i); \
+    return __zn_heap_handle(h, s); \
+} \
+static inline ZnValue __zn_heap_pop_##SFX(ZnHeap *h) { \
+    ZnValue top = __zn_heap_peek(h); \
+    __zn_heap_drop_slot(h, h->_slot[0]); \
+    if (--h->_len > 0) { \
+        h->_data[0] = h->_data[h->_len]; h->_slot[0] = h->_slot[h->_len]; \
+        __zn_heap_down_##SFX(h, 0); \
+    } \
+    return top; \
+} \
+static inline void __zn_heap_decrease_##SFX(ZnHeap *h, int64_t handle, ZnValue v) { \
+    int32_t i = __zn_heap_find(h, handle); \
+    if (i < 0) { fprintf(stderr, "Heap handle is no longer valid\n"); exit(1); } \
+    if (CMP(v, h->_data[i]) > 0) { fprintf(stderr, "decrease_key: new key is greater than the current key\n"); exit(1); } \
+    if (h->_elem_retain && v.as.ptr) h->_elem_retain(v.as.ptr); \
+    if (h->_elem_release && h->_data[i].as.ptr) h->_elem_release(h->_data[i].as.ptr); \
+    h->_data[i] = v; \
+    __zn_heap_up_##SFX(h, i); \
+} \
+static inline ZnHeap *__zn_heap_from_arr_##SFX(ZnArray *a, size_t val_size, ZnElemFn val_ret) { \
+    ZnHeap *h = __zn_heap_alloc(a->_len, a->_elem_retain, a->_elem_release); \
+    for (int32_t i = 0; i < a->_len; i++) { \
+        ZnValue v = a->_data[i]; \
+        if (val_size) v.as.ptr = __zn_val_dup(v.as.ptr, val_size, val_ret); \
+        else if (h->_elem_retain && v.as.ptr) h->_elem_retain(v.as.ptr); \
+        h->_data[i] = v; h->_slot[i] = i; h->_pos[i] = i; h->_gen[i] = 0; \
+    } \
+    h->_len = h->_nslots = a->_len; \
+    for (int32_t i = (h->_len - 2) >> 2; i >= 0; i--) __zn_heap_down_##SFX(h, i); \
+    return h; \
+}
+
+ZN_HEAP_SPECIALIZE(int, __zn_cmp_int)
+ZN_HEAP_SPECIALIZE(float, __zn_cmp_float)
+ZN_HEAP_SPECIALIZE(char, __zn_cmp_char)
+ZN_HEAP_SPECIALIZE(bool, __zn_cmp_bool)
+ZN_HEAP_SPECIALIZE(str, __zn_cmp_str)
+
+/* --- Deque runtime (power-of-two ring buffer) --- */
+
+static ZnDeque *__zn_deque_alloc(int32_t cap, ZnElemFn retain, ZnElemFn release) {
+    int32_t c = 8;
+    while (c < cap) c <<= 1;
+    ZnDeque *d = malloc(sizeof(ZnDeque));
+    d->_rc = 1; d->_len = 0; d->_cap = c; d->_head = 0;
+    d->_data = malloc(c * sizeof(ZnValue));
+    d->_elem_retain = retain;
+    d->_elem_release = release;
+    return d;
+}
+
+static void __zn_deque_retain(ZnDeque *d) { if (d) d->_rc++; }
+
+static void __zn_deque_release(ZnDeque *d) {
+    if (!d) return;
+    if (--(d->_rc) == 0) {
+        if (d->_elem_release) {
+            for (int32_t i = 0; i < d->_len; i++) {
+                ZnValue v = d->_data[(d->_head + i) & (d->_cap - 1)];
+                if (v.as.ptr) d->_elem_release(v.as.ptr);
+            }
+        }
+        free(d->_data);
+        free(d);
+    }
+}
+
+/* Move the elements to a new buffer of cap slots, unwrapped to start at 0 */
+static void __zn_deque_resize(ZnDeque *d, int32_t cap) {
+    ZnValue *data = malloc(cap * sizeof(ZnValue));
+    int32_t first = d->_cap - d->_head < d->_len ? d->_cap - d->_head : d->_len;
+    memcpy(data, d->_data + d->_head, first * sizeof(ZnValue));
+    memcpy(data + first, d->_data, (d->_len - first) * sizeof(ZnValue));
+    free(d->_data);
+    d->_data = data; d->_cap = cap; d->_head = 0;
+}
+
+/* Give memory back once the deque drains to a quarter of its capacity */
+static void __zn_deque_shrink(ZnDeque *d) {
+    if (d->_cap > 8 && d->_len <= d->_cap / 4) __zn_deque_resize(d, d->_cap / 2);
+}
+
+static void __zn_deque_push_back(ZnDeque *d, ZnValue v) {
+    if (d->_len == d->_cap) __zn_deque_resize(d, d->_cap * 2);
+    if (d->_elem_retain && v.as.ptr) d->_elem_retain(v.as.ptr);
+    d->_data[(d->_head + d->_len) & (d->_cap - 1)] = v;
+    d->_len++;
+}
+
+static void __zn_deque_push_front(ZnDeque *d, ZnValue v) {
+    if (d->_len == d->_cap) __zn_deque_resize(d, d->_cap * 2);
+    if (d->_elem_retain && v.as.ptr) d->_elem_retain(v.as.ptr);
+    d->_head = (d->_head - 1) & (d->_cap - 1);
+    d->_data[d->_head] = v;
+    d->_len++;
+}
+
+static void __zn_deque_check_empty(ZnDeque *d) {
+    if (d->_len == 0) { fprintf(stderr, "Deque is empty\n"); exit(1); }
+}
+
+/* pop_back/pop_front transfer the element's reference to the caller */
+static ZnValue __zn_deque_pop_back(ZnDeque *d) {
+    __zn_deque_check_empty(d);
+    ZnValue v = d->_data[(d->_head + d->_len - 1) & (d->_cap - 1)];
+    d->_len--;
+    __zn_deque_shrink(d);
+    return v;
+}
+
+static ZnValue __zn_deque_pop_front(ZnDeque *d) {
+    __zn_deque_check_empty(d);
+    ZnValue v = d->_data[d->_head];
+    d->_head = (d->_head + 1) & (d->_cap - 1);
+    d->_len--;
+    __zn_deque_shrink(d);
+    return v;
+}
+
+static ZnValue __zn_deque_front(ZnDeque *d) {
+    __zn_deque_check_empty(d);
+    return d->_data[d->_head];
+}
+
+static ZnValue __zn_deque_back(ZnDeque *d) {
+    __zn_deque_check_empty(d);
+    return d->_data[(d->_head + d->_len - 1) & (d->_cap - 1)];
+}
+
+static ZnValue *__zn_deque_at(ZnDeque *d, int64_t idx) {
+    if (idx < 0 || idx >= d->_len) { fprintf(stderr, "Deque index out of bounds: %lld (length %d)\n", (long long)idx, d->_len); exit(1); }
+    return &d->_data[(d->_head + idx) & (d->_cap - 1)];
+}
+
+static ZnValue __zn_deque_get(ZnDeque *d, int64_t idx) {
+    return *__zn_deque_at(d, idx);
+}
+
+static void __zn_deque_set(ZnDeque *d, int64_t idx, ZnValue v) {
+    ZnValue *slot = __zn_deque_at(d, idx);
+    if (d->_elem_retain && v.as.ptr) d->_elem_retain(v.as.ptr);
+    if (d->_elem_release && slot->as.ptr) d->_elem_release(slot->as.ptr);
+    *slot = v;
+}
+
+/* Copy an array's elements; boxed values of val_size bytes are duplicated
+ * through val_ret */
+static ZnDeque *__zn_deque_from_arr(ZnArray *a, size_t val_size, ZnElemFn val_ret) {
+    ZnDeque *d = __zn_deque_alloc(a->_len, a->_elem_retain, a->_elem_release);
+    for (int32_t i = 0; i < a->_len; i++) {
+        ZnValue v = a->_data[i];
+        if (val_size) v.as.ptr = __zn_val_dup(v.as.ptr, val_size, val_ret);
+        else if (d->_elem_retain && v.as.ptr) d->_elem_retain(v.as.ptr);
+        d->_data[i] = v;
+    }
+    d->_len = a->_len;
+    return d;
+}
+
+/* --- Bitset runtime ---
+ * Whole-word loops: count uses popcount, next_set uses count-trailing-zeros,
+ * and the set operations combine 64 bits per step. */
+
+static ZnBitset *__zn_bitset_alloc(int64_t n) {
+    if (n < 0 || n > INT32_MAX) { fprintf(stderr, "Bitset size out of range: %lld\n", (long long)n); exit(1); }
+    int32_t nwords = (int32_t)((n + 63) >> 6);
+    ZnBitset *b = calloc(1, sizeof(ZnBitset) + nwords * sizeof(uint64_t));
+    b->_rc = 1; b->_len = (int32_t)n; b->_nwords = nwords;
+    return b;
+}
+
+static void __zn_bitset_retain(ZnBitset *b) { if (b) b->_rc++; }
+
+static void __zn_bitset_release(ZnBitset *b) {
+    if (b && --(b->_rc) == 0) free(b);
+}
+
+static void __zn_bitset_check(ZnBitset *b, int64_t i) {
+    if (i < 0 || i >= b->_len) { fprintf(stderr, "Bitset index out of bounds: %lld (length %d)\n", (long long)i, b->_len); exit(1); }
+}
+
+static bool __zn_bitset_get(ZnBitset *b, int64_t i) {
+    __zn_bitset_check(b, i);
+    return (b->_words[i >> 6] >> (i & 63)) & 1;
+}
+
+static void __zn_bitset_set(ZnBitset *b, int64_t i) {
+    __zn_bitset_check(b, i);
+    b->_words[i >> 6] |= (uint64_t)1 << (i & 63);
+}
+
+static void __zn_bitset_clear(ZnBitset *b, int64_t i) {
+    __zn_bitset_check(b, i);
+    b->_words[i >> 6] &= ~((uint64_t)1 << (i & 63));
+}
+
+static void __zn_bitset_flip(ZnBitset *b, int64_t i) {
+    __zn_bitset_check(b, i);
+    b->_words[i >> 6] ^= (uint64_t)1 << (i & 63);
+}
+
+static int64_t __zn_bitset_count(ZnBitset *b) {
+    int64_t n = 0;
+    for (int32_t w = 0; w < b->_nwords; w++) n += __builtin_popcountll(b->_words[w]);
+    return n;
+}
+
+/* Index of the first set bit at or after from, or -1 */
+static int64_t __zn_bitset_next_set(ZnBitset *b, int64_t from) {
+    if (from < 0) from = 0;
+    if (from >= b->_len) return -1;
+    int32_t w = (int32_t)(from >> 6);
+    uint64_t word = b->_words[w] & (~(uint64_t)0 << (from & 63));
+    for (;;) {
+        if (word) return ((int64_t)w << 6) + __builtin_ctzll(word);
+        if (++w >= b->_nwords) return -1;
+        word = b->_words[w];
+    }
+}
+
+/* Binary set operations return a new bitset as long as the longer operand;
+ * words past the end of the shorter one read as zero. The main loop has no
+ * branches, so the compiler can vectorize it. */
+#define ZN_BITSET_BINOP(NAME, OP) \
+static ZnBitset *__zn_bitset_##NAME(ZnBitset *a, ZnBitset *b) { \
+    ZnBitset *r = __zn_bitset_alloc(a->_len > b->_len ? a->_len : b->_len); \
+    int32_t common = a->_nwords < b->_nwords ? a->_nwords : b->_nwords, w = 0; \
+    for (; w < common; w++) { uint64_t x = a->_words[w], y = b->_words[w]; r->_words[w] = OP; } \
+    for (; w < r->_nwords; w++) { \
+        uint64_t x = w < a->_nwords ? a->_words[w] : 0, y = w < b->_nwords ? b->_words[w] : 0; \
+        r->_words[w] = OP; \
+    } \
+    return r; \
+}
+
+ZN_BITSET_BINOP(and, x & y)
+ZN_BITSET_BINOP(or, x | y)
+ZN_BITSET_BINOP(xor, x ^ y)
+ZN_BITSET_BINOP(and_not, x & ~y)
+
+/* --- OrderedMap runtime (B-tree) --- */
+
+static ZnOrderedMap *__zn_omap_alloc(ZnTag key_tag, ZnElemFn key_retain, ZnElemFn key_release,
+                                     ZnElemFn val_retain, ZnElemFn val_release) {
+    ZnOrderedMap *m = malloc(sizeof(ZnOrderedMap));
+    m->_rc = 1; m->_len = 0; m->_key_tag = key_tag; m->_root = NULL;
+    m->_key_retain = key_retain; m->_key_release = key_release;
+    m->_val_retain = val_retain; m->_val_release = val_release;
+    return m;
+}
+
+static ZnOMapNode *__zn_omap_node(bool leaf) {
+    ZnOMapNode *x = malloc(leaf ? offsetof(ZnOMapNode, _kids) : sizeof(ZnOMapNode));
+    x->_n = 0; x->_leaf = leaf;
+    return x;
+}
+
+static void __zn_omap_free_node(ZnOrderedMap *m, ZnOMapNode *x) {
+    for (int32_t i = 0; i < x->_n; i++) {
+        if (m->_key_release && x->_keys[i].as.ptr) m->_key_release(x->_keys[i].as.ptr);
+        if (m->_val_release && x->_vals[i].as.ptr) m->_val_release(x->_vals[i].as.ptr);
+    }
+    if (!x->_leaf) {
+        for (int32_t i = 0; i <= x->_n; i++) __zn_omap_free_node(m, x->_kids[i]);
+    }
+    free(x);
+}
+
+static void __zn_omap_retain(ZnOrderedMap *m) { if (m) m->_rc++; }
+
+static void __zn_omap_release(ZnOrderedMap *m) {
+    if (!m) return;
+    if (--(m->_rc) == 0) {
+        if (m->_root) __zn_omap_free_node(m, m->_root);
+        free(m);
+    }
+}
+
+static int __zn_omap_cmp(ZnTag tag, ZnValue a, ZnValue b) {
+    switch (tag) {
+    case ZN_TAG_INT: return __zn_cmp_int(a, b);
+    case ZN_TAG_FLOAT: return __zn_cmp_float(a, b);
+    case ZN_TAG_CHAR: return __zn_cmp_char(a, b);
+    default: return __zn_cmp_str(a, b);
+    }
+}
+
+/* Index of the first key >= k in x. Integer keys use a branchless binary
+ * search that compiles to conditional moves. */
+static int32_t __zn_omap_lower(ZnOrderedMap *m, ZnOMapNode *x, ZnValue k) {
+    int32_t n = x->_n;
+    if (n == 0) return 0;
+    const ZnValue *base = x->_keys;
+    if (m->_key_tag == ZN_TAG_INT) {
+        while (n > 1) {
+            int32_t half = n >> 1;
+            base = base[half].as.i < k.as.i ? base + half : base;
+            n -= half;
+        }
+        return (int32_t)(base - x->_keys) + (base->as.i < k.as.i);
+    }
+    while (n > 1) {
+        int32_t half = n >> 1;
+        if (__zn_omap_cmp(m->_key_tag, base[half], k) < 0) base += half;
+        n -= half;
+    }
+    return (int32_t)(base - x->_keys) + (__zn_omap_cmp(m->_key_tag, *base, k) < 0);
+}
+
+static ZnValue *__zn_omap_find(ZnOrderedMap *m, ZnValue k) {
+    ZnOMapNode *x = m->_root;
+    while (x) {
+        int32_t i = __zn_omap_lower(m, x, k);
+        if (i < x->_n && __zn_omap_cmp(m->_key_tag, x->_keys[i], k) == 0) return &x->_vals[i];
+        x = x->_leaf ? NULL : x->_kids[i];
+    }
+    return NULL;
+}
+
+/* Missing keys read as the zero value, like ZnHash */
+static ZnValue __zn_omap_get(ZnOrderedMap *m, ZnValue k) {
+    ZnValue *v = __zn_omap_find(m, k);
+    if (v) return *v;
+    ZnValue nil; nil.tag = ZN_TAG_INT; nil.as.i = 0; return nil;
+}
+
+static bool __zn_omap_contains(ZnOrderedMap *m, ZnValue k) {
+    return __zn_omap_find(m, k) != NULL;
+}
+
+/* Split the full child x->_kids[i] around its median, which moves up into x */
+static void __zn_omap_split(ZnOMapNode *x, int32_t i) {
+    ZnOMapNode *y = x->_kids[i], *z = __zn_omap_node(y->_leaf);
+    z->_n = ZN_OMAP_T - 1;
+    memcpy(z->_keys, y->_keys + ZN_OMAP_T, (ZN_OMAP_T - 1) * sizeof(ZnValue));
+    memcpy(z->_vals, y->_vals + ZN_OMAP_T, (ZN_OMAP_T - 1) * sizeof(ZnValue));
+    if (!y->_leaf) memcpy(z->_kids, y->_kids + ZN_OMAP_T, ZN_OMAP_T * sizeof(ZnOMapNode*));
+    y->_n = ZN_OMAP_T - 1;
+    memmove(x->_kids + i + 2, x->_kids + i + 1, (x->_n - i) * sizeof(ZnOMapNode*));
+    memmove(x->_keys + i + 1, x->_keys + i, (x->_n - i) * sizeof(ZnValue));
+    memmove(x->_vals + i + 1, x->_vals + i, (x->_n - i) * sizeof(ZnValue));
+    x->_kids[i + 1] = z;
+    x->_keys[i] = y->_keys[ZN_OMAP_T - 1];
+    x->_vals[i] = y->_vals[ZN_OMAP_T - 1];
+    x->_n++;
+}
+
+/* Single-pass insert: full nodes are split on the way down */
+static void __zn_omap_set(ZnOrderedMap *m, ZnValue k, ZnValue v) {
+    ZnValue *cur = __zn_omap_find(m, k);
+    if (m->_val_retain && v.as.ptr) m->_val_retain(v.as.ptr);
+    if (cur) {
+        if (m->_val_release && cur->as.ptr) m->_val_release(cur->as.ptr);
+        *cur = v;
+        return;
+    }
+    if (m->_key_retain && k.as.ptr) m->_key_retain(k.as.ptr);
+    if (!m->_root) m->_root = __zn_omap_node(true);
+    if (m->_root->_n == ZN_OMAP_MAX) {
+        ZnOMapNode *r = __zn_omap_node(false);
+        r->_kids[0] = m->_root;
+        m->_root = r;
+        __zn_omap_split(r, 0);
+    }
+    ZnOMapNode *x = m->_root;
+    while (!x->_leaf) {
+        int32_t i = __zn_omap_lower(m, x, k);
+        if (x->_kids[i]->_n == ZN_OMAP_MAX) {
+            __zn_omap_split(x, i);
+            if (__zn_omap_cmp(m->_key_tag, x->_keys[i], k) < 0) i++;
+        }
+        x = x->_kids[i];
+    }
+    int32_t i = __zn_omap_lower(m, x, k);
+    memmove(x->_keys + i + 1, x->_keys + i, (x->_n - i) * sizeof(ZnValue));
+    memmove(x->_vals + i + 1, x->_vals + i, (x->_n - i) * sizeof(ZnValue));
+    x->_keys[i] = k; x->_vals[i] = v;
+    x->_n++;
+    m->_len++;
+}
+
+/* Merge x->_kids[i + 1] and separator i into x->_kids[i] */
+static void __zn_omap_merge(ZnOMapNode *x, int32_t i) {
+    ZnOMapNode *y = x->_kids[i], *z = x->_kids[i + 1];
+    y->_keys[y->_n] = x->_keys[i];
+    y->_vals[y->_n] = x->_vals[i];
+    memcpy(y->_keys + y->_n + 1, z->_keys, z->_n * sizeof(ZnValue));
+    memcpy(y->_vals + y->_n + 1, z->_vals, z->_n * sizeof(ZnValue));
+    if (!y->_leaf) memcpy(y->_kids + y->_n + 1, z->_kids, (z->_n + 1) * sizeof(ZnOMapNode*));
+    y->_n += z->_n + 1;
+    memmove(x->_keys + i, x->_keys + i + 1, (x->_n - i - 1) * sizeof(ZnValue));
+    memmove(x->_vals + i, x->_vals + i + 1, (x->_n - i - 1) * sizeof(ZnValue));
+    memmove(x->_kids + i + 1, x->_kids + i + 2, (x->_n - i - 1) * sizeof(ZnOMapNode*));
+    x->_n--;
+    free(z);
+}
+
+/* Give x->_kids[i] at least ZN_OMAP_T keys by borrowing from a sibling or
+ * merging with one; returns the index of the child that now covers i */
+static int32_t __zn_omap_fill(ZnOMapNode *x, int32_t i) {
+    ZnOMapNode *c = x->_kids[i];
+    if (c->_n >= ZN_OMAP_T) return i;
+    if (i > 0 && x->_kids[i - 1]->_n >= ZN_OMAP_T) {
+        ZnOMapNode *l = x->_kids[i - 1];
+        memmove(c->_keys + 1, c->_keys, c->_n * sizeof(ZnValue));
+        memmove(c->_vals + 1, c->_vals, c->_n * sizeof(ZnValue));
+        if (!c->_leaf) {
+            memmove(c->_kids + 1, c->_kids, (c->_n + 1) * sizeof(ZnOMapNode*));
+            c->_kids[0] = l->_kids[l->_n];
+        }
+        c->_keys[0] = x->_keys[i - 1]; c->_vals[0] = x->_vals[i - 1];
+        x->_keys[i - 1] = l->_keys[l->_n - 1]; x->_vals[i - 1] = l->_vals[l->_n - 1];
+        l->_n--; c->_n++;
+        return i;
+    }
+    if (i < x->_n && x->_kids[i + 1]->_n >= ZN_OMAP_T) {
+        ZnOMapNode *r = x->_kids[i + 1];
+        c->_keys[c->_n] = x->_keys[i]; c->_vals[c->_n] = x->_vals[i];
+        if (!c->_leaf) c->_kids[c->_n + 1] = r->_kids[0];
+        c->_n++;
+        x->_keys[i] = r->_keys[0]; x->_vals[i] = r->_vals[0];
+        memmove(r->_keys, r->_keys + 1, (r->_n - 1) * sizeof(ZnValue));
+        memmove(r->_vals, r->_vals + 1, (r->_n - 1) * sizeof(ZnValue));
+        if (!r->_leaf) memmove(r->_kids, r->_kids + 1, r->_n * sizeof(ZnOMapNode*));
+        r->_n--;
+        return i;
+    }
+    if (i < x->_n) { __zn_omap_merge(x, i); return i; }
+    __zn_omap_merge(x, i - 1);
+    return i - 1;
+}
+
+/* Single-pass delete: every node entered has at least ZN_OMAP_T keys, so
+ * removing from a leaf never underflows. A key found in an internal node
+ * is replaced by its predecessor or successor, which is then deleted from
+ * the leaf below. */
+static bool __zn_omap_remove(ZnOrderedMap *m, ZnValue k) {
+    if (!__zn_omap_find(m, k)) return false;
+    ZnValue gone_k = k, gone_v = k;
+    bool moved = false;
+    ZnOMapNode *x = m->_root;
+    for (;;) {
+        int32_t i = __zn_omap_lower(m, x, k);
+        bool here = i < x->_n && __zn_omap_cmp(m->_key_tag, x->_keys[i], k) == 0;
+        if (x->_leaf) {
+            if (!moved) { gone_k = x->_keys[i]; gone_v = x->_vals[i]; }
+            memmove(x->_keys + i, x->_keys + i + 1, (x->_n - i - 1) * sizeof(ZnValue));
+            memmove(x->_vals + i, x->_vals + i + 1, (x->_n - i - 1) * sizeof(ZnValue));
+            x->_n--;
+            break;
+        }
+        ZnOMapNode *next;
+        if (here && (x->_kids[i]->_n >= ZN_OMAP_T || x->_kids[i + 1]->_n >= ZN_OMAP_T)) {
+            bool pred = x->_kids[i]->_n >= ZN_OMAP_T;
+            next = x->_kids[pred ? i : i + 1];
+            ZnOMapNode *y = next;
+            while (!y->_leaf) y = pred ? y->_kids[y->_n] : y->_kids[0];
+            int32_t j = pred ? y->_n - 1 : 0;
+            if (!moved) { gone_k = x->_keys[i]; gone_v = x->_vals[i]; moved = true; }
+            x->_keys[i] = y->_keys[j]; x->_vals[i] = y->_vals[j];
+            k = y->_keys[j];
+        } else if (here) {
+            __zn_omap_merge(x, i);
+            next = x->_kids[i];
+        } else {
+            next = x->_kids[__zn_omap_fill(x, i)];
+        }
+        if (x == m->_root && x->_n == 0) { m->_root = next; free(x); }
+        x = next;
+    }
+    if (m->_root->_n == 0) { free(m->_root); m->_root = NULL; }
+    if (m->_key_release && gone_k.as.ptr) m->_key_release(gone_k.as.ptr);
+    if (m->_val_release && gone_v.as.ptr) m->_val_release(gone_v.as.ptr);
+    m->_len--;
+    return true;
+}
+
+/* Largest key <= k (floor) or smallest key >= k (ceiling). When there is
+ * none, *found is cleared and the returned value has a NULL pointer. */
+static ZnValue __zn_omap_bound(ZnOrderedMap *m, ZnValue k, bool floor, bool *found) {
+    ZnValue best; best.tag = m->_key_tag; best.as.ptr = NULL;
+    bool have = false;
+    ZnOMapNode *x = m->_root;
+    while (x) {
+        int32_t i = __zn_omap_lower(m, x, k);
+        if (i < x->_n && __zn_omap_cmp(m->_key_tag, x->_keys[i], k) == 0) { best = x->_keys[i]; have = true; break; }
+        if (floor && i > 0) { best = x->_keys[i - 1]; have = true; }
+        if (!floor && i < x->_n) { best = x->_keys[i]; have = true; }
+        x = x->_leaf ? NULL : x->_kids[i];
+    }
+    if (found) *found = have;
+    return best;
+}
+
+static ZnValue __zn_omap_floor(ZnOrderedMap *m, ZnValue k, bool *found) {
+    return __zn_omap_bound(m, k, true, found);
+}
+
+static ZnValue __zn_omap_ceiling(ZnOrderedMap *m, ZnValue k, bool *found) {
+    return __zn_omap_bound(m, k, false, found);
+}
+
+/* In-order walk appending keys or values in [lo, hi] to out; subtrees
+ * entirely below lo are skipped, and the walk stops at the first key past
+ * hi. Boxed values of val_size bytes are copied through val_ret. */
+static bool __zn_omap_collect(ZnOrderedMap *m, ZnOMapNode *x, ZnValue lo, ZnValue hi, bool bounded,
+                              ZnArray *out, bool keys, size_t val_size, ZnElemFn val_ret) {
+    int32_t j = bounded ? __zn_omap_lower(m, x, lo) : 0;
+    for (; j <= x->_n; j++) {
+        if (!x->_leaf && !__zn_omap_collect(m, x->_kids[j], lo, hi, bounded, out, keys, val_size, val_ret)) return false;
+        if (j == x->_n) break;
+        if (bounded && __zn_omap_cmp(m->_key_tag, x->_keys[j], hi) > 0) return false;
+        ZnValue v = keys ? x->_keys[j] : x->_vals[j];
+        if (!keys && val_size) v.as.ptr = __zn_val_dup(v.as.ptr, val_size, val_ret);
+        __zn_arr_push(out, v);
+    }
+    return true;
+}
+
+static ZnArray *__zn_omap_range(ZnOrderedMap *m, ZnValue lo, ZnValue hi, bool bounded,
+                                ZnArray *out, bool keys, size_t val_size, ZnElemFn val_ret) {
+    if (m->_root) __zn_omap_collect(m, m->_root, lo, hi, bounded, out, keys, val_size, val_ret);
+    return out;
+}
+
+/* Bulk-load from keys in strictly increasing order, building the tree one
+ * level at a time from the leaves up: each level's entries are spread
+ * evenly over the fewest nodes that hold them, and the separators between
+ * those nodes become the entries of the level above. */
+static ZnOrderedMap *__zn_omap_from_sorted(ZnOrderedMap *m, ZnArray *keys, ZnArray *vals,
+                                           size_t val_size, ZnElemFn val_ret) {
+    int32_t n = keys->_len;
+    if (vals->_len != n) { fprintf(stderr, "OrderedMap needs as many values as keys: %d keys, %d values\n", n, vals->_len); exit(1); }
+    for (int32_t i = 1; i < n; i++) {
+        if (__zn_omap_cmp(m->_key_tag, keys->_data[i - 1], keys->_data[i]) >= 0) {
+            fprintf(stderr, "OrderedMap keys must be sorted and unique (index %d)\n", i); exit(1);
+        }
+    }
+    if (n == 0) return m;
+    ZnValue *ek = malloc(n * sizeof(ZnValue)), *ev = malloc(n * sizeof(ZnValue));
+    for (int32_t i = 0; i < n; i++) {
+        ek[i] = keys->_data[i]; ev[i] = vals->_data[i];
+        if (m->_key_retain && ek[i].as.ptr) m->_key_retain(ek[i].as.ptr);
+        if (val_size) ev[i].as.ptr = __zn_val_dup(ev[i].as.ptr, val_size, val_ret);
+        else if (m->_val_retain && ev[i].as.ptr) m->_val_retain(ev[i].as.ptr);
+    }
+    ZnOMapNode **kids = NULL;
+    int32_t cnt = n;
+    bool leaf = true;
+    for (;;) {
+        int32_t nodes = (cnt + 1 + ZN_OMAP_MAX) / (ZN_OMAP_MAX + 1);
+        int32_t placed = cnt - (nodes - 1), src = 0, kid = 0;
+        ZnOMapNode **level = malloc(nodes * sizeof(ZnOMapNode*));
+        for (int32_t j = 0; j < nodes; j++) {
+            int32_t take = placed / nodes + (j < placed % nodes);
+            ZnOMapNode *x = __zn_omap_node(leaf);
+            memcpy(x->_keys, ek + src, take * sizeof(ZnValue));
+            memcpy(x->_vals, ev + src, take * sizeof(ZnValue));
+            if (!leaf) { memcpy(x->_kids, kids + kid, (take + 1) * sizeof(ZnOMapNode*)); kid += take + 1; }
+            x->_n = take;
+            src += take;
+            level[j] = x;
+            /* Separators are compacted to the front for the next level */
+            if (j < nodes - 1) { ek[j] = ek[src]; ev[j] = ev[src]; src++; }
+        }
+        free(kids);
+        kids = level;
+        cnt = nodes - 1;
+        leaf = false;
+        if (nodes == 1) break;
+    }
+    m->_root = kids[0];
+    m->_len = n;
+    free(kids); free(ek); free(ev);
+    return m;
+}
+
+/* --- Trie runtime (adaptive radix tree) --- */
+
+static ZnTrie *__zn_trie_alloc(ZnElemFn val_retain, ZnElemFn val_release) {
+    ZnTrie *t = malloc(sizeof(ZnTrie));
+    t->_rc = 1; t->_len = 0; t->_root = NULL;
+    t->_val_retain = val_retain; t->_val_release = val_release;
+    return t;
+}
+
+static ZnTrieNode *__zn_trie_node(int type) {
+    static const size_t sizes[] = { sizeof(ZnTrieNode4), sizeof(ZnTrieNode16),
+                                    sizeof(ZnTrieNode48), sizeof(ZnTrieNode256) };
+    ZnTrieNode *x = calloc(1, sizes[type]);
+    x->_type = (uint8_t)type;
+    return x;
+}
+
+/* The child slot for byte b, or NULL */
+static ZnTrieNode **__zn_trie_child(ZnTrieNode *x, uint8_t b) {
+    switch (x->_type) {
+    case ZN_TRIE_N4: {
+        ZnTrieNode4 *n = (ZnTrieNode4*)x;
+        for (int i = 0; i < x->_n; i++) if (n->_keys[i] == b) return &n->_kids[i];
+        return NULL;
+    }
+    case ZN_TRIE_N16: {
+        ZnTrieNode16 *n = (ZnTrieNode16*)x;
+#if defined(__SSE2__)
+        /* Compare all 16 key bytes at once */
+        __m128i eq = _mm_cmpeq_epi8(_mm_set1_epi8((char)b), _mm_loadu_si128((const __m128i*)n->_keys));
+        int mask = _mm_movemask_epi8(eq) & ((1 << x->_n) - 1);
+        return mask ? &n->_kids[__builtin_ctz(mask)] : NULL;
+#else
+        for (int i = 0; i < x->_n; i++) if (n->_keys[i] == b) return &n->_kids[i];
+        return NULL;
+#endif
+    }
+    case ZN_TRIE_N48: {
+        ZnTrieNode48 *n = (ZnTrieNode48*)x;
+        return n->_index[b] ? &n->_kids[n->_index[b] - 1] : NULL;
+    }
+    default: {
+        ZnTrieNode256 *n = (ZnTrieNode256*)x;
+        return n->_kids[b] ? &n->_kids[b] : NULL;
+    }
+    }
+}
+
+/* Add a child under byte b to *ref, moving the node up to the next size
+ * when it is full. Smaller nodes keep their key bytes sorted. */
+static void __zn_trie_add_child(ZnTrieNode **ref, uint8_t b, ZnTrieNode *child) {
+    ZnTrieNode *x = *ref;
+    if (x->_type == ZN_TRIE_N4 || x->_type == ZN_TRIE_N16) {
+        int cap = x->_type == ZN_TRIE_N4 ? 4 : 16;
+        uint8_t *keys = x->_type == ZN_TRIE_N4 ? ((ZnTrieNode4*)x)->_keys : ((ZnTrieNode16*)x)->_keys;
+        ZnTrieNode **kids = x->_type == ZN_TRIE_N4 ? ((ZnTrieNode4*)x)->_kids : ((ZnTrieNode16*)x)->_kids;
+        if (x->_n < cap) {
+            int i = x->_n;
+            while (i > 0 && keys[i - 1] > b) { keys[i] = keys[i - 1]; kids[i] = kids[i - 1]; i--; }
+            keys[i] = b; kids[i] = child;
+            x->_n++;
+            return;
+        }
+        ZnTrieNode *y = __zn_trie_node(x->_type + 1);
+        *y = *x;
+        y->_type = (uint8_t)(x->_type + 1);
+        if (y->_type == ZN_TRIE_N16) {
+            memcpy(((ZnTrieNode16*)y)->_keys, keys, 4);
+            memcpy(((ZnTrieNode16*)y)->_kids, kids, 4 * sizeof(ZnTrieNode*));
+        } else {
+            for (int i = 0; i < 16; i++) {
+                ((ZnTrieNode48*)y)->_index[keys[i]] = (uint8_t)(i + 1);
+                ((ZnTrieNode48*)y)->_kids[i] = kids[i];
+            }
+        }
+        free(x);
+        *ref = y;
+        __zn_trie_add_child(ref, b, child);
+        return;
+    }
+    if (x->_type == ZN_TRIE_N48) {
+        ZnTrieNode48 *n = (ZnTrieNode48*)x;
+        if (x->_n < 48) {
+            n->_kids[x->_n] = child;
+            n->_index[b] = (uint8_t)(++x->_n);
+            return;
+        }
+        ZnTrieNode256 *y = (ZnTrieNode256*)__zn_trie_node(ZN_TRIE_N256);
+        y->_h = *x;
+        y->_h._type = ZN_TRIE_N256;
+        for (int k = 0; k < 256; k++) if (n->_index[k]) y->_kids[k] = n->_kids[n->_index[k] - 1];
+        free(x);
+        *ref = (ZnTrieNode*)y;
+        x = *ref;
+    }
+    ((ZnTrieNode256*)x)->_kids[b] = child;
+    x->_n++;
+}
+
+/* Next child in ascending byte order, starting from cursor *pos (0 at first) */
+static ZnTrieNode *__zn_trie_next_kid(ZnTrieNode *x, int *pos) {
+    switch (x->_type) {
+    case ZN_TRIE_N4:
+        return *pos < x->_n ? ((ZnTrieNode4*)x)->_kids[(*pos)++] : NULL;
+    case ZN_TRIE_N16:
+        return *pos < x->_n ? ((ZnTrieNode16*)x)->_kids[(*pos)++] : NULL;
+    case ZN_TRIE_N48: {
+        ZnTrieNode48 *n = (ZnTrieNode48*)x;
+        while (*pos < 256) { int k = (*pos)++; if (n->_index[k]) return n->_kids[n->_index[k] - 1]; }
+        return NULL;
+    }
+    default:
+        while (*pos < 256) { ZnTrieNode *c = ((ZnTrieNode256*)x)->_kids[(*pos)++]; if (c) return c; }
+        return NULL;
+    }
+}
+
+static void __zn_trie_free_node(ZnTrie *t, ZnTrieNode *x) {
+    int pos = 0;
+    for (ZnTrieNode *c; (c = __zn_trie_next_kid(x, &pos)); ) __zn_trie_free_node(t, c);
+    if (x->_has) {
+        __zn_str_release(x->_key);
+        if (t->_val_release && x->_val.as.ptr) t->_val_release(x->_val.as.ptr);
+    }
+    free(x);
+}
+
+static void __zn_trie_retain(ZnTrie *t) { if (t) t->_rc++; }
+
+static void __zn_trie_release(ZnTrie *t) {
+    if (!t) return;
+    if (--(t->_rc) == 0) {
+        if (t->_root) __zn_trie_free_node(t, t->_root);
+        free(t);
+    }
+}
+
+/* A chain of nodes spelling s[0..n); *end is the node where it finishes */
+static ZnTrieNode *__zn_trie_path(const uint8_t *s, int32_t n, ZnTrieNode **end) {
+    ZnTrieNode *x = __zn_trie_node(ZN_TRIE_N4);
+    x->_plen = (uint8_t)(n < ZN_TRIE_PREFIX ? n : ZN_TRIE_PREFIX);
+    memcpy(x->_prefix, s, x->_plen);
+    if (n <= ZN_TRIE_PREFIX) { *end = x; return x; }
+    __zn_trie_add_child(&x, s[ZN_TRIE_PREFIX], __zn_trie_path(s + ZN_TRIE_PREFIX + 1, n - ZN_TRIE_PREFIX - 1, end));
+    return x;
+}
+
+/* The node where key ends, or NULL */
+static ZnTrieNode *__zn_trie_find(ZnTrie *t, ZnString *key) {
+    const uint8_t *s = (const uint8_t*)key->_data;
+    int32_t n = key->_len;
+    ZnTrieNode *x = t->_root;
+    while (x) {
+        if (n < x->_plen || memcmp(x->_prefix, s, x->_plen) != 0) return NULL;
+        s += x->_plen; n -= x->_plen;
+        if (n == 0) return x->_has ? x : NULL;
+        ZnTrieNode **c = __zn_trie_child(x, *s);
+        x = c ? *c : NULL;
+        s++; n--;
+    }
+    return NULL;
+}
+
+/* Missing keys read as the zero value, like ZnHash */
+static ZnValue __zn_trie_get(ZnTrie *t, ZnString *key) {
+    ZnTrieNode *x = __zn_trie_find(t, key);
+    if (x) return x->_val;
+    ZnValue nil; nil.tag = ZN_TAG_INT; nil.as.i = 0; return nil;
+}
+
+static bool __zn_trie_contains(ZnTrie *t, ZnString *key) {
+    return __zn_trie_find(t, key) != NULL;
+}
+
+static void __zn_trie_set(ZnTrie *t, ZnString *key, ZnValue v) {
+    const uint8_t *s = (const uint8_t*)key->_data;
+    int32_t n = key->_len;
+    ZnTrieNode **ref = &t->_root, *end = NULL;
+    while (!end) {
+        ZnTrieNode *x = *ref;
+        if (!x) { *ref = __zn_trie_path(s, n, &end); break; }
+        int32_t i = 0;
+        while (i < x->_plen && i < n && x->_prefix[i] == s[i]) i++;
+        if (i < x->_plen) {
+            /* Split the compressed path where the key leaves it */
+            ZnTrieNode *p = __zn_trie_node(ZN_TRIE_N4);
+            p->_plen = (uint8_t)i;
+            memcpy(p->_prefix, x->_prefix, i);
+            uint8_t edge = x->_prefix[i];
+            memmove(x->_prefix, x->_prefix + i + 1, x->_plen - i - 1);
+            x->_plen = (uint8_t)(x->_plen - i - 1);
+            __zn_trie_add_child(&p, edge, x);
+            if (i == n) end = p;
+            else __zn_trie_add_child(&p, s[i], __zn_trie_path(s + i + 1, n - i - 1, &end));
+            *ref = p;
+            break;
+        }
+        s += i; n -= i;
+        if (n == 0) { end = x; break; }
+        ZnTrieNode **c = __zn_trie_child(x, *s);
+        if (!c) {
+            ZnTrieNode *leaf = __zn_trie_path(s + 1, n - 1, &end);
+            __zn_trie_add_child(ref, *s, leaf);
+            break;
+        }
+        ref = c; s++; n--;
+    }
+    if (t->_val_retain && v.as.ptr) t->_val_retain(v.as.ptr);
+    if (end->_has) {
+        if (t->_val_release && end->_val.as.ptr) t->_val_release(end->_val.as.ptr);
+    } else {
+        __zn_str_retain(key);
+        end->_key = key; end->_has = true;
+        t->_len++;
+    }
+    end->_val = v;
+}
+
+/* Take the child under byte b out of *ref, moving the node down a size once
+ * the smaller one would still have room to spare (so alternating inserts
+ * and removals at the boundary do not resize every time). */
+static void __zn_trie_drop_child(ZnTrieNode **ref, uint8_t b) {
+    ZnTrieNode *x = *ref;
+    if (x->_type == ZN_TRIE_N4 || x->_type == ZN_TRIE_N16) {
+        uint8_t *keys = x->_type == ZN_TRIE_N4 ? ((ZnTrieNode4*)x)->_keys : ((ZnTrieNode16*)x)->_keys;
+        ZnTrieNode **kids = x->_type == ZN_TRIE_N4 ? ((ZnTrieNode4*)x)->_kids : ((ZnTrieNode16*)x)->_kids;
+        int i = 0;
+        while (keys[i] != b) i++;
+        x->_n--;
+        memmove(keys + i, keys + i + 1, x->_n - i);
+        memmove(kids + i, kids + i + 1, (x->_n - i) * sizeof(ZnTrieNode*));
+        if (x->_type == ZN_TRIE_N16 && x->_n <= 3) {
+            ZnTrieNode *y = __zn_trie_node(ZN_TRIE_N4);
+            *y = *x;
+            y->_type = ZN_TRIE_N4;
+            memcpy(((ZnTrieNode4*)y)->_keys, keys, x->_n);
+            memcpy(((ZnTrieNode4*)y)->_kids, kids, x->_n * sizeof(ZnTrieNode*));
+            free(x);
+            *ref = y;
+        }
+        return;
+    }
+    if (x->_type == ZN_TRIE_N48) {
+        ZnTrieNode48 *n = (ZnTrieNode48*)x;
+        int i = n->_index[b] - 1;
+        n->_index[b] = 0;
+        x->_n--;
+        if (i != x->_n) {
+            /* Move the last child into the hole */
+            n->_kids[i] = n->_kids[x->_n];
+            for (int k = 0; k < 256; k++) if (n->_index[k] == x->_n + 1) { n->_index[k] = (uint8_t)(i + 1); break; }
+        }
+        if (x->_n <= 12) {
+            ZnTrieNode16 *y = (ZnTrieNode16*)__zn_trie_node(ZN_TRIE_N16);
+            y->_h = *x;
+            y->_h._type = ZN_TRIE_N16;
+            for (int k = 0, j = 0; k < 256; k++) {
+                if (n->_index[k]) { y->_keys[j] = (uint8_t)k; y->_kids[j++] = n->_kids[n->_index[k] - 1]; }
+            }
+            free(x);
+            *ref = (ZnTrieNode*)y;
+        }
+        return;
+    }
+    ZnTrieNode256 *n = (ZnTrieNode256*)x;
+    n->_kids[b] = NULL;
+    x->_n--;
+    if (x->_n <= 37) {
+        ZnTrieNode48 *y = (ZnTrieNode48*)__zn_trie_node(ZN_TRIE_N48);
+        y->_h = *x;
+        y->_h._type = ZN_TRIE_N48;
+        for (int k = 0, j = 0; k < 256; k++) {
+            if (n->_kids[k]) { y->_kids[j] = n->_kids[k]; y->_index[k] = (uint8_t)++j; }
+        }
+        free(x);
+        *ref = (ZnTrieNode*)y;
+    }
+}
+
+/* A node left without an entry is freed once it has no children, and
+ * merged into its only child when their paths fit in one prefix. */
+static void __zn_trie_compact(ZnTrieNode **ref) {
+    ZnTrieNode *x = *ref;
+    if (x->_has) return;
+    if (x->_n == 0) { free(x); *ref = NULL; return; }
+    if (x->_type != ZN_TRIE_N4 || x->_n != 1) return;
+    ZnTrieNode *kid = ((ZnTrieNode4*)x)->_kids[0];
+    if (x->_plen + 1 + kid->_plen > ZN_TRIE_PREFIX) return;
+    memmove(kid->_prefix + x->_plen + 1, kid->_prefix, kid->_plen);
+    memcpy(kid->_prefix, x->_prefix, x->_plen);
+    kid->_prefix[x->_plen] = ((ZnTrieNode4*)x)->_keys[0];
+    kid->_plen = (uint8_t)(kid->_plen + x->_plen + 1);
+    free(x);
+    *ref = kid;
+}
+
+/* Clear the entry for s[0..n) below *ref, compacting each node on the way
+ * back up so the path of a removed key does not outlive it */
+static bool __zn_trie_remove_at(ZnTrie *t, ZnTrieNode **ref, const uint8_t *s, int32_t n) {
+    ZnTrieNode *x = *ref;
+    if (n < x->_plen || memcmp(x->_prefix, s, x->_plen) != 0) return false;
+    s += x->_plen; n -= x->_plen;
+    if (n == 0) {
+        if (!x->_has) return false;
+        __zn_str_release(x->_key);
+        if (t->_val_release && x->_val.as.ptr) t->_val_release(x->_val.as.ptr);
+        x->_key = NULL; x->_has = false;
+        t->_len--;
+    } else {
+        ZnTrieNode **c = __zn_trie_child(x, *s);
+        if (!c || !__zn_trie_remove_at(t, c, s + 1, n - 1)) return false;
+        if (!*c) __zn_trie_drop_child(ref, *s);
+    }
+    __zn_trie_compact(ref);
+    return true;
+}
+
+static bool __zn_trie_remove(ZnTrie *t, ZnString *key) {
+    return t->_root && __zn_trie_remove_at(t, &t->_root, (const uint8_t*)key->_data, key->_len);
+}
+
+/* The longest stored key that is a prefix of s (borrowed), or NULL */
+static ZnString *__zn_trie_longest_prefix(ZnTrie *t, ZnString *s_) {
+    const uint8_t *s = (const uint8_t*)s_->_data;
+    int32_t n = s_->_len;
+    ZnString *best = NULL;
+    ZnTrieNode *x = t->_root;
+    while (x) {
+        if (n < x->_plen || memcmp(x->_prefix, s, x->_plen) != 0) break;
+        s += x->_plen; n -= x->_plen;
+        if (x->_has) best = x->_key;
+        if (n == 0) break;
+        ZnTrieNode **c = __zn_trie_child(x, *s);
+        x = c ? *c : NULL;
+        s++; n--;
+    }
+    return best;
+}
+
+/* Depth-first walk in byte order, so keys come out sorted. Boxed values of
+ * val_size bytes are copied through val_ret. */
+static void __zn_trie_collect(ZnTrieNode *x, ZnArray *out, bool keys, size_t val_size, ZnElemFn val_ret) {
+    if (x->_has) {
+        ZnValue v = keys ? __zn_val_string(x->_key) : x->_val;
+        if (!keys && val_size) v.as.ptr = __zn_val_dup(v.as.ptr, val_size, val_ret);
+        __zn_arr_push(out, v);
+    }
+    int pos = 0;
+    for (ZnTrieNode *c; (c = __zn_trie_next_kid(x, &pos)); ) __zn_trie_collect(c, out, keys, val_size, val_ret);
+}
+
+/* Append the keys (or values) of every entry starting with prefix to out */
+static ZnArray *__zn_trie_with_prefix(ZnTrie *t, ZnString *prefix, ZnArray *out, bool keys,
+                                     size_t val_size, ZnElemFn val_ret) {
+    const uint8_t *s = (const uint8_t*)prefix->_data;
+    int32_t n = prefix->_len;
+    ZnTrieNode *x = t->_root;
+    while (x) {
+        int32_t m = n < x->_plen ? n : x->_plen;
+        if (memcmp(x->_prefix, s, m) != 0) break;
+        if (n <= x->_plen) { __zn_trie_collect(x, out, keys, val_size, val_ret); break; }
+        s += x->_plen; n -= x->_plen;
+        ZnTrieNode **c = __zn_trie_child(x, *s);
+        x = c ? *c : NULL;
+        s++; n--;
+    }
+    return out;
+}
+
+/* --- LruCache runtime --- */
+
+static ZnLruCache *__zn_lru_alloc(int64_t cap, ZnElemFn key_retain, ZnElemFn key_release,
+                                  ZnHashFn key_hashcode, ZnEqFn key_equals,
+                                  ZnElemFn val_retain, ZnElemFn val_release) {
+    if (cap < 1 || cap > INT32_MAX / 2) { fprintf(stderr, "LruCache capacity out of range: %lld\n", (long long)cap); exit(1); }
+    ZnLruCache *c = malloc(sizeof(ZnLruCache));
+    c->_rc = 1; c->_len = 0; c->_cap = (int32_t)cap;
+    /* The table never grows: size it once for a load factor of at most 3/4 */
+    uint32_t nb = 8;
+    while (nb * 3 / 4 < (uint32_t)cap) nb <<= 1;
+    c->_mask = nb - 1;
+    c->_buckets = calloc(nb, sizeof(ZnLruEntry*));
+    c->_list._prev = c->_list._next = &c->_list;
+    c->_hits = 0; c->_misses = 0;
+    c->_key_retain = key_retain; c->_key_release = key_release;
+    c->_key_hashcode = key_hashcode; c->_key_equals = key_equals;
+    c->_val_retain = val_retain; c->_val_release = val_release;
+    return c;
+}
+
+static void __zn_lru_retain(ZnLruCache *c) { if (c) c->_rc++; }
+
+static void __zn_lru_drop_refs(ZnLruCache *c, ZnLruEntry *e) {
+    if (c->_key_release && e->_key.as.ptr) c->_key_release(e->_key.as.ptr);
+    if (c->_val_release && e->_val.as.ptr) c->_val_release(e->_val.as.ptr);
+}
+
+static void __zn_lru_release(ZnLruCache *c) {
+    if (!c) return;
+    if (--(c->_rc) == 0) {
+        ZnLruEntry *e = c->_list._next;
+        while (e != &c->_list) {
+            ZnLruEntry *next = e->_next;
+            __zn_lru_drop_refs(c, e);
+            free(e);
+            e = next;
+        }
+        free(c->_buckets); free(c);
+    }
+}
+
+static void __zn_lru_unlink(ZnLruEntry *e) {
+    e->_prev->_next = e->_next;
+    e->_next->_prev = e->_prev;
+}
+
+static void __zn_lru_push_front(ZnLruCache *c, ZnLruEntry *e) {
+    e->_prev = &c->_list;
+    e->_next = c->_list._next;
+    c->_list._next->_prev = e;
+    c->_list._next = e;
+}
+
+/* The bucket link that points at key's entry, or at the chain's NULL end */
+static ZnLruEntry **__zn_lru_slot(ZnLruCache *c, ZnValue key, unsigned int hash) {
+    ZnLruEntry **p = &c->_buckets[hash & c->_mask];
+    while (*p && !((*p)->_hash == hash && c->_key_equals((*p)->_key, key))) p = &(*p)->_hnext;
+    return p;
+}
+
+/* The stored value for key, or NULL on a miss. A hit moves the entry to
+ * the front; both outcomes are counted. */
+static ZnValue *__zn_lru_find(ZnLruCache *c, ZnValue key) {
+    ZnLruEntry *e = *__zn_lru_slot(c, key, c->_key_hashcode(key));
+    if (!e) { c->_misses++; return NULL; }
+    c->_hits++;
+    if (c->_list._next != e) { __zn_lru_unlink(e); __zn_lru_push_front(c, e); }
+    return &e->_val;
+}
+
+/* A miss reads as the zero value */
+static ZnValue __zn_lru_get(ZnLruCache *c, ZnValue key) {
+    ZnValue *v = __zn_lru_find(c, key);
+    if (v) return *v;
+    ZnValue nil; nil.tag = ZN_TAG_INT; nil.as.i = 0; return nil;
+}
+
+static bool __zn_lru_contains(ZnLruCache *c, ZnValue key) {
+    return *__zn_lru_slot(c, key, c->_key_hashcode(key)) != NULL;
+}
+
+static void __zn_lru_put(ZnLruCache *c, ZnValue key, ZnValue val) {
+    unsigned int hash = c->_key_hashcode(key);
+    ZnLruEntry **slot = __zn_lru_slot(c, key, hash);
+    if (c->_val_retain && val.as.ptr) c->_val_retain(val.as.ptr);
+    ZnLruEntry *e = *slot;
+    if (e) {
+        if (c->_val_release && e->_val.as.ptr) c->_val_release(e->_val.as.ptr);
+        e->_val = val;
+        __zn_lru_unlink(e);
+        __zn_lru_push_front(c, e);
+        return;
+    }
+    if (c->_len == c->_cap) {
+        /* Evict the least recently used entry and reuse its memory */
+        e = c->_list._prev;
+        __zn_lru_unlink(e);
+        ZnLruEntry **p = &c->_buckets[e->_hash & c->_mask];
+        while (*p != e) p = &(*p)->_hnext;
+        *p = e->_hnext;
+        __zn_lru_drop_refs(c, e);
+        c->_len--;
+        /* The new key's chain may have run through the evicted entry */
+        slot = __zn_lru_slot(c, key, hash);
+    } else {
+        e = malloc(sizeof(ZnLruEntry));
+    }
+    if (c->_key_retain && key.as.ptr) c->_key_retain(key.as.ptr);
+    e->_key = key; e->_val = val; e->_hash = hash;
+    e->_hnext = NULL;
+    *slot = e;
+    __zn_lru_push_front(c, e);
+    c->_len++;
+}
+
+static bool __zn_lru_remove(ZnLruCache *c, ZnValue key) {
+    ZnLruEntry **slot = __zn_lru_slot(c, key, c->_key_hashcode(key));
+    ZnLruEntry *e = *slot;
+    if (!e) return false;
+    *slot = e->_hnext;
+    __zn_lru_unlink(e);
+    __zn_lru_drop_refs(c, e);
+    free(e);
+    c->_len--;
+    return true;
+}
+
+static int64_t __zn_lru_hits(ZnLruCache *c) { return c->_hits; }
+static int64_t __zn_lru_misses(ZnLruCache *c) { return c->_misses; }
+static int64_t __zn_lru_capacity(ZnLruCache *c) { return c->_cap; }
+
+/* --- Sorted search runtime (arrays and SortedIndex) --- */
+
+/* Searches over a sorted array. Each step halves the range with a
+ * conditional move rather than a branch, so there is nothing to
+ * mispredict, and elements are read straight from _data without bounds
+ * checks or tag tests. */
+#define ZN_LESS_INT(a, b) ((a).as.i < (b).as.i)
+#define ZN_LESS_FLOAT(a, b) ((a).as.f < (b).as.f)
+#define ZN_LESS_CHAR(a, b) ((a).as.c < (b).as.c)
+#define ZN_LESS_STR(a, b) (__zn_cmp_str(a, b) < 0)
+
+#define ZN_ARR_SEARCH(SFX, LESS) \
+static int64_t __zn_arr_lower_bound_##SFX(ZnArray *a, ZnValue x) { \
+    const ZnValue *base = a->_data; \
+    int32_t n = a->_len; \
+    if (n == 0) return 0; \
+    while (n > 1) { \
+        int32_t half = n / 2; \
+        base = LESS(base[half], x) ? base + half : base; \
+        n -= half; \
+    } \
+    return (base - a->_data) + LESS(base[0], x); \
+} \
+static int64_t __zn_arr_upper_bound_##SFX(ZnArray *a, ZnValue x) { \
+    const ZnValue *base = a->_data; \
+    int32_t n = a->_len; \
+    if (n == 0) return 0; \
+    while (n > 1) { \
+        int32_t half = n / 2; \
+        base = !LESS(x, base[half]) ? base + half : base; \
+        n -= half; \
+    } \
+    return (base - a->_data) + !LESS(x, base[0]); \
+} \
+static ZnOpt_int __zn_arr_binary_search_##SFX(ZnArray *a, ZnValue x) { \
+    int64_t i = __zn_arr_lower_bound_##SFX(a, x); \
+    ZnOpt_int r = { i < a->_len && !LESS(x, a->_data[i]), i }; \
+    return r; \
+}
+
+ZN_ARR_SEARCH(int, ZN_LESS_INT)
+ZN_ARR_SEARCH(float, ZN_LESS_FLOAT)
+ZN_ARR_SEARCH(char, ZN_LESS_CHAR)
+ZN_ARR_SEARCH(str, ZN_LESS_STR)
+
+static inline bool __zn_idx_less(ZnTag tag, ZnIdxKey a, ZnIdxKey b) {
+    switch (tag) {
+    case ZN_TAG_FLOAT: return a.f < b.f;
+    case ZN_TAG_STRING: return __zn_cmp_str(__zn_val_string(a.s), __zn_val_string(b.s)) < 0;
+    default: return a.i < b.i;
+    }
+}
+
+static ZnIdxKey __zn_idx_key(ZnTag tag, ZnValue v) {
+    ZnIdxKey k;
+    switch (tag) {
+    case ZN_TAG_FLOAT: k.f = v.as.f; break;
+    case ZN_TAG_STRING: k.s = (ZnString*)v.as.ptr; break;
+    case ZN_TAG_CHAR: k.i = v.as.c; break;
+    default: k.i = v.as.i; break;
+    }
+    return k;
+}
+
+static ZnValue __zn_idx_val(ZnTag tag, ZnIdxKey k) {
+    switch (tag) {
+    case ZN_TAG_FLOAT: return __zn_val_float(k.f);
+    case ZN_TAG_STRING: return __zn_val_string(k.s);
+    case ZN_TAG_CHAR: return __zn_val_char((char)k.i);
+    default: return __zn_val_int(k.i);
+    }
+}
+
+static int __zn_idx_cmp_int(const void *a, const void *b) {
+    int64_t x = ((const ZnIdxKey*)a)->i, y = ((const ZnIdxKey*)b)->i;
+    return (x > y) - (x < y);
+}
+static int __zn_idx_cmp_float(const void *a, const void *b) {
+    double x = ((const ZnIdxKey*)a)->f, y = ((const ZnIdxKey*)b)->f;
+    return (x > y) - (x < y);
+}
+static int __zn_idx_cmp_str(const void *a, const void *b) {
+    return __zn_cmp_str(__zn_val_string(((const ZnIdxKey*)a)->s), __zn_val_string(((const ZnIdxKey*)b)->s));
+}
+
+/* In-order walk of the implicit tree places sorted[i] at its BFS slot */
+static int32_t __zn_sidx_fill(ZnSortedIndex *x, const ZnIdxKey *sorted, int32_t i, int64_t k) {
+    if (k > x->_len) return i;
+    i = __zn_sidx_fill(x, sorted, i, 2 * k);
+    x->_keys[k] = sorted[i];
+    x->_rank[k] = i++;
+    return __zn_sidx_fill(x, sorted, i, 2 * k + 1);
+}
+
+/* Index over a copy of the array's elements, in any order; duplicates stay */
+static ZnSortedIndex *__zn_sidx_from_arr(ZnTag tag, ZnArray *a) {
+    ZnSortedIndex *x = malloc(sizeof(ZnSortedIndex));
+    x->_rc = 1; x->_len = a->_len; x->_tag = tag;
+    ZnIdxKey *sorted = malloc((a->_len + 1) * sizeof(ZnIdxKey));
+    for (int32_t i = 0; i < a->_len; i++) {
+        sorted[i] = __zn_idx_key(tag, a->_data[i]);
+        if (tag == ZN_TAG_STRING) __zn_str_retain(sorted[i].s);
+    }
+    qsort(sorted, a->_len, sizeof(ZnIdxKey),
+          tag == ZN_TAG_FLOAT ? __zn_idx_cmp_float : tag == ZN_TAG_STRING ? __zn_idx_cmp_str : __zn_idx_cmp_int);
+    /* Slot k's descendants three levels down, 8k..8k+7, fill one cache line */
+    size_t bytes = ((size_t)(a->_len + 1) * sizeof(ZnIdxKey) + 63) & ~(size_t)63;
+    x->_keys = aligned_alloc(64, bytes);
+    x->_rank = malloc((a->_len + 1) * sizeof(int32_t));
+    __zn_sidx_fill(x, sorted, 0, 1);
+    free(sorted);
+    return x;
+}
+
+static void __zn_sidx_retain(ZnSortedIndex *x) { if (x) x->_rc++; }
+
+static void __zn_sidx_release(ZnSortedIndex *x) {
+    if (!x || --(x->_rc) > 0) return;
+    if (x->_tag == ZN_TAG_STRING) {
+        for (int32_t k = 1; k <= x->_len; k++) __zn_str_release(x->_keys[k].s);
+    }
+    free(x->_keys); free(x->_rank); free(x);
+}
+
+/* Descend from the root, going right while `right(key)` holds. Slot k's
+ * bits record the turns taken: for the ceiling (right while key < x) the
+ * answer is where the last left turn happened, found by stripping the
+ * trailing ones and one zero; for the floor (right while key <= x) it is
+ * the last right turn, found by stripping trailing zeros and a one. */
+#define ZN_SIDX_DESCEND(x, RIGHT) ({ \
+    const ZnIdxKey *__b = (x)->_keys; \
+    int64_t __k = 1, __n = (x)->_len; \
+    while (__k <= __n) { \
+        __builtin_prefetch(__b + 8 * __k); \
+        __k = 2 * __k + (RIGHT); \
+    } \
+    __k; })
+
+/* Slot of the smallest key >= v, or 0 */
+static int64_t __zn_sidx_ceiling_slot(ZnSortedIndex *x, ZnValue v) {
+    ZnIdxKey key = __zn_idx_key(x->_tag, v);
+    int64_t k;
+    switch (x->_tag) {
+    case ZN_TAG_FLOAT: k = ZN_SIDX_DESCEND(x, __b[__k].f < key.f); break;
+    case ZN_TAG_STRING: k = ZN_SIDX_DESCEND(x, __zn_idx_less(ZN_TAG_STRING, __b[__k], key)); break;
+    default: k = ZN_SIDX_DESCEND(x, __b[__k].i < key.i); break;
+    }
+    return k >> __builtin_ffsll(~k);
+}
+
+/* Slot of the largest key <= v, or 0 */
+static int64_t __zn_sidx_floor_slot(ZnSortedIndex *x, ZnValue v) {
+    ZnIdxKey key = __zn_idx_key(x->_tag, v);
+    int64_t k;
+    switch (x->_tag) {
+    case ZN_TAG_FLOAT: k = ZN_SIDX_DESCEND(x, !(key.f < __b[__k].f)); break;
+    case ZN_TAG_STRING: k = ZN_SIDX_DESCEND(x, !__zn_idx_less(ZN_TAG_STRING, key, __b[__k])); break;
+    default: k = ZN_SIDX_DESCEND(x, !(key.i < __b[__k].i)); break;
+    }
+    return k >> __builtin_ffsll(k);
+}
+
+static bool __zn_sidx_contains(ZnSortedIndex *x, ZnValue v) {
+    int64_t k = __zn_sidx_ceiling_slot(x, v);
+    return k != 0 && !__zn_idx_less(x->_tag, __zn_idx_key(x->_tag, v), x->_keys[k]);
+}
+
+/* Number of keys < v */
+static int64_t __zn_sidx_rank(ZnSortedIndex *x, ZnValue v) {
+    int64_t k = __zn_sidx_ceiling_slot(x, v);
+    return k ? x->_rank[k] : x->_len;
+}
+
+/* The key itself (borrowed), or *found = false; a missing String is NULL */
+static ZnValue __zn_sidx_key_at(ZnSortedIndex *x, int64_t k, bool *found) {
+    if (found) *found = k != 0;
+    if (k == 0) { ZnValue nil; nil.tag = ZN_TAG_INT; nil.as.i = 0; return nil; }
+    return __zn_idx_val(x->_tag, x->_keys[k]);
+}
+
+static ZnValue __zn_sidx_floor(ZnSortedIndex *x, ZnValue v, bool *found) {
+    return __zn_sidx_key_at(x, __zn_sidx_floor_slot(x, v), found);
+}
+
+static ZnValue __zn_sidx_ceiling(ZnSortedIndex *x, ZnValue v, bool *found) {
+    return __zn_sidx_key_at(x, __zn_sidx_ceiling_slot(x, v), found);
+}
+
+/* --- Matrix runtime (strided views over a contiguous buffer) ---
+ * Transpose and matmul work in ZN_MAT_TILE x ZN_MAT_TILE blocks, so the
+ * rows and columns a block touches stay in cache while it is in use. */
+
+#define ZN_MAT_TILE 32
+
+static ZnMatrix *__zn_mat_wrap(ZnMatBuf *buf, double *data, int64_t rows, int64_t cols, int64_t rs, int64_t cs) {
+    ZnMatrix *m = malloc(sizeof(ZnMatrix));
+    m->_rc = 1; m->_rows = (int32_t)rows; m->_cols = (int32_t)cols; m->_len = rows * cols;
+    m->_rs = rs; m->_cs = cs; m->_data = data; m->_buf = buf;
+    return m;
+}
+
+/* A contiguous rows x cols matrix of zeros */
+static ZnMatrix *__zn_mat_alloc(int64_t rows, int64_t cols) {
+    if (rows < 0 || cols < 0 || rows > INT32_MAX || cols > INT32_MAX) {
+        fprintf(stderr, "Invalid matrix shape: %lld x %lld\n", (long long)rows, (long long)cols);
+        exit(1);
+    }
+    size_t bytes = (sizeof(ZnMatBuf) + (size_t)(rows * cols) * sizeof(double) + 63) & ~(size_t)63;
+    ZnMatBuf *buf = memset(aligned_alloc(64, bytes), 0, bytes);
+    buf->_rc = 1;
+    return __zn_mat_wrap(buf, buf->_data, rows, cols, cols, 1);
+}
+
+/* A rows x cols matrix filled row by row from a float array */
+static ZnMatrix *__zn_mat_from_arr(int64_t rows, int64_t cols, ZnArray *values) {
+    ZnMatrix *m = __zn_mat_alloc(rows, cols);
+    if (values->_len != m->_len) {
+        fprintf(stderr, "Matrix of %lld x %lld needs %lld values, got %d\n",
+                (long long)rows, (long long)cols, (long long)m->_len, values->_len);
+        exit(1);
+    }
+    for (int64_t k = 0; k < m->_len; k++) m->_data[k] = values->_data[k].as.f;
+    return m;
+}
+
+static void __zn_mat_retain(ZnMatrix *m) { if (m) m->_rc++; }
+
+static void __zn_mat_release(ZnMatrix *m) {
+    if (!m || --(m->_rc) > 0) return;
+    if (--(m->_buf->_rc) == 0) free(m->_buf);
+    free(m);
+}
+
+static double *__zn_mat_at(ZnMatrix *m, int64_t i, int64_t j) {
+    if (i < 0 || i >= m->_rows || j < 0 || j >= m->_cols) {
+        fprintf(stderr, "Matrix index out of bounds: [%lld, %lld] (shape %d x %d)\n",
+                (long long)i, (long long)j, m->_rows, m->_cols);
+        exit(1);
+    }
+    return &m->_data[i * m->_rs + j * m->_cs];
+}
+
+static double __zn_mat_get(ZnMatrix *m, int64_t i, int64_t j) { return *__zn_mat_at(m, i, j); }
+
+static void __zn_mat_set(ZnMatrix *m, int64_t i, int64_t j, double v) { *__zn_mat_at(m, i, j) = v; }
+
+/* Rows r0...r1 and columns c0...c1 (end-exclusive), sharing m's buffer */
+static ZnMatrix *__zn_mat_slice(ZnMatrix *m, int64_t r0, int64_t r1, int64_t c0, int64_t c1) {
+    if (r0 < 0 || r0 > r1 || r1 > m->_rows || c0 < 0 || c0 > c1 || c1 > m->_cols) {
+        fprintf(stderr, "Matrix slice out of bounds: [%lld...%lld, %lld...%lld] (shape %d x %d)\n",
+                (long long)r0, (long long)r1, (long long)c0, (long long)c1, m->_rows, m->_cols);
+        exit(1);
+    }
+    m->_buf->_rc++;
+    return __zn_mat_wrap(m->_buf, m->_data + r0 * m->_rs + c0 * m->_cs, r1 - r0, c1 - c0, m->_rs, m->_cs);
+}
+
+static ZnMatrix *__zn_mat_row(ZnMatrix *m, int64_t i) { return __zn_mat_slice(m, i, i + 1, 0, m->_cols); }
+
+static ZnMatrix *__zn_mat_col(ZnMatrix *m, int64_t j) { return __zn_mat_slice(m, 0, m->_rows, j, j + 1); }
+
+static ZnMatrix *__zn_mat_copy(ZnMatrix *m) {
+    ZnMatrix *r = __zn_mat_alloc(m->_rows, m->_cols);
+    for (int64_t i = 0; i < m->_rows; i++) {
+        const double *src = m->_data + i * m->_rs;
+        double *dst = r->_data + i * r->_cols;
+        if (m->_cs == 1) memcpy(dst, src, m->_cols * sizeof(double));
+        else for (int64_t j = 0; j < m->_cols; j++) dst[j] = src[j * m->_cs];
+    }
+    return r;
+}
+
+/* A new contiguous transpose. Each tile is read along its rows and
+ * written along its columns while both stay in L1. */
+static ZnMatrix *__zn_mat_transpose(ZnMatrix *m) {
+    int64_t rows = m->_rows, cols = m->_cols;
+    ZnMatrix *t = __zn_mat_alloc(cols, rows);
+    for (int64_t i0 = 0; i0 < rows; i0 += ZN_MAT_TILE) {
+        int64_t i1 = i0 + ZN_MAT_TILE < rows ? i0 + ZN_MAT_TILE : rows;
+        for (int64_t j0 = 0; j0 < cols; j0 += ZN_MAT_TILE) {
+            int64_t j1 = j0 + ZN_MAT_TILE < cols ? j0 + ZN_MAT_TILE : cols;
+            for (int64_t i = i0; i < i1; i++) {
+                for (int64_t j = j0; j < j1; j++) t->_data[j * rows + i] = m->_data[i * m->_rs + j * m->_cs];
+            }
+        }
+    }
+    return t;
+}
+
+/* a x b, blocked over i, k and j. The innermost loop runs along a row of
+ * b and a row of the result, both unit-stride, so it vectorizes; b is
+ * packed into a contiguous copy first when it is a strided view. */
+static ZnMatrix *__zn_mat_matmul(ZnMatrix *a, ZnMatrix *b) {
+    if (a->_cols != b->_rows) {
+        fprintf(stderr, "Matrix shapes do not match for matmul: %d x %d times %d x %d\n",
+                a->_rows, a->_cols, b->_rows, b->_cols);
+        exit(1);
+    }
+    int64_t n = a->_rows, k = a->_cols, p = b->_cols;
+    ZnMatrix *c = __zn_mat_alloc(n, p);
+    ZnMatrix *bp = b->_cs == 1 ? b : __zn_mat_copy(b);
+    for (int64_t i0 = 0; i0 < n; i0 += ZN_MAT_TILE) {
+        int64_t i1 = i0 + ZN_MAT_TILE < n ? i0 + ZN_MAT_TILE : n;
+        for (int64_t k0 = 0; k0 < k; k0 += ZN_MAT_TILE) {
+            int64_t k1 = k0 + ZN_MAT_TILE < k ? k0 + ZN_MAT_TILE : k;
+            for (int64_t j0 = 0; j0 < p; j0 += ZN_MAT_TILE) {
+                int64_t j1 = j0 + ZN_MAT_TILE < p ? j0 + ZN_MAT_TILE : p;
+                for (int64_t i = i0; i < i1; i++) {
+                    double *restrict crow = c->_data + i * p;
+                    for (int64_t q = k0; q < k1; q++) {
+                        double aiq = a->_data[i * a->_rs + q * a->_cs];
+                        const double *restrict brow = bp->_data + q * bp->_rs;
+                        for (int64_t j = j0; j < j1; j++) crow[j] += aiq * brow[j];
+                    }
+                }
+            }
+        }
+    }
+    if (bp != b) __zn_mat_release(bp);
+    return c;
+}
+
+/* The elements row by row, pushed onto out */
+static ZnArray *__zn_mat_to_array(ZnMatrix *m, ZnArray *out) {
+    for (int64_t i = 0; i < m->_rows; i++) {
+        for (int64_t j = 0; j < m->_cols; j++) __zn_arr_push(out, __zn_val_float(m->_data[i * m->_rs + j * m->_cs]));
+    }
+    return out;
+}
+
+static double __zn_mat_sum(ZnMatrix *m) {
+    double s = 0.0;
+    for (int64_t i = 0; i < m->_rows; i++) {
+        for (int64_t j = 0; j < m->_cols; j++) s += m->_data[i * m->_rs + j * m->_cs];
+    }
+    return s;
+}
+
+static void __zn_mat_fill(ZnMatrix *m, double v) {
+    for (int64_t i = 0; i < m->_rows; i++) {
+        for (int64_t j = 0; j < m->_cols; j++) m->_data[i * m->_rs + j * m->_cs] = v;
+    }
+}
+
+/* --- SlotMap runtime (dense values behind generation-checked handles) --- */
+
+static ZnSlotMap *__zn_slotmap_alloc(ZnElemFn retain, ZnElemFn release) {
+    ZnSlotMap *m = malloc(sizeof(ZnSlotMap));
+    m->_rc = 1; m->_len = 0; m->_cap = 0; m->_nslots = 0; m->_free = -1;
+    m->_vals = NULL; m->_owner = NULL; m->_slots = NULL;
+    m->_elem_retain = retain;
+    m->_elem_release = release;
+    return m;
+}
+
+static void __zn_slotmap_retain(ZnSlotMap *m) { if (m) m->_rc++; }
+
+static void __zn_slotmap_release(ZnSlotMap *m) {
+    if (!m || --(m->_rc) > 0) return;
+    if (m->_elem_release) {
+        for (int32_t d = 0; d < m->_len; d++) {
+            if (m->_vals[d].as.ptr) m->_elem_release(m->_vals[d].as.ptr);
+        }
+    }
+    free(m->_vals); free(m->_owner); free(m->_slots);
+    free(m);
+}
+
+/* Dense index of the value behind handle h, or -1 */
+static inline int32_t __zn_slotmap_find(ZnSlotMap *m, int64_t h) {
+    uint32_t slot = (uint32_t)h, gen = (uint32_t)((uint64_t)h >> 32);
+    if (slot >= (uint32_t)m->_nslots || m->_slots[slot]._gen != gen || !(gen & 1)) return -1;
+    return m->_slots[slot]._idx;
+}
+
+static int32_t __zn_slotmap_at(ZnSlotMap *m, int64_t h) {
+    int32_t d = __zn_slotmap_find(m, h);
+    if (d < 0) { fprintf(stderr, "SlotMap handle is stale or invalid: %lld\n", (long long)h); exit(1); }
+    return d;
+}
+
+static int64_t __zn_slotmap_insert(ZnSlotMap *m, ZnValue v) {
+    if (m->_len == m->_cap) {
+        m->_cap = m->_cap ? m->_cap * 2 : 8;
+        m->_vals = realloc(m->_vals, m->_cap * sizeof(ZnValue));
+        m->_owner = realloc(m->_owner, m->_cap * sizeof(int32_t));
+        /* There are never more slots than the most values ever held */
+        m->_slots = realloc(m->_slots, m->_cap * sizeof(ZnSlot));
+    }
+    int32_t slot = m->_free;
+    if (slot >= 0) {
+        m->_free = m->_slots[slot]._idx;
+    } else {
+        slot = m->_nslots++;
+        m->_slots[slot]._gen = 0;
+    }
+    if (m->_elem_retain && v.as.ptr) m->_elem_retain(v.as.ptr);
+    int32_t d = m->_len++;
+    m->_vals[d] = v;
+    m->_owner[d] = slot;
+    m->_slots[slot]._gen++;
+    m->_slots[slot]._idx = d;
+    return ((int64_t)m->_slots[slot]._gen << 32) | slot;
+}
+
+static bool __zn_slotmap_contains(ZnSlotMap *m, int64_t h) { return __zn_slotmap_find(m, h) >= 0; }
+
+static ZnValue __zn_slotmap_get(ZnSlotMap *m, int64_t h) { return m->_vals[__zn_slotmap_at(m, h)]; }
+
+static void __zn_slotmap_set(ZnSlotMap *m, int64_t h, ZnValue v) {
+    ZnValue *slot = &m->_vals[__zn_slotmap_at(m, h)];
+    if (m->_elem_retain && v.as.ptr) m->_elem_retain(v.as.ptr);
+    if (m->_elem_release && slot->as.ptr) m->_elem_release(slot->as.ptr);
+    *slot = v;
+}
+
+static bool __zn_slotmap_remove(ZnSlotMap *m, int64_t h) {
+    int32_t d = __zn_slotmap_find(m, h);
+    if (d < 0) return false;
+    uint32_t slot = (uint32_t)h;
+    if (m->_elem_release && m->_vals[d].as.ptr) m->_elem_release(m->_vals[d].as.ptr);
+    int32_t last = --m->_len;
+    if (d != last) {
+        m->_vals[d] = m->_vals[last];
+        m->_owner[d] = m->_owner[last];
+        m->_slots[m->_owner[d]]._idx = d;
+    }
+    m->_slots[slot]._gen++;
+    m->_slots[slot]._idx = m->_free;
+    m->_free = slot;
+    return true;
+}
+
+/* The values in dense order, pushed onto out; boxed values of val_size
+ * bytes are copied through val_ret */
+static ZnArray *__zn_slotmap_values(ZnSlotMap *m, ZnArray *out, size_t val_size, ZnElemFn val_ret) {
+    for (int32_t d = 0; d < m->_len; d++) {
+        ZnValue v = m->_vals[d];
+        if (val_size) v.as.ptr = __zn_val_dup(v.as.ptr, val_size, val_ret);
+        __zn_arr_push(out, v);
+    }
+    return out;
+}
+
+/* The handles in the same order as values() */
+static ZnArray *__zn_slotmap_handles(ZnSlotMap *m, ZnArray *out) {
+    for (int32_t d = 0; d < m->_len; d++) {
+        int32_t slot = m->_owner[d];
+        __zn_arr_push(out, __zn_val_int(((int64_t)m->_slots[slot]._gen << 32) | slot));
+    }
+    return out;
+}
+
+/* --- Spin locks --- */
+
+static inline void __zn_cpu_relax(void) {
+#if defined(__SSE2__)
+    _mm_pause();
+#endif
+}
+
+/* Spins before a waiter yields or parks */
+#define ZN_SPIN_LIMIT 100
+
+/* Spin briefly, then give the core away to whoever holds the lock */
+static inline void __zn_spin_wait(int *spins) {
+    if (++*spins < ZN_SPIN_LIMIT) { __zn_cpu_relax(); return; }
+    *spins = 0;
+    sched_yield();
+}
+
+/* Reader-writer lock word: bit 0 is set while a writer holds it, bit 1
+ * while a writer waits (new readers then hold off, so a stream of readers
+ * cannot starve writers), and each reader adds 4. */
+#define ZN_RW_WRITER 1u
+#define ZN_RW_PENDING 2u
+#define ZN_RW_READER 4u
+
+static void __zn_rw_read_lock(_Atomic uint32_t *l) {
+    for (int spins = 0;; __zn_spin_wait(&spins)) {
+        uint32_t s = atomic_load_explicit(l, memory_order_relaxed);
+        if (!(s & (ZN_RW_WRITER | ZN_RW_PENDING)) &&
+            atomic_compare_exchange_weak_explicit(l, &s, s + ZN_RW_READER,
+                                                  memory_order_acquire, memory_order_relaxed)) return;
+    }
+}
+
+static inline void __zn_rw_read_unlock(_Atomic uint32_t *l) {
+    atomic_fetch_sub_explicit(l, ZN_RW_READER, memory_order_release);
+}
+
+static void __zn_rw_write_lock(_Atomic uint32_t *l) {
+    for (int spins = 0;; __zn_spin_wait(&spins)) {
+        uint32_t s = atomic_load_explicit(l, memory_order_relaxed);
+        if ((s & ~ZN_RW_PENDING) == 0) {
+            /* Taking the lock also clears the waiting bit; writers still
+             * waiting set it again */
+            if (atomic_compare_exchange_weak_explicit(l, &s, ZN_RW_WRITER,
+                                                      memory_order_acquire, memory_order_relaxed)) return;
+        } else if (!(s & ZN_RW_PENDING)) {
+            atomic_fetch_or_explicit(l, ZN_RW_PENDING, memory_order_relaxed);
+        }
+    }
+}
+
+static inline void __zn_rw_write_unlock(_Atomic uint32_t *l) {
+    atomic_fetch_and_explicit(l, ~ZN_RW_WRITER, memory_order_release);
+}
+
+/* --- ConcurrentHash runtime --- */
+
+/* shards is rounded up to a power of two. Keys are hashed and compared by
+ * the usual per-type callbacks; a key or value release callback marks it
+ * as a String, the one reference type the table holds. */
+static ZnConcurrentHash *__zn_chash_alloc(int64_t shards, ZnElemFn key_release,
+                                          ZnHashFn key_hashcode, ZnEqFn key_equals,
+                                          ZnElemFn val_release) {
+    if (shards < 1 || shards > 65536) { fprintf(stderr, "ConcurrentHash shard count out of range: %lld\n", (long long)shards); exit(1); }
+    int32_t n = 1;
+    uint32_t shift = 32;
+    while (n < shards) { n <<= 1; shift--; }
+    ZnConcurrentHash *m = __zn_obj_alloc(sizeof(ZnConcurrentHash));
+    atomic_init(&m->_rc, 1);
+    atomic_init(&m->_len, 0);
+    m->_nshards = n; m->_shift = shift;
+    m->_str_keys = key_release != NULL;
+    m->_str_vals = val_release != NULL;
+    m->_shards = aligned_alloc(ZN_CACHE_LINE, n * sizeof(ZnChashShard));
+    for (int32_t i = 0; i < n; i++) {
+        atomic_init(&m->_shards[i]._lock, 0);
+        /* The table already holds its own copies, so it retains nothing */
+        m->_shards[i]._map = __zn_hash_alloc(0, NULL, key_release, key_hashcode, key_equals, NULL, val_release);
+        /* Lookups under a read lock must not move entries */
+        __zn_hash_incremental_rehash(m->_shards[i]._map, false);
+    }
+    return m;
+}
+
+static void __zn_chash_retain(ZnConcurrentHash *m) {
+    if (m) atomic_fetch_add_explicit(&m->_rc, 1, memory_order_relaxed);
+}
+
+static void __zn_chash_release(ZnConcurrentHash *m) {
+    if (!m || atomic_fetch_sub_explicit(&m->_rc, 1, memory_order_acq_rel) != 1) return;
+    for (int32_t i = 0; i < m->_nshards; i++) __zn_hash_release(m->_shards[i]._map);
+    free(m->_shards);
+    free(m);
+}
+
+/* The shard for a hashcode. It takes the top bits of a different mix from
+ * the one behind the in-shard tags, so a shard's entries still spread
+ * over all tag values. */
+static inline ZnChashShard *__zn_chash_shard(ZnConcurrentHash *m, unsigned int hc) {
+    return &m->_shards[(uint64_t)(uint32_t)(hc * 0x85EBCA6Bu) >> m->_shift];
+}
+
+/* A private copy of a String, so no refcount crosses threads; static
+ * literals are never freed and need none */
+static inline ZnValue __zn_chash_copy(ZnValue v, bool is_str) {
+    if (is_str && ((ZnString*)v.as.ptr)->_rc >= 0) {
+        ZnString *s = v.as.ptr;
+        v.as.ptr = __zn_str_alloc(s->_data, s->_len);
+    }
+    return v;
+}
+
+/* The value slot for key, holding zero if the key had to be added (with
+ * a copy of key). The caller holds the shard's write lock. */
+static ZnValue *__zn_chash_slot(ZnConcurrentHash *m, ZnHash *h, ZnValue key, unsigned int hc, bool *added) {
+    ZnValue *v = __zn_hash_find_hashed(h, key, hc);
+    *added = v == NULL;
+    if (v) return v;
+    ZnValue zero; zero.tag = ZN_TAG_INT; zero.as.i = 0;
+    atomic_fetch_add_explicit(&m->_len, 1, memory_order_relaxed);
+    return __zn_hash_upsert(h, __zn_chash_copy(key, m->_str_keys), hc, zero, true);
+}
+
+static struct { int32_t _rc; int32_t _len; char _data[1]; } __zn_chash_empty_str = {-1, 0, ""};
+
+/* A copy of key's value (owned by the caller), or the zero value; a
+ * missing String reads as "" */
+static ZnValue __zn_chash_get(ZnConcurrentHash *m, ZnValue key) {
+    unsigned int hc = m->_shards[0]._map->_key_hashcode(key);
+    ZnChashShard *s = __zn_chash_shard(m, hc);
+    __zn_rw_read_lock(&s->_lock);
+    ZnValue *v = __zn_hash_find_hashed(s->_map, key, hc);
+    ZnValue r;
+    if (v) r = __zn_chash_copy(*v, m->_str_vals);
+    else if (m->_str_vals) r = __zn_val_string((ZnString*)&__zn_chash_empty_str);
+    else { r.tag = ZN_TAG_INT; r.as.i = 0; }
+    __zn_rw_read_unlock(&s->_lock);
+    return r;
+}
+
+static bool __zn_chash_contains(ZnConcurrentHash *m, ZnValue key) {
+    unsigned int hc = m->_shards[0]._map->_key_hashcode(key);
+    ZnChashShard *s = __zn_chash_shard(m, hc);
+    __zn_rw_read_lock(&s->_lock);
+    bool found = __zn_hash_find_hashed(s->_map, key, hc) != NULL;
+    __zn_rw_read_unlock(&s->_lock);
+    return found;
+}
+
+static void __zn_chash_set(ZnConcurrentHash *m, ZnValue key, ZnValue val) {
+    unsigned int hc = m->_shards[0]._map->_key_hashcode(key);
+    ZnChashShard *s = __zn_chash_shard(m, hc);
+    val = __zn_chash_copy(val, m->_str_vals);
+    bool added;
+    __zn_rw_write_lock(&s->_lock);
+    ZnValue *slot = __zn_chash_slot(m, s->_map, key, hc, &added);
+    ZnValue old = *slot;
+    *slot = val;
+    __zn_rw_write_unlock(&s->_lock);
+    /* The replaced value is the table's own copy: free it outside the lock */
+    if (!added && m->_str_vals) __zn_str_release(old.as.ptr);
+}
+
+/* Store val only when key is absent; true if it was stored */
+static bool __zn_chash_put_if_absent(ZnConcurrentHash *m, ZnValue key, ZnValue val) {
+    unsigned int hc = m->_shards[0]._map->_key_hashcode(key);
+    ZnChashShard *s = __zn_chash_shard(m, hc);
+    bool added;
+    __zn_rw_write_lock(&s->_lock);
+    ZnValue *slot = __zn_chash_slot(m, s->_map, key, hc, &added);
+    if (added) *slot = __zn_chash_copy(val, m->_str_vals);
+    __zn_rw_write_unlock(&s->_lock);
+    return added;
+}
+
+/* Add delta to an int value, starting from 0; the new value */
+static int64_t __zn_chash_add(ZnConcurrentHash *m, ZnValue key, int64_t delta) {
+    unsigned int hc = m->_shards[0]._map->_key_hashcode(key);
+    ZnChashShard *s = __zn_chash_shard(m, hc);
+    bool added;
+    __zn_rw_write_lock(&s->_lock);
+    int64_t r = (__zn_chash_slot(m, s->_map, key, hc, &added)->as.i += delta);
+    __zn_rw_write_unlock(&s->_lock);
+    return r;
+}
+
+static bool __zn_chash_remove(ZnConcurrentHash *m, ZnValue key) {
+    unsigned int hc = m->_shards[0]._map->_key_hashcode(key);
+    ZnChashShard *s = __zn_chash_shard(m, hc);
+    __zn_rw_write_lock(&s->_lock);
+    bool removed = __zn_hash_remove_hashed(s->_map, key, hc);
+    __zn_rw_write_unlock(&s->_lock);
+    if (removed) atomic_fetch_sub_explicit(&m->_len, 1, memory_order_relaxed);
+    return removed;
+}
+
+static inline void __zn_chash_push(ZnArray *out, ZnValue v, bool is_str) {
+    ZnValue c = __zn_chash_copy(v, is_str);
+    __zn_arr_push(out, c);
+    if (c.as.ptr != v.as.ptr) __zn_str_release(c.as.ptr);
+}
+
+/* Every key (or value), pushed onto out a shard at a time. Each shard is
+ * read at one instant, but entries other threads change in shards not yet
+ * visited may or may not show up. */
+static ZnArray *__zn_chash_collect(ZnConcurrentHash *m, ZnArray *out, bool keys) {
+    bool is_str = keys ? m->_str_keys : m->_str_vals;
+    for (int32_t i = 0; i < m->_nshards; i++) {
+        ZnChashShard *s = &m->_shards[i];
+        __zn_rw_read_lock(&s->_lock);
+        ZnHash *h = s->_map;
+        if (!h->_buckets) {
+            for (int j = 0; j < h->_len; j++) __zn_chash_push(out, keys ? h->_small->_keys[j] : h->_small->_vals[j], is_str);
+        } else {
+            for (int b = 0; b < h->_cap; b++) {
+                for (ZnHashEntry *e = h->_buckets[b]; e; e = e->next) {
+                    __zn_chash_push(out, keys ? e->key : e->value, is_str);
+                }
+            }
+        }
+        __zn_rw_read_unlock(&s->_lock);
+    }
+    return out;
+}
+
+static int64_t __zn_chash_shards(ZnConcurrentHash *m) { return m->_nshards; }
+
+/* --- Synchronization runtime --- */
+
+/* Sleep while *addr still holds val; wake up to n sleepers. Elsewhere
+ * than Linux a waiter just yields, so the lock words degrade to spin locks. */
+static inline void __zn_futex_wait(_Atomic uint32_t *addr, uint32_t val) {
+#if defined(__linux__)
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    if (atomic_load_explicit(addr, memory_order_relaxed) == val) sched_yield();
+#endif
+}
+
+static inline void __zn_futex_wake(_Atomic uint32_t *addr, int n) {
+#if defined(__linux__)
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+#else
+    (void)addr; (void)n;
+#endif
+}
+
+static void *__zn_sync_alloc(size_t size) {
+    void *p = aligned_alloc(ZN_CACHE_LINE, size);
+    memset(p, 0, size);
+    atomic_init((_Atomic int32_t*)p, 1);
+    return p;
+}
+
+/* Every synchronization type starts with its atomic _rc */
+static inline void __zn_sync_retain(void *p) {
+    if (p) atomic_fetch_add_explicit((_Atomic int32_t*)p, 1, memory_order_relaxed);
+}
+
+static inline void __zn_sync_release(void *p) {
+    if (p && atomic_fetch_sub_explicit((_Atomic int32_t*)p, 1, memory_order_acq_rel) == 1) free(p);
+}
+
+/* Atomics: the orderings are compile-time constants at every call site,
+ * so these inline down to single instructions */
+static ZnAtomic *__zn_atomic_alloc(int64_t v) {
+    ZnAtomic *a = __zn_sync_alloc(sizeof(ZnAtomic));
+    atomic_init(&a->_v, v);
+    return a;
+}
+
+static void __zn_atomic_retain(ZnAtomic *a) { __zn_sync_retain(a); }
+static void __zn_atomic_release(ZnAtomic *a) { __zn_sync_release(a); }
+
+static inline int64_t __zn_atomic_load(ZnAtomic *a, memory_order mo) {
+    return atomic_load_explicit(&a->_v, mo);
+}
+
+static inline void __zn_atomic_store(ZnAtomic *a, int64_t v, memory_order mo) {
+    atomic_store_explicit(&a->_v, v, mo);
+}
+
+static inline int64_t __zn_atomic_exchange(ZnAtomic *a, int64_t v, memory_order mo) {
+    return atomic_exchange_explicit(&a->_v, v, mo);
+}
+
+static inline int64_t __zn_atomic_fetch_add(ZnAtomic *a, int64_t d, memory_order mo) {
+    return atomic_fetch_add_explicit(&a->_v, d, mo);
+}
+
+static inline int64_t __zn_atomic_fetch_sub(ZnAtomic *a, int64_t d, memory_order mo) {
+    return atomic_fetch_sub_explicit(&a->_v, d, mo);
+}
+
+/* Strong compare-and-swap: true if the value was expected and is now desired */
+static inline bool __zn_atomic_compare_exchange(ZnAtomic *a, int64_t expected, int64_t desired,
+                                                memory_order mo, memory_order fail) {
+    return atomic_compare_exchange_strong_explicit(&a->_v, &expected, desired, mo, fail);
+}
+
+/* Mutex: _state is 0 when free, 1 when held, 2 when held with threads
+ * (maybe) parked, so an uncontended unlock never enters the kernel */
+static ZnMutex *__zn_mutex_alloc(void) { return __zn_sync_alloc(sizeof(ZnMutex)); }
+static void __zn_mutex_retain(ZnMutex *m) { __zn_sync_retain(m); }
+static void __zn_mutex_release(ZnMutex *m) { __zn_sync_release(m); }
+
+static inline bool __zn_mutex_try_lock(ZnMutex *m) {
+    uint32_t c = 0;
+    return atomic_compare_exchange_strong_explicit(&m->_state, &c, 1, memory_order_acquire, memory_order_relaxed);
+}
+
+static void __zn_mutex_lock(ZnMutex *m) {
+    if (__zn_mutex_try_lock(m)) return;
+    /* The holder is likely to let go soon */
+    for (int i = 0; i < ZN_SPIN_LIMIT; i++) {
+        __zn_cpu_relax();
+        if (atomic_load_explicit(&m->_state, memory_order_relaxed) == 0 && __zn_mutex_try_lock(m)) return;
+    }
+    while (atomic_exchange_explicit(&m->_state, 2, memory_order_acquire) != 0) __zn_futex_wait(&m->_state, 2);
+}
+
+static void __zn_mutex_unlock(ZnMutex *m) {
+    uint32_t s = atomic_exchange_explicit(&m->_state, 0, memory_order_release);
+    if (s == 0) { fprintf(stderr, "Mutex unlocked while not locked\n"); exit(1); }
+    if (s == 2) __zn_futex_wake(&m->_state, 1);
+}
+
+/* RwLock: _state counts readers in its low bits, with ZN_RWL_WRITER set
+ * while a writer holds it and ZN_RWL_PENDING while one waits (new readers
+ * then hold off). Parked threads sleep on _seq, which an unlock bumps
+ * only when _waiters says someone may be asleep. */
+#define ZN_RWL_WRITER 0x80000000u
+#define ZN_RWL_PENDING 0x40000000u
+#define ZN_RWL_READERS 0x3FFFFFFFu
+
+static ZnRwLock *__zn_rwlock_alloc(void) { return __zn_sync_alloc(sizeof(ZnRwLock)); }
+static void __zn_rwlock_retain(ZnRwLock *l) { __zn_sync_retain(l); }
+static void __zn_rwlock_release(ZnRwLock *l) { __zn_sync_release(l); }
+
+static inline bool __zn_rwlock_try_read(ZnRwLock *l) {
+    uint32_t s = atomic_load_explicit(&l->_state, memory_order_relaxed);
+    return !(s & (ZN_RWL_WRITER | ZN_RWL_PENDING)) &&
+           atomic_compare_exchange_weak_explicit(&l->_state, &s, s + 1, memory_order_acquire, memory_order_relaxed);
+}
+
+static inline bool __zn_rwlock_try_write(ZnRwLock *l) {
+    uint32_t s = atomic_load_explicit(&l->_state, memory_order_relaxed);
+    if (s & ~ZN_RWL_PENDING) {
+        if (!(s & ZN_RWL_PENDING)) atomic_fetch_or_explicit(&l->_state, ZN_RWL_PENDING, memory_order_relaxed);
+        return false;
+    }
+    /* Taking the lock clears the waiting bit; other writers set it again */
+    return atomic_compare_exchange_weak_explicit(&l->_state, &s, ZN_RWL_WRITER, memory_order_acquire, memory_order_relaxed);
+}
+
+/* Spin on try_lock, then park until an unlock moves _seq. Registering in
+ * _waiters before the last try means an unlock either lets that try
+ * succeed or sees the waiter and wakes it. */
+static void __zn_rwlock_wait(ZnRwLock *l, bool (*try_lock)(ZnRwLock*)) {
+    for (int spins = 0;; spins++) {
+        if (try_lock(l)) return;
+        if (spins < ZN_SPIN_LIMIT) { __zn_cpu_relax(); continue; }
+        uint32_t seq = atomic_load(&l->_seq);
+        atomic_fetch_add(&l->_waiters, 1);
+        if (try_lock(l)) { atomic_fetch_sub(&l->_waiters, 1); return; }
+        __zn_futex_wait(&l->_seq, seq);
+        atomic_fetch_sub(&l->_waiters, 1);
+    }
+}
+
+static void __zn_rwlock_wake(ZnRwLock *l) {
+    if (atomic_load(&l->_waiters) == 0) return;
+    atomic_fetch_add(&l->_seq, 1);
+    __zn_futex_wake(&l->_seq, INT32_MAX);
+}
+
+static void __zn_rwlock_read_lock(ZnRwLock *l) {
+    if (!__zn_rwlock_try_read(l)) __zn_rwlock_wait(l, __zn_rwlock_try_read);
+}
+
+static void __zn_rwlock_write_lock(ZnRwLock *l) {
+    if (!__zn_rwlock_try_write(l)) __zn_rwlock_wait(l, __zn_rwlock_try_write);
+}
+
+static void __zn_rwlock_read_unlock(ZnRwLock *l) {
+    uint32_t s = atomic_fetch_sub(&l->_state, 1);
+    if (!(s & ZN_RWL_READERS)) { fprintf(stderr, "RwLock read_unlock without a reader\n"); exit(1); }
+    /* The last reader out lets a waiting writer in */
+    if ((s & ZN_RWL_READERS) == 1) __zn_rwlock_wake(l);
+}
+
+static void __zn_rwlock_write_unlock(ZnRwLock *l) {
+    uint32_t s = atomic_fetch_and(&l->_state, ~ZN_RWL_WRITER);
+    if (!(s & ZN_RWL_WRITER)) { fprintf(stderr, "RwLock write_unlock without a writer\n"); exit(1); }
+    __zn_rwlock_wake(l);
+}
+
+/* Once: _state is 0 before the first call, 1 while it runs, 3 while it
+ * runs with threads parked on it, and 2 once it has finished */
+static ZnOnce *__zn_once_alloc(void) { return __zn_sync_alloc(sizeof(ZnOnce)); }
+static void __zn_once_retain(ZnOnce *o) { __zn_sync_retain(o); }
+static void __zn_once_release(ZnOnce *o) { __zn_sync_release(o); }
+
+/* True for the one caller that must run the body and then call
+ * __zn_once_end; everyone else returns false once the body has finished */
+static bool __zn_once_begin(ZnOnce *o) {
+    uint32_t s = atomic_load_explicit(&o->_state, memory_order_acquire);
+    if (s == 2) return false;
+    s = 0;
+    if (atomic_compare_exchange_strong_explicit(&o->_state, &s, 1, memory_order_acquire, memory_order_acquire)) return true;
+    for (;;) {
+        s = atomic_load_explicit(&o->_state, memory_order_acquire);
+        if (s == 2) return false;
+        if (s == 1 && !atomic_compare_exchange_weak_explicit(&o->_state, &s, 3, memory_order_relaxed, memory_order_relaxed)) continue;
+        __zn_futex_wait(&o->_state, 3);
+    }
+}
+
+static void __zn_once_end(ZnOnce *o) {
+    if (atomic_exchange_explicit(&o->_state, 2, memory_order_release) == 3) __zn_futex_wake(&o->_state, INT32_MAX);
+}
+
+/* The fast path of __zn_once_begin, inlined where a Once guards every read */
+static inline bool __zn_once_done(ZnOnce *o) {
+    return atomic_load_explicit(&o->_state, memory_order_acquire) == 2;
+}
+
+/* Barrier: the last of _n threads to arrive resets the count and starts
+ * the next generation, releasing the rest; it alone gets true */
+static ZnBarrier *__zn_barrier_alloc(int64_t n) {
+    if (n < 1 || n > INT32_MAX) { fprintf(stderr, "Barrier thread count out of range: %lld\n", (long long)n); exit(1); }
+    ZnBarrier *b = __zn_sync_alloc(sizeof(ZnBarrier));
+    b->_n = (int32_t)n;
+    return b;
+}
+
+static void __zn_barrier_retain(ZnBarrier *b) { __zn_sync_retain(b); }
+static void __zn_barrier_release(ZnBarrier *b) { __zn_sync_release(b); }
+
+static bool __zn_barrier_wait(ZnBarrier *b) {
+    uint32_t gen = atomic_load_explicit(&b->_gen, memory_order_acquire);
+    if (atomic_fetch_add_explicit(&b->_count, 1, memory_order_acq_rel) + 1 == b->_n) {
+        atomic_store_explicit(&b->_count, 0, memory_order_relaxed);
+        atomic_fetch_add_explicit(&b->_gen, 1, memory_order_release);
+        __zn_futex_wake(&b->_gen, INT32_MAX);
+        return true;
+    }
+    for (int spins = 0; atomic_load_explicit(&b->_gen, memory_order_acquire) == gen; spins++) {
+        if (spins < ZN_SPIN_LIMIT) __zn_cpu_relax();
+        else __zn_futex_wait(&b->_gen, gen);
+    }
+    return false;
+}
+
+/* --- Actor runtime --- */
+
+/* A private copy of a String for another thread; literals are shared */
+static ZnString *__zn_str_clone(const ZnString *s) {
+    if (!s || s->_rc < 0) return (ZnString *)s;
+    return __zn_str_alloc(s->_data, s->_len);
+}
+
+/* Mailbox: Vyukov's intrusive MPSC queue. A push is one exchange; the
+ * single consumer pops without atomics read-modify-writes. */
+static inline void __zn_mailbox_push(ZnActor *a, ZnMsg *m) {
+    atomic_store_explicit(&m->_next, NULL, memory_order_relaxed);
+    ZnMsg *prev = atomic_exchange_explicit(&a->_head, m, memory_order_seq_cst);
+    atomic_store_explicit(&prev->_next, m, memory_order_release);
+}
+
+/* NULL when empty, or when a push is halfway through; the caller looks
+ * at _head again after going idle */
+static ZnMsg *__zn_mailbox_pop(ZnActor *a) {
+    ZnMsg *tail = a->_tail;
+    ZnMsg *next = atomic_load_explicit(&tail->_next, memory_order_acquire);
+    if (tail == &a->_stub) {
+        if (!next) return NULL;
+        a->_tail = tail = next;
+        next = atomic_load_explicit(&next->_next, memory_order_acquire);
+    }
+    if (next) {
+        a->_tail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&a->_head, memory_order_acquire)) return NULL;
+    __zn_mailbox_push(a, &a->_stub);
+    next = atomic_load_explicit(&tail->_next, memory_order_acquire);
+    if (!next) return NULL;
+    a->_tail = next;
+    return tail;
+}
+
+
+/* Scheduler: worker threads take runnable actors off one FIFO queue.
+ * _active counts scheduled actors, so the program is quiet when it is 0. */
+#define ZN_ACTOR_BATCH 64
+#define ZN_ACTOR_MAX_WORKERS 64
+
+static struct {
+    _Alignas(ZN_CACHE_LINE) pthread_mutex_t _lock;
+    pthread_cond_t _work;
+    pthread_cond_t _quiet;
+    ZnActor *_first, *_last;
+    bool _stop;
+    /* Counted by senders outside the lock */
+    _Alignas(ZN_CACHE_LINE) _Atomic int64_t _active;
+    int32_t _nworkers;
+    pthread_t _workers[ZN_ACTOR_MAX_WORKERS];
+} __zn_sched = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static pthread_once_t __zn_sched_once = PTHREAD_ONCE_INIT;
+static _Thread_local bool __zn_on_worker;
+
+static void __zn_sched_push(ZnActor *a) {
+    a->_next = NULL;
+    pthread_mutex_lock(&__zn_sched._lock);
+    if (__zn_sched._last) __zn_sched._last->_next = a;
+    else __zn_sched._first = a;
+    __zn_sched._last = a;
+    pthread_cond_signal(&__zn_sched._work);
+    pthread_mutex_unlock(&__zn_sched._lock);
+}
+
+static void __zn_actor_retain(ZnActor *a) {
+    if (a) atomic_fetch_add_explicit(&a->_rc, 1, memory_order_relaxed);
+}
+
+static void __zn_actor_release(ZnActor *a) {
+    if (a && atomic_fetch_sub_explicit(&a->_rc, 1, memory_order_acq_rel) == 1) a->_dispose(a);
+}
+
+/* Run up to a batch of messages. The actor holds a reference for the
+ * scheduler while it is scheduled; an activation that drains the mailbox
+ * marks it idle and drops that reference, unless a sender slipped a
+ * message in meanwhile. */
+static void __zn_actor_run(ZnActor *a) {
+    for (int n = 0; n < ZN_ACTOR_BATCH; n++) {
+        ZnMsg *m = __zn_mailbox_pop(a);
+        if (!m) {
+            /* _tail belongs to whoever runs the actor next once _sched is 0 */
+            bool drained = a->_tail == &a->_stub;
+            atomic_store_explicit(&a->_sched, 0, memory_order_seq_cst);
+            uint32_t idle = 0;
+            if ((!drained || atomic_load_explicit(&a->_head, memory_order_seq_cst) != &a->_stub) &&
+                atomic_compare_exchange_strong_explicit(&a->_sched, &idle, 1, memory_order_seq_cst, memory_order_relaxed)) {
+                __zn_sched_push(a);
+                return;
+            }
+            if (atomic_fetch_sub_explicit(&__zn_sched._active, 1, memory_order_acq_rel) == 1) {
+                pthread_mutex_lock(&__zn_sched._lock);
+                pthread_cond_broadcast(&__zn_sched._quiet);
+                pthread_mutex_unlock(&__zn_sched._lock);
+            }
+            __zn_actor_release(a);
+            return;
+        }
+        m->_run(a, m);
+    }
+    __zn_sched_push(a);
+}
+
+static void *__zn_worker_main(void *arg) {
+    (void)arg;
+    __zn_on_worker = true;
+    for (;;) {
+        pthread_mutex_lock(&__zn_sched._lock);
+        while (!__zn_sched._first && !__zn_sched._stop)
+            pthread_cond_wait(&__zn_sched._work, &__zn_sched._lock);
+        ZnActor *a = __zn_sched._first;
+        if (!a) {
+            pthread_mutex_unlock(&__zn_sched._lock);
+            return NULL;
+        }
+        __zn_sched._first = a->_next;
+        if (!__zn_sched._first) __zn_sched._last = NULL;
+        pthread_mutex_unlock(&__zn_sched._lock);
+        __zn_actor_run(a);
+    }
+}
+
+/* Block until every mailbox is empty and no handler is running */
+static void __zn_actors_wait(void) {
+    if (__zn_on_worker) {
+        fprintf(stderr, "await_actors() called from an actor handler\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&__zn_sched._lock);
+    while (atomic_load_explicit(&__zn_sched._active, memory_order_acquire) > 0)
+        pthread_cond_wait(&__zn_sched._quiet, &__zn_sched._lock);
+    pthread_mutex_unlock(&__zn_sched._lock);
+}
+
+/* At exit: let the actors finish their mail, then stop the workers */
+static void __zn_actors_shutdown(void) {
+    if (__zn_on_worker) return;
+    __zn_actors_wait();
+    pthread_mutex_lock(&__zn_sched._lock);
+    __zn_sched._stop = true;
+    pthread_cond_broadcast(&__zn_sched._work);
+    pthread_mutex_unlock(&__zn_sched._lock);
+    for (int32_t i = 0; i < __zn_sched._nworkers; i++) pthread_join(__zn_sched._workers[i], NULL);
+}
+
+/* One worker per online CPU, or ZINC_THREADS */
+static void __zn_sched_start(void) {
+    long n = 0;
+    const char *env = getenv("ZINC_THREADS");
+    if (env) n = strtol(env, NULL, 10);
+#if defined(_SC_NPROCESSORS_ONLN)
+    if (n <= 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (n <= 0) n = 1;
+    if (n > ZN_ACTOR_MAX_WORKERS) n = ZN_ACTOR_MAX_WORKERS;
+    for (long i = 0; i < n; i++) {
+        if (pthread_create(&__zn_sched._workers[__zn_sched._nworkers], NULL, __zn_worker_main, NULL) != 0) break;
+        __zn_sched._nworkers++;
+    }
+    if (__zn_sched._nworkers == 0) {
+        fprintf(stderr, "Could not start actor worker threads\n");
+        exit(1);
+    }
+    atexit(__zn_actors_shutdown);
+}
+
+/* size is that of the generated actor struct, which starts with ZnActor */
+static void *__zn_actor_alloc(size_t size, void (*dispose)(ZnActor*)) {
+    pthread_once(&__zn_sched_once, __zn_sched_start);
+    size = (size + ZN_CACHE_LINE - 1) & ~(size_t)(ZN_CACHE_LINE - 1);
+    ZnActor *a = __zn_obj_alloc(size);
+    memset(a, 0, size);
+    atomic_init(&a->_rc, 1);
+    a->_dispose = dispose;
+    atomic_init(&a->_head, &a->_stub);
+    a->_tail = &a->_stub;
+    return a;
+}
+
+/* Enqueue m; if the actor was idle, schedule it on behalf of the sender,
+ * who holds a reference across the call */
+static void __zn_actor_send(ZnActor *a, ZnMsg *m) {
+    __zn_mailbox_push(a, m);
+    uint32_t idle = 0;
+    if (atomic_load_explicit(&a->_sched, memory_order_seq_cst) == 0 &&
+        atomic_compare_exchange_strong_explicit(&a->_sched, &idle, 1, memory_order_seq_cst, memory_order_relaxed)) {
+        __zn_actor_retain(a);
+        atomic_fetch_add_explicit(&__zn_sched._active, 1, memory_order_relaxed);
+        __zn_sched_push(a);
+    }
+}
+
+/* --- Shared runtime (epoch-based reclamation) --- */
+
+/* Every thread that reads a Shared owns a record holding the epoch it
+ * pinned, or 0 between reads. The list only grows: the record of an
+ * exited thread is handed to the next thread that needs one. */
+typedef struct ZnEbrRec {
+    _Alignas(ZN_CACHE_LINE) _Atomic uint64_t _epoch;
+    _Atomic uint32_t _owned;
+    struct ZnEbrRec *_next;
+} ZnEbrRec;
+
+/* Read by every pin, so it stays off the lines of neighbouring globals */
+static _Alignas(ZN_CACHE_LINE) _Atomic uint64_t __zn_ebr_epoch = 1;
+static _Atomic(ZnEbrRec*) __zn_ebr_recs;
+static _Thread_local ZnEbrRec *__zn_ebr_self;
+static pthread_key_t __zn_ebr_key;
+static pthread_once_t __zn_ebr_once = PTHREAD_ONCE_INIT;
+
+static void __zn_ebr_exit(void *r) {
+    atomic_store_explicit(&((ZnEbrRec*)r)->_owned, 0, memory_order_release);
+}
+
+static void __zn_ebr_init(void) { pthread_key_create(&__zn_ebr_key, __zn_ebr_exit); }
+
+static ZnEbrRec *__zn_ebr_register(void) {
+    pthread_once(&__zn_ebr_once, __zn_ebr_init);
+    ZnEbrRec *r = atomic_load_explicit(&__zn_ebr_recs, memory_order_acquire);
+    for (; r; r = r->_next) {
+        uint32_t unowned = 0;
+        if (atomic_compare_exchange_strong_explicit(&r->_owned, &unowned, 1,
+                                                    memory_order_acquire, memory_order_relaxed)) break;
+    }
+    if (!r) {
+        r = aligned_alloc(ZN_CACHE_LINE, sizeof(ZnEbrRec));
+        atomic_init(&r->_epoch, 0);
+        atomic_init(&r->_owned, 1);
+        r->_next = atomic_load_explicit(&__zn_ebr_recs, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&__zn_ebr_recs, &r->_next, r,
+                                                      memory_order_release, memory_order_relaxed)) {}
+    }
+    pthread_setspecific(__zn_ebr_key, r);
+    return __zn_ebr_self = r;
+}
+
+/* Announce the current epoch, then load the version. Both are seq_cst: a
+ * publisher that misses the announcement swapped the version earlier, so
+ * the load sees the new one. */
+static inline void *__zn_shared_pin(ZnShared *s) {
+    ZnEbrRec *r = __zn_ebr_self ? __zn_ebr_self : __zn_ebr_register();
+    atomic_store(&r->_epoch, atomic_load(&__zn_ebr_epoch));
+    return atomic_load(&s->_cur);
+}
+
+static inline void __zn_shared_unpin(void) {
+    atomic_store_explicit(&__zn_ebr_self->_epoch, 0, memory_order_release);
+}
+
+/* Wait out every reader pinned before epoch e. Reads are one lookup
+ * each, so the wait is short; it spins, then yields. */
+static void __zn_ebr_synchronize(uint64_t e) {
+    for (ZnEbrRec *r = atomic_load_explicit(&__zn_ebr_recs, memory_order_acquire); r; r = r->_next) {
+        int spins = 0;
+        for (;;) {
+            uint64_t pinned = atomic_load(&r->_epoch);
+            if (pinned == 0 || pinned >= e) break;
+            __zn_spin_wait(&spins);
+        }
+    }
+}
+
+/* A String only this version references: one still held elsewhere is
+ * replaced by a copy, so no refcount is shared between threads */
+static ZnString *__zn_str_own(ZnString *s) {
+    if (!s || s->_rc <= 1) return s;
+    ZnString *c = __zn_str_alloc(s->_data, s->_len);
+    __zn_str_release(s);
+    return c;
+}
+
+/* Every runtime type and class starts with its _rc */
+static void *__zn_shared_own(void *v) {
+    if (*(int32_t*)v != 1) {
+        fprintf(stderr, "Shared value is still referenced elsewhere\n");
+        exit(1);
+    }
+    return v;
+}
+
+/* A published hash is never written again: any rehash in progress is
+ * finished so that lookups only read */
+static ZnHash *__zn_shared_own_hash(ZnHash *h, bool str_keys, bool str_vals) {
+    __zn_shared_own(h);
+    if (h->_old) __zn_hash_migrate(h, h->_old_cap);
+    h->_incremental = false;
+    if (!h->_buckets) {
+        for (int32_t i = 0; i < h->_len; i++) {
+            if (str_keys) h->_small->_keys[i].as.ptr = __zn_str_own(h->_small->_keys[i].as.ptr);
+            if (str_vals) h->_small->_vals[i].as.ptr = __zn_str_own(h->_small->_vals[i].as.ptr);
+        }
+        return h;
+    }
+    if (!str_keys && !str_vals) return h;
+    for (int32_t i = 0; i < h->_cap; i++) {
+        for (ZnHashEntry *e = h->_buckets[i]; e; e = e->next) {
+            if (str_keys) e->key.as.ptr = __zn_str_own(e->key.as.ptr);
+            if (str_vals) e->value.as.ptr = __zn_str_own(e->value.as.ptr);
+        }
+    }
+    return h;
+}
+
+static ZnArray *__zn_shared_own_arr(ZnArray *a, bool is_str) {
+    __zn_shared_own(a);
+    if (is_str) {
+        for (int32_t i = 0; i < a->_len; i++) a->_data[i].as.ptr = __zn_str_own(a->_data[i].as.ptr);
+    }
+    return a;
+}
+
+static ZnShared *__zn_shared_alloc(void *v, ZnElemFn release) {
+    ZnShared *s = __zn_sync_alloc(sizeof(ZnShared));
+    atomic_init(&s->_cur, v);
+    s->_release = release;
+    return s;
+}
+
+static void __zn_shared_retain(ZnShared *s) { __zn_sync_retain(s); }
+
+/* Whoever drops the last reference is the only one left to read */
+static void __zn_shared_release(ZnShared *s) {
+    if (!s || atomic_fetch_sub_explicit(&s->_rc, 1, memory_order_acq_rel) != 1) return;
+    s->_release(atomic_load_explicit(&s->_cur, memory_order_relaxed));
+    free(s);
+}
+
+/* Swap in v, then free the old version after a grace period. Publishers
+ * need no lock between them: each frees only the version it replaced. */
+static void __zn_shared_publish(ZnShared *s, void *v) {
+    void *old = atomic_exchange(&s->_cur, v);
+    __zn_ebr_synchronize(atomic_fetch_add(&__zn_ebr_epoch, 1) + 1);
+    s->_release(old);
+}
+
+/* Lookups copy a String out, as ConcurrentHash does; a miss reads as the
+ * zero value */
+static ZnValue __zn_shared_hash_get(ZnShared *s, ZnValue key, bool str_vals) {
+    ZnHash *h = __zn_shared_pin(s);
+    ZnValue *v = __zn_hash_find(h, key);
+    ZnValue r;
+    if (v) r = __zn_chash_copy(*v, str_vals);
+    else if (str_vals) r = __zn_val_string((ZnString*)&__zn_chash_empty_str);
+    else { r.tag = ZN_TAG_INT; r.as.i = 0; }
+    __zn_shared_unpin();
+    return r;
+}
+
+static bool __zn_shared_hash_contains(ZnShared *s, ZnValue key) {
+    ZnHash *h = __zn_shared_pin(s);
+    bool found = __zn_hash_find(h, key) != NULL;
+    __zn_shared_unpin();
+    return found;
+}
+
+static int64_t __zn_shared_hash_len(ZnShared *s) {
+    int64_t n = ((ZnHash*)__zn_shared_pin(s))->_len;
+    __zn_shared_unpin();
+    return n;
+}
+
+static ZnValue __zn_shared_arr_get(ZnShared *s, int64_t idx, bool is_str) {
+    ZnValue r = __zn_chash_copy(__zn_arr_get(__zn_shared_pin(s), idx), is_str);
+    __zn_shared_unpin();
+    return r;
+}
+
+static int64_t __zn_shared_arr_len(ZnShared *s) {
+    int64_t n = ((ZnArray*)__zn_shared_pin(s))->_len;
+    __zn_shared_unpin();
+    return n;
+}
+
+/* --- Threadlocal globals --- */
+
+/* The program points __zn_tls_exit at a function that releases the
+ * calling thread's threadlocal globals. A thread that initializes one
+ * calls __zn_tls_track, so the function runs when the thread exits; the
+ * main thread does not run key destructors, so the program calls it
+ * from its atexit handler instead. */
+static void (*__zn_tls_exit)(void);
+static pthread_key_t __zn_tls_key;
+static pthread_once_t __zn_tls_once = PTHREAD_ONCE_INIT;
+
+static void __zn_tls_key_exit(void *p) {
+    (void)p;
+    __zn_tls_exit();
+}
+
+static void __zn_tls_key_init(void) {
+    pthread_key_create(&__zn_tls_key, __zn_tls_key_exit);
+}
+
+static void __zn_tls_track(void) {
+    pthread_once(&__zn_tls_once, __zn_tls_key_init);
+    pthread_setspecific(__zn_tls_key, (void*)1);
 }
 
 /* Wrapper to cast __zn_str_retain/release for use as ZnElemFn */
@@ -282,5 +3865,39 @@ static void __zn_arr_retain_v(void *p) { __zn_arr_retain((ZnArray*)p); }
 static void __zn_arr_release_v(void *p) { __zn_arr_release((ZnArray*)p); }
 static void __zn_hash_retain_v(void *p) { __zn_hash_retain((ZnHash*)p); }
 static void __zn_hash_release_v(void *p) { __zn_hash_release((ZnHash*)p); }
+static void __zn_rope_retain_v(void *p) { __zn_rope_retain((ZnRope*)p); }
+static void __zn_rope_release_v(void *p) { __zn_rope_release((ZnRope*)p); }
+static void __zn_heap_retain_v(void *p) { __zn_heap_retain((ZnHeap*)p); }
+static void __zn_heap_release_v(void *p) { __zn_heap_release((ZnHeap*)p); }
+static void __zn_deque_retain_v(void *p) { __zn_deque_retain((ZnDeque*)p); }
+static void __zn_deque_release_v(void *p) { __zn_deque_release((ZnDeque*)p); }
+static void __zn_bitset_retain_v(void *p) { __zn_bitset_retain((ZnBitset*)p); }
+static void __zn_bitset_release_v(void *p) { __zn_bitset_release((ZnBitset*)p); }
+static void __zn_omap_retain_v(void *p) { __zn_omap_retain((ZnOrderedMap*)p); }
+static void __zn_omap_release_v(void *p) { __zn_omap_release((ZnOrderedMap*)p); }
+static void __zn_trie_retain_v(void *p) { __zn_trie_retain((ZnTrie*)p); }
+static void __zn_trie_release_v(void *p) { __zn_trie_release((ZnTrie*)p); }
+static void __zn_lru_retain_v(void *p) { __zn_lru_retain((ZnLruCache*)p); }
+static void __zn_lru_release_v(void *p) { __zn_lru_release((ZnLruCache*)p); }
+static void __zn_sidx_retain_v(void *p) { __zn_sidx_retain((ZnSortedIndex*)p); }
+static void __zn_sidx_release_v(void *p) { __zn_sidx_release((ZnSortedIndex*)p); }
+static void __zn_mat_retain_v(void *p) { __zn_mat_retain((ZnMatrix*)p); }
+static void __zn_mat_release_v(void *p) { __zn_mat_release((ZnMatrix*)p); }
+static void __zn_slotmap_retain_v(void *p) { __zn_slotmap_retain((ZnSlotMap*)p); }
+static void __zn_slotmap_release_v(void *p) { __zn_slotmap_release((ZnSlotMap*)p); }
+static void __zn_chash_retain_v(void *p) { __zn_chash_retain((ZnConcurrentHash*)p); }
+static void __zn_chash_release_v(void *p) { __zn_chash_release((ZnConcurrentHash*)p); }
+static void __zn_atomic_retain_v(void *p) { __zn_sync_retain(p); }
+static void __zn_atomic_release_v(void *p) { __zn_sync_release(p); }
+static void __zn_mutex_retain_v(void *p) { __zn_sync_retain(p); }
+static void __zn_mutex_release_v(void *p) { __zn_sync_release(p); }
+static void __zn_rwlock_retain_v(void *p) { __zn_sync_retain(p); }
+static void __zn_rwlock_release_v(void *p) { __zn_sync_release(p); }
+static void __zn_once_retain_v(void *p) { __zn_sync_retain(p); }
+static void __zn_once_release_v(void *p) { __zn_sync_release(p); }
+static void __zn_barrier_retain_v(void *p) { __zn_sync_retain(p); }
+static void __zn_barrier_release_v(void *p) { __zn_sync_release(p); }
+static void __zn_shared_retain_v(void *p) { __zn_shared_retain((ZnShared*)p); }
+static void __zn_shared_release_v(void *p) { __zn_shared_release((ZnShared*)p); }
 
 #endif